@@ -0,0 +1,465 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "BatchFiles.hpp"
+#include <cerrno>
+#include <mutex>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef IO_URING_OP_SUPPORTED // Headers of Linux 5.6, with the opcodes probe.
+#define TGAAC_HAS_IO_URING
+#endif
+#endif
+
+#ifdef TGAAC_HAS_IO_URING
+
+/// Minimal io_uring, with the rings mapped as described by io_uring_setup(2).
+struct batch_writer::uring
+{
+    int fd = -1;
+    io_uring_params params{};
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe* cqes;
+    unsigned tail;         ///< Of the submission queue, published by SubmitAndWait().
+    unsigned nbQueued = 0; ///< Not submitted yet.
+
+    explicit uring(unsigned entries)
+    {
+        fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            throw ::runtime_error("io_uring_setup: {}", strerror(errno));
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        auto funcMap = [&](size_t size, off_t offset) {
+            void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd, offset);
+            if (ptr == MAP_FAILED)
+                throw ::runtime_error("io_uring mmap: {}", strerror(errno));
+            return ptr;
+        };
+        sqRing = funcMap(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = singleMap ? sqRing : funcMap(cqRingSize, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*)funcMap(params.sq_entries * sizeof(io_uring_sqe),
+                                      IORING_OFF_SQES);
+
+        auto funcField = [](void* ring, uint32_t offset) {
+            return (unsigned*)((char*)ring + offset);
+        };
+        sqTail = funcField(sqRing, params.sq_off.tail);
+        sqMask = funcField(sqRing, params.sq_off.ring_mask);
+        sqArray = funcField(sqRing, params.sq_off.array);
+        cqHead = funcField(cqRing, params.cq_off.head);
+        cqTail = funcField(cqRing, params.cq_off.tail);
+        cqMask = funcField(cqRing, params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
+        tail = *sqTail;
+    }
+
+    /// io_uring_setup() succeeds on kernels which lack some operations, such as 5.1 to
+    /// 5.5 without OPENAT and CLOSE.
+    bool Supports(std::initializer_list<uint8_t> opcodes) const
+    {
+        constexpr unsigned NB_PROBED = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) +
+                                  NB_PROBED * sizeof(io_uring_probe_op));
+        auto* probe = (io_uring_probe*)storage.data();
+        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                      NB_PROBED) < 0)
+            return false;
+        return std::ranges::all_of(opcodes, [&](uint8_t opcode) {
+            return opcode <= probe->last_op &&
+                   (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+        });
+    }
+
+    ~uring()
+    {
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            ::munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            ::munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    /// The caller must not queue more than params.sq_entries before SubmitAndWait().
+    io_uring_sqe& Queue(uint64_t userData)
+    {
+        unsigned index = tail & *sqMask;
+        sqArray[index] = index;
+        io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = userData;
+        ++tail;
+        ++nbQueued;
+        return sqe;
+    }
+
+    /// Submits the queued operations, then calls func(cqe) for 'nbCompletions' of them.
+    template <typename F>
+    void SubmitAndWait(unsigned nbCompletions, F&& func)
+    {
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        unsigned nbToSubmit = std::exchange(nbQueued, 0);
+        while (true)
+        {
+            unsigned head = *cqHead;
+            unsigned available = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != available && nbCompletions > 0; ++head, --nbCompletions)
+                func(cqes[head & *cqMask]);
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            if (nbCompletions == 0 && nbToSubmit == 0)
+                return;
+
+            int nbSubmitted = (int)::syscall(__NR_io_uring_enter, fd, nbToSubmit,
+                                             nbCompletions, IORING_ENTER_GETEVENTS,
+                                             nullptr, 0);
+            if (nbSubmitted < 0 && errno != EINTR)
+                throw ::runtime_error("io_uring_enter: {}", strerror(errno));
+            if (nbSubmitted > 0)
+                nbToSubmit -= nbSubmitted;
+        }
+    }
+};
+
+#else
+
+struct batch_writer::uring
+{
+};
+
+#endif
+
+static void CloseDirectory(int fd)
+{
+#ifndef _WIN32
+    if (fd >= 0)
+        ::close(fd);
+#endif
+}
+
+batch_writer::batch_writer(size_t batchSize, [[maybe_unused]] bool useIoUring)
+    : m_batchSize{std::max<size_t>(1, batchSize)}
+{
+#ifdef TGAAC_HAS_IO_URING
+    // Old kernels, or io_uring disabled by sysctl or seccomp, use the threads.
+    if (useIoUring)
+    {
+        try
+        {
+            // A chunk needs one entry per file to open, then two to write and close.
+            m_ring = std::make_unique<uring>(2 * MAX_OPEN_FILES);
+            if (!m_ring->Supports({IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE}))
+                m_ring.reset();
+        }
+        catch (std::exception const&)
+        {
+        }
+    }
+#endif
+}
+
+batch_writer::~batch_writer()
+{
+    for (directory const& dir : m_directories)
+        CloseDirectory(dir.fd);
+}
+
+void batch_writer::Write(fs::path const& p, std::string content)
+{
+    fs::path parent = p.parent_path();
+    if (m_directories.empty() || m_directories.back().path != parent)
+    {
+#ifdef _WIN32
+        int fd = -1;
+#else
+        int fd = ::open(parent.empty() ? "." : parent.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            throw ::runtime_error("Could not open directory {}: {}", parent.string(),
+                                  strerror(errno));
+#endif
+        m_directories.push_back({std::move(parent), fd});
+    }
+    m_pending.push_back(
+        {m_directories.size() - 1, p.filename().string(), std::move(content)});
+    if (m_pending.size() >= m_batchSize)
+        WriteBatch();
+}
+
+void batch_writer::Flush()
+{
+    if (!m_pending.empty())
+        WriteBatch();
+    for (directory const& dir : m_directories)
+        CloseDirectory(dir.fd);
+    m_directories.clear();
+
+    if (!m_error.empty())
+        throw ::runtime_error("{}", std::exchange(m_error, {}));
+}
+
+void batch_writer::WriteBatch()
+{
+#ifdef TGAAC_HAS_IO_URING
+    if (m_ring)
+        WriteBatchUring();
+    else
+#endif
+        WriteBatchThreads();
+    m_pending.clear();
+
+    // Only the directory of the next files is kept open.
+    if (m_directories.size() > 1)
+    {
+        for (size_t i = 0; i + 1 < m_directories.size(); ++i)
+            CloseDirectory(m_directories[i].fd);
+        m_directories.erase(m_directories.begin(), m_directories.end() - 1);
+    }
+}
+
+void batch_writer::SetError(pending_file const& file, std::string_view what, int error)
+{
+    if (m_error.empty())
+        m_error = fmt::format("Could not {} {}: {}", what,
+                              (m_directories[file.directory].path / file.name).string(),
+                              strerror(error));
+}
+
+#ifdef TGAAC_HAS_IO_URING
+
+void batch_writer::WriteBatchUring()
+{
+    constexpr int OPEN_FLAGS = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    std::vector<int> fds(m_pending.size(), -1);
+    for (size_t begin = 0; begin < m_pending.size(); begin += MAX_OPEN_FILES)
+    {
+        size_t end = std::min(begin + MAX_OPEN_FILES, m_pending.size());
+
+        // Files are opened first, as a write can only be linked to a known descriptor.
+        bool isUnsupported = false;
+        for (size_t i = begin; i < end; ++i)
+        {
+            io_uring_sqe& sqe = m_ring->Queue(i);
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = m_directories[m_pending[i].directory].fd;
+            sqe.addr = (uint64_t)m_pending[i].name.c_str();
+            sqe.len = 0644;
+            sqe.open_flags = OPEN_FLAGS;
+        }
+        m_ring->SubmitAndWait(end - begin, [&](io_uring_cqe const& cqe) {
+            if (cqe.res >= 0)
+                fds[cqe.user_data] = cqe.res;
+            else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+                isUnsupported = true;
+            else
+                SetError(m_pending[cqe.user_data], "create", -cqe.res);
+        });
+
+        // Despite the probe, the ring cannot open files: the threads write this chunk
+        // and the next ones, the files already opened being truncated again. The files
+        // of the previous chunks were closed by the ring, and their numbers may have
+        // been reused since.
+        if (isUnsupported)
+        {
+            for (size_t i = begin; i < end; ++i)
+                if (fds[i] >= 0)
+                    ::close(fds[i]);
+            m_ring.reset();
+            m_pending.erase(m_pending.begin(), m_pending.begin() + begin);
+            WriteBatchThreads();
+            return;
+        }
+
+        // Then each write is followed by its close. A failed write cancels the close.
+        unsigned nbOps = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (fds[i] < 0)
+                continue;
+            std::string const& content = m_pending[i].content;
+            io_uring_sqe& write = m_ring->Queue(2 * i);
+            write.opcode = IORING_OP_WRITE;
+            write.flags = IOSQE_IO_LINK;
+            write.fd = fds[i];
+            write.addr = (uint64_t)content.data();
+            write.len = content.size();
+            io_uring_sqe& close = m_ring->Queue(2 * i + 1);
+            close.opcode = IORING_OP_CLOSE;
+            close.fd = fds[i];
+            nbOps += 2;
+        }
+        m_ring->SubmitAndWait(nbOps, [&](io_uring_cqe const& cqe) {
+            size_t i = cqe.user_data / 2;
+            bool isWrite = cqe.user_data % 2 == 0;
+            if (isWrite && cqe.res >= 0 && size_t(cqe.res) != m_pending[i].content.size())
+                SetError(m_pending[i], "write", EIO); // Short write, on a full disk.
+            else if (isWrite && cqe.res < 0)
+                SetError(m_pending[i], "write", -cqe.res);
+            else if (!isWrite && cqe.res == -ECANCELED)
+                ::close(fds[i]);
+            else if (!isWrite && cqe.res < 0)
+                SetError(m_pending[i], "close", -cqe.res);
+        });
+    }
+}
+
+#endif
+
+void batch_writer::WriteBatchThreads()
+{
+    constexpr unsigned NB_THREADS = 4;
+
+    // Each file records its own error, so that the threads do not share anything.
+    std::vector<std::pair<char const*, int>> errors(m_pending.size());
+    ParallelFor(
+        m_pending.size(),
+        [&](size_t i) {
+            pending_file const& file = m_pending[i];
+#ifdef _WIN32
+            fs::path path = m_directories[file.directory].path / file.name;
+            std::FILE* out = OpenFile(path, true);
+            if (!out)
+            {
+                errors[i] = {"create", errno};
+                return;
+            }
+            if (std::fwrite(file.content.data(), 1, file.content.size(), out) !=
+                file.content.size())
+                errors[i] = {"write", errno != 0 ? errno : EIO};
+            if (std::fclose(out) != 0 && !errors[i].first)
+                errors[i] = {"close", errno};
+#else
+            int fd = ::openat(m_directories[file.directory].fd, file.name.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                errors[i] = {"create", errno};
+                return;
+            }
+            for (size_t written = 0; written < file.content.size();)
+            {
+                ssize_t n = ::write(fd, file.content.data() + written,
+                                    file.content.size() - written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    errors[i] = {"write", n < 0 ? errno : EIO};
+                    break;
+                }
+                written += n;
+            }
+            if (::close(fd) != 0 && !errors[i].first)
+                errors[i] = {"close", errno};
+#endif
+        },
+        NB_THREADS);
+
+    for (size_t i = 0; i < m_pending.size(); ++i)
+        if (errors[i].first)
+            SetError(m_pending[i], errors[i].first, errors[i].second);
+}
+
+batch_reader::batch_reader(fs::path const& dir, std::span<std::string const> names,
+                           unsigned nbThreads)
+{
+#ifndef _WIN32
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0)
+        throw ::runtime_error("Could not open directory {}: {}", dir.string(),
+                              strerror(errno));
+    auto funcClose = [](int* fd) { ::close(*fd); };
+    std::unique_ptr<int, decltype(funcClose)> dirGuard{&dirFd, funcClose};
+#endif
+
+    // Each file records its own error, so that the threads do not share anything.
+    std::vector<std::pair<char const*, int>> errors(names.size());
+    m_files.resize(names.size());
+    ParallelFor(
+        names.size(),
+        [&](size_t i) {
+#ifdef _WIN32
+            fs::path path = dir / names[i];
+            std::unique_ptr<std::FILE, decltype(&std::fclose)> in{OpenFile(path, false),
+                                                                  &std::fclose};
+            if (!in)
+            {
+                errors[i] = {"open", errno};
+                return;
+            }
+            struct _stat64 st;
+            if (::_fstat64(::_fileno(in.get()), &st) != 0)
+            {
+                errors[i] = {"stat", errno};
+                return;
+            }
+            std::string& content = m_files[i];
+            content.resize(st.st_size);
+            if (std::fread(content.data(), 1, content.size(), in.get()) != content.size())
+                errors[i] = {"read", std::ferror(in.get()) ? errno : EIO};
+#else
+            int fd = ::openat(dirFd, names[i].c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                errors[i] = {"open", errno};
+                return;
+            }
+            std::unique_ptr<int, decltype(funcClose)> fdGuard{&fd, funcClose};
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                errors[i] = {"stat", errno};
+                return;
+            }
+            std::string& content = m_files[i];
+            content.resize(st.st_size);
+            for (size_t nbRead = 0; nbRead < content.size();)
+            {
+                ssize_t n = ::read(fd, content.data() + nbRead, content.size() - nbRead);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    errors[i] = {"read", n < 0 ? errno : EIO}; // Truncated meanwhile.
+                    return;
+                }
+                nbRead += n;
+            }
+#endif
+        },
+        nbThreads);
+
+    for (size_t i = 0; i < names.size(); ++i)
+        if (errors[i].first)
+            throw ::runtime_error("Could not {} {}: {}", errors[i].first,
+                                  (dir / names[i]).string(), strerror(errors[i].second));
+}
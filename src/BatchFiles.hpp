@@ -0,0 +1,80 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_BATCH_FILES_HPP
+#define JV_TGAAC_BATCH_FILES_HPP
+
+#include "Utility.hpp"
+
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Writes many small files with batched system calls. Each directory is opened once,
+/// and its files are opened relative to it. A batch is submitted through io_uring, a
+/// few files at a time, when the kernel supports it, else its files are written by a
+/// few threads. On Windows, the threads open the files by their path instead.
+/// Files are only complete after Flush(), which throws the first error.
+/// Not thread-safe: each thread should have its own writer.
+class batch_writer
+{
+    struct uring;
+    struct pending_file
+    {
+        size_t directory; ///< Index in m_directories.
+        std::string name;
+        std::string content;
+    };
+    struct directory
+    {
+        fs::path path;
+        int fd; ///< -1 on Windows.
+    };
+
+    /// Files opened at once by the ring, a batch being written by chunks.
+    static constexpr size_t MAX_OPEN_FILES = 32;
+
+    std::unique_ptr<uring> m_ring;
+    std::vector<directory> m_directories;
+    std::vector<pending_file> m_pending;
+    size_t m_batchSize;
+    std::string m_error;
+
+    void WriteBatch();
+    void WriteBatchUring();
+    void WriteBatchThreads();
+    void SetError(pending_file const& file, std::string_view what, int error);
+
+  public:
+    /// Queues up to 'batchSize' files before writing them.
+    explicit batch_writer(size_t batchSize = 256, bool useIoUring = true);
+    /// Files not flushed are discarded.
+    ~batch_writer();
+    batch_writer(batch_writer const&) = delete;
+    batch_writer& operator=(batch_writer const&) = delete;
+
+    bool UsesIoUring() const noexcept { return m_ring != nullptr; }
+
+    /// The directory must exist. Files are created or truncated.
+    void Write(fs::path const& p, std::string content);
+    void Flush();
+};
+
+/// Reads whole files of a directory concurrently. Each file is opened relative to the
+/// directory, sized by fstat(), read and closed by the same task, so that each thread
+/// has at most one file open. On Windows, each file is opened by its path.
+class batch_reader
+{
+    std::vector<std::string> m_files;
+
+  public:
+    batch_reader(fs::path const& dir, std::span<std::string const> names,
+                 unsigned nbThreads = 4);
+
+    size_t Count() const noexcept { return m_files.size(); }
+    std::string_view operator[](size_t i) const noexcept { return m_files[i]; }
+};
+
+#endif
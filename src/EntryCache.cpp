@@ -0,0 +1,77 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "EntryCache.hpp"
+
+entry_cache::entry_cache(int64_t maxBytes, size_t nbShards)
+    : m_shards(nbShards), m_maxShardBytes{maxBytes / int64_t(nbShards)}
+{
+}
+
+entry_cache::value entry_cache::GetOrLoad(uint64_t key, int64_t size,
+                                          std::function<std::string()> const& load)
+{
+    // Consecutive keys, like the entries of an ARC file, go to different shards.
+    shard& shard = m_shards[((key * 0x9E3779B97F4A7C15) >> 32) % m_shards.size()];
+
+    std::shared_future<value> cached;
+    std::promise<value> promise;
+    uint64_t loadID = 0;
+    bool isKept = size <= m_maxShardBytes;
+    {
+        std::lock_guard lock{shard.mutex};
+        if (auto it = shard.slots.find(key); it != shard.slots.end())
+        {
+            ++m_hits;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruIt);
+            cached = it->second.future;
+        }
+        else
+        {
+            ++m_misses;
+            loadID = shard.nextLoadID++;
+            if (isKept)
+            {
+                shard.lru.push_front(key);
+                shard.slots.emplace(key, slot{promise.get_future().share(), size,
+                                              loadID, shard.lru.begin()});
+                shard.bytes += size;
+            }
+            // Evicted buffers stay valid for the threads still holding them.
+            while (shard.bytes > m_maxShardBytes)
+            {
+                auto evicted = shard.slots.find(shard.lru.back());
+                shard.bytes -= evicted->second.size;
+                shard.slots.erase(evicted);
+                shard.lru.pop_back();
+            }
+        }
+    }
+    // Waits for the thread loading it, and rethrows its error.
+    if (cached.valid())
+        return cached.get();
+
+    try
+    {
+        value result = std::make_shared<std::string const>(load());
+        promise.set_value(result);
+        return result;
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+        if (isKept)
+        {
+            // Forgotten, so that it is loaded again next time.
+            std::lock_guard lock{shard.mutex};
+            auto it = shard.slots.find(key);
+            if (it != shard.slots.end() && it->second.loadID == loadID)
+            {
+                shard.bytes -= it->second.size;
+                shard.lru.erase(it->second.lruIt);
+                shard.slots.erase(it);
+            }
+        }
+        throw;
+    }
+}
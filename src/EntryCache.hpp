@@ -0,0 +1,62 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_ENTRY_CACHE_HPP
+#define JV_TGAAC_ENTRY_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Bounded LRU cache of immutable buffers, shared by threads. The keys are spread
+/// over shards with their own lock and LRU list, so that threads reading different
+/// buffers rarely wait for each other. A missing buffer is loaded by a single thread,
+/// the others asking for it meanwhile wait for its result.
+class entry_cache
+{
+  public:
+    using value = std::shared_ptr<std::string const>;
+
+    /// 'maxBytes' is divided between the shards. Larger buffers are not kept.
+    explicit entry_cache(int64_t maxBytes, size_t nbShards = 16);
+    entry_cache(entry_cache const&) = delete;
+    entry_cache& operator=(entry_cache const&) = delete;
+
+    /// Returns the buffer of 'key', calling load() if it is not cached.
+    /// 'size' is the one of the loaded buffer, known before loading it.
+    value GetOrLoad(uint64_t key, int64_t size, std::function<std::string()> const& load);
+
+    uint64_t Hits() const noexcept { return m_hits; }
+    uint64_t Misses() const noexcept { return m_misses; }
+
+  private:
+    struct slot
+    {
+        std::shared_future<value> future;
+        int64_t size;
+        uint64_t loadID; ///< Identifies the load, in case of eviction meanwhile.
+        std::list<uint64_t>::iterator lruIt;
+    };
+    struct shard
+    {
+        std::mutex mutex;
+        std::list<uint64_t> lru; ///< Most recently used first.
+        std::unordered_map<uint64_t, slot> slots;
+        int64_t bytes = 0;
+        uint64_t nextLoadID = 0;
+    };
+
+    std::vector<shard> m_shards;
+    int64_t m_maxShardBytes;
+    std::atomic<uint64_t> m_hits = 0;
+    std::atomic<uint64_t> m_misses = 0;
+};
+
+#endif
@@ -0,0 +1,205 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_FILE_SCHEMA_HPP
+#define JV_TGAAC_FILE_SCHEMA_HPP
+
+/// This file contains the description of on-disk records (always little-endian),
+/// used to decode and encode arrays of them in bulk, with validation.
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <tuple>
+
+#include "Utility.hpp"
+
+/// One field of an on-disk record: the host member, and its offset in the file
+/// and in the host struct. Use JV_SCHEMA_FIELD() to declare one.
+template <auto Member>
+struct schema_field
+{
+    size_t fileOffset;
+    size_t hostOffset;
+};
+
+#define JV_SCHEMA_FIELD(Struct, member, fileOffset)                                      \
+    schema_field<&Struct::member>{fileOffset, offsetof(Struct, member)}
+
+/// Specialized for each on-disk record, next to its definition, with:
+/// - 'static constexpr size_t size' the byte size in the file,
+/// - 'static constexpr std::tuple fields' the schema_field of each member,
+///   in file order and without gap,
+/// - optionally 'static void Validate(T const&, TStream&)' called on each record
+///   by ReadRecords(), which reports errors with TStream::Error().
+template <typename T>
+struct file_schema;
+
+/// Compile-time check that the fields cover exactly the record, in file order.
+template <typename T>
+constexpr bool IsValidSchema();
+
+/// Whether records can be copied as-is between the file and the host.
+template <typename T>
+constexpr bool IsHostLayout();
+
+/// Decodes records from 'bytes', which must be of size 'out.size() * schema.size'.
+template <typename T>
+void DecodeRecords(std::string_view bytes, std::span<T> out);
+
+/// Encodes records to 'out', which must be of size 'in.size() * schema.size'.
+template <typename T>
+void EncodeRecords(std::span<T const> in, std::span<char> out);
+
+/// Decodes and validates records with one bounded read from 'in'.
+template <typename T, typename TReader>
+void ReadRecords(TReader& in, std::span<T> out);
+
+/// Encodes records and writes them with one write to 'out'.
+template <typename T, typename TWriter>
+void WriteRecords(TWriter& out, std::span<T const> in);
+
+//
+// ==================== IMPLEMENTATION ====================
+//
+
+namespace detail
+{
+template <typename T>
+struct member_traits;
+
+template <typename C, typename M>
+struct member_traits<M C::*>
+{
+    using type = M;
+};
+
+template <auto Member>
+using member_t = typename member_traits<decltype(Member)>::type;
+
+/// Byte-swaps integers and arrays of integers, in-place.
+template <typename M>
+void ByteSwap(M& value)
+{
+    if constexpr (std::is_array_v<M>)
+    {
+        for (auto& element : value)
+            ByteSwap(element);
+    }
+    else if constexpr (std::is_integral_v<M> && sizeof(M) > 1)
+    {
+        auto bytes = std::bit_cast<std::array<uint8_t, sizeof(M)>>(value);
+        std::ranges::reverse(bytes);
+        value = std::bit_cast<M>(bytes);
+    }
+}
+
+template <typename T, typename F>
+constexpr void ForEachField(F&& func)
+{
+    auto funcApply = [&](auto const&... fields) { (func(fields), ...); };
+    std::apply(funcApply, file_schema<T>::fields);
+}
+} // namespace detail
+
+template <typename T>
+constexpr bool IsValidSchema()
+{
+    size_t offset = 0;
+    bool valid = true;
+    detail::ForEachField<T>([&]<auto Member>(schema_field<Member> const& field) {
+        valid = valid && field.fileOffset == offset;
+        offset += sizeof(detail::member_t<Member>);
+    });
+    return valid && offset == file_schema<T>::size;
+}
+
+template <typename T>
+constexpr bool IsHostLayout()
+{
+    bool same = (std::endian::native == std::endian::little);
+    same = same && sizeof(T) == file_schema<T>::size;
+    detail::ForEachField<T>([&](auto const& field) {
+        same = same && field.fileOffset == field.hostOffset;
+    });
+    return same;
+}
+
+template <typename T>
+void DecodeRecords(std::string_view bytes, std::span<T> out)
+{
+    static_assert(std::is_trivial_v<T>);
+    static_assert(IsValidSchema<T>(), "fields do not cover exactly the record");
+    constexpr size_t size = file_schema<T>::size;
+
+    if constexpr (IsHostLayout<T>())
+    {
+        memcpy(out.data(), bytes.data(), out.size_bytes());
+        return;
+    }
+
+    // Field-major loops, so that byte-swapping of a field is vectorizable.
+    detail::ForEachField<T>([&]<auto Member>(schema_field<Member> const& field) {
+        using M = detail::member_t<Member>;
+        for (size_t i = 0; i < out.size(); ++i)
+            memcpy(&(out[i].*Member), bytes.data() + i * size + field.fileOffset,
+                   sizeof(M));
+        if constexpr (std::endian::native == std::endian::big)
+            for (size_t i = 0; i < out.size(); ++i)
+                detail::ByteSwap(out[i].*Member);
+    });
+}
+
+template <typename T>
+void EncodeRecords(std::span<T const> in, std::span<char> out)
+{
+    static_assert(std::is_trivial_v<T>);
+    static_assert(IsValidSchema<T>(), "fields do not cover exactly the record");
+    constexpr size_t size = file_schema<T>::size;
+
+    if constexpr (IsHostLayout<T>())
+    {
+        memcpy(out.data(), in.data(), in.size_bytes());
+        return;
+    }
+
+    detail::ForEachField<T>([&]<auto Member>(schema_field<Member> const& field) {
+        using M = detail::member_t<Member>;
+        for (size_t i = 0; i < in.size(); ++i)
+        {
+            M value;
+            memcpy(&value, &(in[i].*Member), sizeof(M));
+            if constexpr (std::endian::native == std::endian::big)
+                detail::ByteSwap(value);
+            memcpy(out.data() + i * size + field.fileOffset, &value, sizeof(M));
+        }
+    });
+}
+
+template <typename T, typename TReader>
+void ReadRecords(TReader& in, std::span<T> out)
+{
+    constexpr size_t size = file_schema<T>::size;
+    DecodeRecords(in.ReadView(out.size() * size), out);
+
+    if constexpr (requires(T const& rec) { file_schema<T>::Validate(rec, in); })
+        for (T const& rec : out)
+            file_schema<T>::Validate(rec, in);
+}
+
+template <typename T, typename TWriter>
+void WriteRecords(TWriter& out, std::span<T const> in)
+{
+    if constexpr (IsHostLayout<T>())
+    {
+        out.Write(in);
+    }
+    else
+    {
+        std::string bytes(in.size() * file_schema<T>::size, '\0');
+        EncodeRecords(in, std::span{bytes});
+        out.Write(std::span{bytes});
+    }
+}
+
+#endif
@@ -0,0 +1,28 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "MemoryBudget.hpp"
+
+void memory_budget::Acquire(int64_t bytes)
+{
+    std::unique_lock lock{m_mutex};
+    m_released.wait(lock, [&] {
+        return m_usedBytes == 0 || m_retainedBytes + m_usedBytes + bytes <= m_maxBytes;
+    });
+    m_usedBytes += bytes;
+}
+
+void memory_budget::Retain(int64_t bytes)
+{
+    std::lock_guard lock{m_mutex};
+    m_retainedBytes += bytes;
+}
+
+void memory_budget::Release(int64_t bytes)
+{
+    {
+        std::lock_guard lock{m_mutex};
+        m_usedBytes -= bytes;
+    }
+    m_released.notify_all();
+}
@@ -0,0 +1,33 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_MEMORY_BUDGET_HPP
+#define JV_TGAAC_MEMORY_BUDGET_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/// Makes threads wait until the bytes they need fit in a memory budget.
+/// A request larger than the whole budget still runs, but alone.
+class memory_budget
+{
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    int64_t m_maxBytes;
+    int64_t m_usedBytes = 0;
+    int64_t m_retainedBytes = 0;
+
+  public:
+    explicit memory_budget(int64_t maxBytes) : m_maxBytes{maxBytes} {}
+
+    int64_t MaxBytes() const noexcept { return m_maxBytes; }
+
+    void Acquire(int64_t bytes);
+    void Release(int64_t bytes);
+    /// Charges the growth of results kept until the end, without waiting: the next
+    /// requests have less room, down to running alone.
+    void Retain(int64_t bytes);
+};
+
+#endif
@@ -0,0 +1,26 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "StringPool.hpp"
+
+std::string_view string_pool::Intern(std::string_view str)
+{
+    ++m_internedCount;
+    m_internedBytes += str.size();
+
+    auto it = m_views.find(str);
+    if (it != m_views.end())
+        return *it;
+
+    m_uniqueBytes += str.size();
+    std::string_view view = m_storage.emplace_back(str);
+    m_views.insert(view);
+    return view;
+}
+
+int64_t string_pool::MemoryUsage() const noexcept
+{
+    // Each string has a hash table node (view, next pointer and cached hash).
+    constexpr int64_t perString = sizeof(std::string) + sizeof(std::string_view) + 16;
+    return m_uniqueBytes + int64_t(m_storage.size()) * perString;
+}
@@ -0,0 +1,35 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_STRING_POOL_HPP
+#define JV_TGAAC_STRING_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+/// Hash-consing of strings: equal strings are stored only once, so interned views
+/// can be compared by their data() pointer. Views are valid as long as the pool.
+class string_pool
+{
+    std::deque<std::string> m_storage;
+    std::unordered_set<std::string_view> m_views;
+    size_t m_internedCount = 0;
+    int64_t m_internedBytes = 0;
+    int64_t m_uniqueBytes = 0;
+
+  public:
+    std::string_view Intern(std::string_view str);
+
+    size_t UniqueCount() const noexcept { return m_storage.size(); }
+    int64_t UniqueBytes() const noexcept { return m_uniqueBytes; }
+    /// Approximate heap size, with the string and hash table overheads.
+    int64_t MemoryUsage() const noexcept;
+    size_t InternedCount() const noexcept { return m_internedCount; }
+    int64_t InternedBytes() const noexcept { return m_internedBytes; }
+};
+
+#endif
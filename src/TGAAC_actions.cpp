@@ -2,49 +2,227 @@
 // Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
 
 #include "TGAAC_actions.hpp"
+#include "BatchFiles.hpp"
+#include "MemoryBudget.hpp"
 #include "TGAAC_file_ARC.hpp"
 #include "TGAAC_file_GMD.hpp"
+#include "TGAAC_search.hpp"
+#include "TGAAC_verify.hpp"
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <optional>
+#include <set>
+#include <thread>
+#include <unordered_map>
 
 static constexpr std::string_view META_FILE = "__meta__.xml";
+static constexpr std::string_view SEARCH_FILE = "__search__.bin";
+static constexpr std::string_view MANIFEST_FILE = "__manifest__.jsonl";
+static constexpr std::string_view JOURNAL_FILE = "__journal__.txt";
+static constexpr std::string_view REPACK_FILE = "__repack__.txt";
 
-void TGAAC_WriteFolder_ARC(ARC_Archive const& arc, fs::path const& outFolder)
+void TGAAC_DedupWriter::Write(fs::path const& path, std::string_view content,
+                              batch_writer* writer)
 {
-    CreateEmptyDirectory(outFolder);
+    std::unique_lock lock{m_mutex};
+    std::string_view interned = m_contents.Intern(content);
+    auto [it, inserted] =
+        m_paths.try_emplace(interned.data(), stored_file{path, writer == nullptr});
+    if (!inserted && !it->second.isWritten)
+    {
+        m_pendingLinks.emplace_back(interned, path);
+        return;
+    }
+    if (!inserted)
+    {
+        std::error_code error;
+        fs::create_hard_link(it->second.path, path, error);
+        if (!error)
+        {
+            ++m_nbLinks;
+            return;
+        }
+    }
+    lock.unlock();
+    if (writer)
+        writer->Write(path, std::string(content));
+    else
+        stream_ptr{path, std::ios::out}.Write(std::span{content});
+}
 
-    pugi::xml_document xmlMeta;
+void TGAAC_DedupWriter::RenameFolder(fs::path const& from, fs::path const& to)
+{
+    // Compared by components, as separators differ on Windows.
+    auto funcIsInside = [&](fs::path const& path) {
+        fs::path relative = path.lexically_relative(from);
+        return !relative.empty() && *relative.begin() != "..";
+    };
+
+    std::lock_guard lock{m_mutex};
+    for (auto& [content, file] : m_paths)
+        if (funcIsInside(file.path))
+            file.isWritten = true;
+
+    std::erase_if(m_pendingLinks, [&](auto const& pending) {
+        auto const& [content, path] = pending;
+        if (!funcIsInside(path))
+            return false;
+        stored_file const& file = m_paths.at(content.data());
+        std::error_code error;
+        if (file.isWritten)
+            fs::create_hard_link(file.path, path, error);
+        if (file.isWritten && !error)
+            ++m_nbLinks;
+        else
+            stream_ptr{path, std::ios::out}.Write(std::span{content});
+        return true;
+    });
+
+    fs::rename(from, to);
+    for (auto& [content, file] : m_paths)
+        if (funcIsInside(file.path))
+            file.path = to / file.path.lexically_relative(from);
+}
+
+void TGAAC_DedupWriter::PrintStats() const
+{
+    double ratio = m_contents.UniqueBytes() > 0 ? double(m_contents.InternedBytes()) /
+                                                      m_contents.UniqueBytes()
+                                                : 1.0;
+    fmt::print("Dedup: {} files with {} unique contents ({} hardlinks), "
+               "{} bytes written instead of {} (ratio {:.2f})\n",
+               m_contents.InternedCount(), m_contents.UniqueCount(), m_nbLinks,
+               m_contents.UniqueBytes(), m_contents.InternedBytes(), ratio);
+}
+
+int64_t TGAAC_DedupWriter::MemoryUsage()
+{
+    std::lock_guard lock{m_mutex};
+    int64_t bytes = m_contents.MemoryUsage();
+    for (auto const& [content, file] : m_paths)
+        bytes += sizeof(content) + sizeof(file) + 16 + file.path.native().capacity();
+    for (auto const& [content, path] : m_pendingLinks)
+        bytes += sizeof(content) + sizeof(path) + path.native().capacity();
+    return bytes;
+}
+
+/// Writes the folder of a GMD entry, and its node in the ARC metafile.
+static void WriteEntryFolder(ARC_Entry const& entry, std::string_view gmdBytes,
+                             pugi::xml_node xmlEntries, fs::path const& outFolder,
+                             TGAAC_ExtractOptions const& options)
+{
+    std::string entryFolder = "gmd__" + ConvertToID(entry.filename);
+    pugi::xml_node xmlEntry = xmlEntries.append_child("GMD_Entry");
+    xmlEntry.append_attribute("key").set_value(entry.filename.c_str());
+    xmlEntry.append_attribute("file").set_value(entryFolder.c_str());
+    xmlEntry.append_child("ext").text().set((uint32_t)entry.ext);
+    xmlEntry.append_child("isCompressed").text().set(entry.isCompressed);
+    xmlEntry.append_child("unknownFlags").text().set(entry.unknownFlags);
+
+    // Cached so that repacking gives the same compressed bytes.
+    if (entry.isCompressed)
+    {
+        if (std::optional<ARC_DeflateParams> params = ARC_Entry::DetectDeflateParams(
+                gmdBytes, entry.content, options.deflateThreads))
+        {
+            pugi::xml_node xmlDeflate = xmlEntry.append_child("deflate");
+            xmlDeflate.append_attribute("level").set_value(params->level);
+            xmlDeflate.append_attribute("windowBits").set_value(params->windowBits);
+            xmlDeflate.append_attribute("memLevel").set_value(params->memLevel);
+            xmlDeflate.append_attribute("strategy").set_value(params->strategy);
+        }
+    }
+
+    span_reader gmdStream{entry.filename, gmdBytes};
+    GMD_Registry gmd;
+    gmd.Load(gmdStream);
+    TGAAC_WriteFolder_GMD(gmd, outFolder / entryFolder, options);
+
+    if (options.onGmdEntry)
+        for (GMD_Entry const& gmdEntry : gmd.entries)
+            options.onGmdEntry(entry.filename, gmdEntry);
+}
+
+/// Creates the ARC metafile, without entries.
+static pugi::xml_node CreateArchiveMeta(pugi::xml_document& xmlMeta, uint16_t version,
+                                        bool hasExtendedNames)
+{
     pugi::xml_node xmlRoot = xmlMeta.append_child("ARC_Archive");
+    xmlRoot.append_child("version").text().set(version);
+    xmlRoot.append_child("hasExtendedNames").text().set(hasExtendedNames);
+    return xmlRoot.append_child("entries");
+}
 
-    xmlRoot.append_child("version").text().set(arc.version);
-    xmlRoot.append_child("hasExtendedNames").text().set(arc.hasExtendedNames);
+void TGAAC_WriteFolder_ARC(ARC_Archive const& arc, fs::path const& outFolder,
+                           TGAAC_ExtractOptions const& options)
+{
+    CreateEmptyDirectory(outFolder);
 
-    pugi::xml_node xmlEntries = xmlRoot.append_child("entries");
+    pugi::xml_document xmlMeta;
+    pugi::xml_node xmlEntries =
+        CreateArchiveMeta(xmlMeta, arc.version, arc.hasExtendedNames);
 
     for (ARC_Entry const& entry : arc.entries)
     {
         if (entry.ext != ARC_ExtensionHash::GMD)
             continue;
 
-        std::string entryFolder = "gmd__" + ConvertToID(entry.filename);
-        pugi::xml_node xmlEntry = xmlEntries.append_child("GMD_Entry");
-        xmlEntry.append_attribute("key").set_value(entry.filename.c_str());
-        xmlEntry.append_attribute("file").set_value(entryFolder.c_str());
-        xmlEntry.append_child("ext").text().set((uint32_t)entry.ext);
-        xmlEntry.append_child("isCompressed").text().set(entry.isCompressed);
-        xmlEntry.append_child("unknownFlags").text().set(entry.unknownFlags);
-
         std::string gmdBytes =
             entry.isCompressed ? ARC_Entry::Decompress(entry.content, entry.decompSize)
                                : entry.content;
-        stream_ptr gmdStream{entry.filename, gmdBytes};
-        GMD_Registry gmd;
-        gmd.Load(gmdStream);
-        TGAAC_WriteFolder_GMD(gmd, outFolder / entryFolder);
+        WriteEntryFolder(entry, gmdBytes, xmlEntries, outFolder, options);
+    }
+
+    xmlMeta.save_file((outFolder / META_FILE).string().c_str());
+}
+
+void TGAAC_ExtractArchive(fs::path const& arcFile, fs::path const& outFolder,
+                          TGAAC_ExtractOptions const& options)
+{
+    CreateEmptyDirectory(outFolder);
+
+    file_reader arcStream{arcFile};
+    ARC_Archive arc;
+    std::vector<ARC_TocEntry> toc = arc.LoadTOC(arcStream);
+
+    pugi::xml_document xmlMeta;
+    pugi::xml_node xmlEntries =
+        CreateArchiveMeta(xmlMeta, arc.version, arc.hasExtendedNames);
+
+    for (ARC_TocEntry const& tocEntry : toc)
+    {
+        if (tocEntry.ext != ARC_ExtensionHash::GMD)
+            continue;
+
+        // Compressed and decompressed bytes, then the GMD strings and the files.
+        int64_t estimatedBytes = tocEntry.compSize + 4 * int64_t(tocEntry.decompSize);
+        if (options.budget)
+            options.budget->Acquire(estimatedBytes);
+        try
+        {
+            ARC_Entry entry = ARC_Archive::LoadEntry(arcStream, tocEntry);
+            std::string gmdBytes =
+                entry.isCompressed
+                    ? ARC_Entry::Decompress(entry.content, entry.decompSize)
+                    : std::move(entry.content);
+            WriteEntryFolder(entry, gmdBytes, xmlEntries, outFolder, options);
+        }
+        catch (...)
+        {
+            if (options.budget)
+                options.budget->Release(estimatedBytes);
+            throw;
+        }
+        if (options.budget)
+            options.budget->Release(estimatedBytes);
     }
 
     xmlMeta.save_file((outFolder / META_FILE).string().c_str());
 }
 
-void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder)
+void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder,
+                           TGAAC_ExtractOptions const& options)
 {
     CreateEmptyDirectory(outFolder);
 
@@ -56,6 +234,8 @@ void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder)
     xmlRoot.append_child("language").text().set(gmd.language);
     xmlRoot.append_child("name").text().set(gmd.name.c_str());
     xmlRoot.append_child("_padding").text().set(gmd._padding);
+    if (options.escapeJV)
+        xmlRoot.append_child("escape").text().set("JV");
 
     pugi::xml_node xmlEntries = xmlRoot.append_child("entries");
     for (GMD_Entry const& entry : gmd.entries)
@@ -65,14 +245,22 @@ void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder)
         xmlEntry.append_attribute("key").set_value(entry.key.c_str());
         xmlEntry.append_attribute("file").set_value(entryFilename.c_str());
 
-        stream_ptr{outFolder / entryFilename, std::ios::out}.Write(
-            std::span{entry.value});
+        std::string content =
+            options.escapeJV ? GMD_EscapeEntryJV(entry.value) : entry.value;
+        if (options.dedup)
+            options.dedup->Write(outFolder / entryFilename, content, options.writer);
+        else if (options.writer)
+            options.writer->Write(outFolder / entryFilename, std::move(content));
+        else
+            stream_ptr{outFolder / entryFilename, std::ios::out}.Write(
+                std::span{content});
     }
 
     xmlMeta.save_file((outFolder / META_FILE).string().c_str());
 }
 
-void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder)
+void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder,
+                          bool parallelDeflate)
 {
     arc = {};
 
@@ -88,14 +276,29 @@ void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder)
     arc.version = xmlRoot.child("version").text().as_ullong();
     arc.hasExtendedNames = xmlRoot.child("hasExtendedNames").text().as_bool();
 
-    pugi::xml_node xmlEntries = xmlRoot.child("entries");
-    for (auto xmlEntry = xmlEntries.first_child(); xmlEntry;
-         xmlEntry = xmlEntry.next_sibling())
+    std::vector<pugi::xml_node> xmlEntries;
+    for (pugi::xml_node xmlEntry : xmlRoot.child("entries").children())
+        xmlEntries.push_back(xmlEntry);
+
+    // The next GMD folder is read while the current one is serialized and compressed,
+    // unless the other cores are already busy with other ARC files.
+    std::launch policy =
+        IsParallelWorker() ? std::launch::deferred : std::launch::async;
+    auto funcReadGMD = [&](size_t i) {
+        fs::path gmdFolder = inFolder / xmlEntries[i].attribute("file").value();
+        return std::async(policy, [gmdFolder] {
+            GMD_Registry gmd;
+            TGAAC_ReadFolder_GMD(gmd, gmdFolder);
+            return gmd;
+        });
+    };
+    std::future<GMD_Registry> nextGMD;
+    for (size_t i = 0; i < xmlEntries.size(); ++i)
     {
+        pugi::xml_node xmlEntry = xmlEntries[i];
         auto& entry = arc.entries.emplace_back();
 
         entry.filename = xmlEntry.attribute("key").value();
-        std::string entryFolder = xmlEntry.attribute("file").value();
         entry.ext = (ARC_ExtensionHash)xmlEntry.child("ext").text().as_ullong();
         entry.isCompressed = xmlEntry.child("isCompressed").text().as_bool();
         entry.unknownFlags = xmlEntry.child("unknownFlags").text().as_ullong();
@@ -103,18 +306,33 @@ void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder)
         if (entry.ext != ARC_ExtensionHash::GMD)
             throw runtime_error("Unsupported entry extension {}", (uint32_t)entry.ext);
 
-        GMD_Registry gmd;
-        TGAAC_ReadFolder_GMD(gmd, inFolder / entryFolder);
-        stream_ptr gmdOut = {entry.filename, std::string{}};
-        gmd.Save(gmdOut);
-
-        std::string_view gmdBytes = dynamic_cast<std::stringbuf&>(*gmdOut.get()).view();
+        if (i == 0)
+            nextGMD = funcReadGMD(0);
+        GMD_Registry gmd = nextGMD.get();
+        if (i + 1 < xmlEntries.size())
+            nextGMD = funcReadGMD(i + 1);
+        std::string gmdBytes = gmd.Save();
         entry.decompSize = gmdBytes.size();
 
-        if (entry.isCompressed)
-            entry.content = ARC_Entry::Compress(gmdBytes);
+        // Without cached parameters, deflateInit() ones are used.
+        ARC_DeflateParams params;
+        if (pugi::xml_node xmlDeflate = xmlEntry.child("deflate"))
+        {
+            auto funcInt = [&](char const* name, int& value) {
+                value = xmlDeflate.attribute(name).as_int(value);
+            };
+            funcInt("level", params.level);
+            funcInt("windowBits", params.windowBits);
+            funcInt("memLevel", params.memLevel);
+            funcInt("strategy", params.strategy);
+        }
+
+        if (entry.isCompressed && parallelDeflate)
+            entry.content = ARC_Entry::CompressParallel(gmdBytes, params);
+        else if (entry.isCompressed)
+            entry.content = ARC_Entry::Compress(gmdBytes, params);
         else
-            entry.content = gmdBytes;
+            entry.content = std::move(gmdBytes);
     }
 }
 
@@ -137,23 +355,206 @@ void TGAAC_ReadFolder_GMD(GMD_Registry& gmd, fs::path const& inFolder)
     gmd.language = xmlRoot.child("language").text().as_ullong();
     gmd.name = xmlRoot.child("name").text().as_string();
     gmd._padding = xmlRoot.child("_padding").text().as_ullong();
+    bool escapeJV = xmlRoot.child("escape").text().as_string() == std::string_view{"JV"};
 
+    std::vector<std::string> entryFilenames;
     pugi::xml_node xmlEntries = xmlRoot.child("entries");
     for (auto xmlEntry = xmlEntries.first_child(); xmlEntry;
          xmlEntry = xmlEntry.next_sibling())
     {
-        std::string key = xmlEntry.attribute("key").value();
-        std::string entryFilename = xmlEntry.attribute("file").value();
+        gmd.entries.emplace_back().key = xmlEntry.attribute("key").value();
+        entryFilenames.emplace_back(xmlEntry.attribute("file").value());
+    }
 
-        auto& entry = gmd.entries.emplace_back();
-        entry.key = std::move(key);
-        entry.value = stream_ptr{inFolder / entryFilename}.ReadAll();
+    batch_reader entryFiles{inFolder, entryFilenames};
+    for (size_t i = 0; i < gmd.entries.size(); ++i)
+    {
+        if (!escapeJV)
+        {
+            gmd.entries[i].value = entryFiles[i];
+            continue;
+        }
+        try
+        {
+            gmd.entries[i].value = GMD_UnescapeEntryJV(entryFiles[i]);
+        }
+        catch (std::exception const& e)
+        {
+            throw runtime_error("{}: {}", (inFolder / entryFilenames[i]).string(),
+                                e.what());
+        }
     }
 }
 
-void TGAAC_GlobalExtract(fs::path const& installFolder, fs::path const& extractFolder)
+/// ARC files completed by the runs of a global action, one per line, with an optional
+/// stamp of their inputs. An ARC file is only recorded once its output has been
+/// renamed in place, so a run which is interrupted never leaves a partial output
+/// marked as done.
+class BatchJournal
 {
-    CreateEmptyDirectory(extractFolder);
+    std::mutex m_mutex;
+    fs::path m_path;
+    std::unordered_map<std::string, std::string> m_done;       ///< Stamps by ARC file.
+    std::vector<std::pair<std::string, std::string>> m_marked; ///< By this run.
+
+  public:
+    explicit BatchJournal(fs::path path) : m_path{std::move(path)}
+    {
+        if (!fs::exists(m_path))
+        {
+            stream_ptr{m_path, std::ios::out};
+            return;
+        }
+        // The last line of an ARC file is the most recent one.
+        file_reader in{m_path};
+        std::string line;
+        while (in.ReadLine(line))
+        {
+            size_t tab = line.find('\t');
+            if (tab == line.npos)
+                m_done.insert_or_assign(line, "");
+            else
+                m_done.insert_or_assign(line.substr(0, tab), line.substr(tab + 1));
+        }
+    }
+
+    /// Only reads the journal of the previous runs, can be called from several threads.
+    bool IsDone(std::string const& name, fs::path const& output,
+                std::string_view stamp = {}) const
+    {
+        auto it = m_done.find(name);
+        return it != m_done.end() && it->second == stamp && fs::exists(output);
+    }
+
+    void MarkDone(std::string const& name, std::string_view stamp = {})
+    {
+        std::lock_guard lock{m_mutex};
+        std::string line = name;
+        if (!stamp.empty())
+            (line += '\t') += stamp;
+        line += '\n';
+        stream_ptr out{m_path, std::ios::out | std::ios::app};
+        out.Write(std::span{line});
+        out.Sync();
+        m_marked.emplace_back(name, stamp);
+    }
+
+    /// Once all ARC files are done, the next run starts from scratch.
+    void Remove()
+    {
+        fs::remove(m_path);
+    }
+
+    /// Rewrites the journal with only the last line of each ARC file.
+    void Compact()
+    {
+        if (m_marked.empty())
+            return;
+        for (auto& [name, stamp] : m_marked)
+            m_done.insert_or_assign(std::move(name), std::move(stamp));
+        m_marked.clear();
+
+        std::vector<std::pair<std::string, std::string>> lines(m_done.begin(),
+                                                                m_done.end());
+        std::ranges::sort(lines);
+        std::string content;
+        for (auto const& [name, stamp] : lines)
+            content += fmt::format("{}\t{}\n", name, stamp);
+
+        fs::path tmpPath = m_path;
+        tmpPath += ".tmp";
+        {
+            file_writer out{tmpPath};
+            out.Write(std::span{content});
+            out.Sync();
+        }
+        fs::rename(tmpPath, m_path);
+    }
+};
+
+/// Size and modification time of a file, empty if it does not exist.
+static std::string FileStamp(fs::path const& path)
+{
+    std::error_code error;
+    fs::directory_entry file{path, error};
+    if (error || !file.exists())
+        return {};
+    return fmt::format("{}:{}:{}\n", path.generic_string(), file.file_size(),
+                       file.last_write_time().time_since_epoch().count());
+}
+
+/// Files from which a repacked ARC file is built: the original ARC file, and all the
+/// files of its extracted folder. In the manner of make, a file modified, added or
+/// removed changes their stamp.
+static std::string RepackInputsStamp(fs::path const& arcFile, fs::path const& arcFolder)
+{
+    std::vector<fs::path> files;
+    for (fs::directory_entry const& file : fs::recursive_directory_iterator(arcFolder))
+        if (file.is_regular_file())
+            files.push_back(file.path());
+    std::ranges::sort(files);
+
+    std::string stamp = FileStamp(arcFile);
+    for (fs::path const& file : files)
+        stamp += FileStamp(file);
+    return stamp;
+}
+
+/// Recorded for each repacked ARC file, with the output itself, so that an output
+/// modified or removed since is also built again.
+static std::string RepackStamp(std::string_view inputsStamp, fs::path const& outFile)
+{
+    std::string stamp{inputsStamp};
+    stamp += FileStamp(outFile);
+    return fmt::format("{:016x}", std::hash<std::string>{}(stamp));
+}
+
+/// Calls func(xmlEntry, gmdFolder) for each GMD entry of an extracted ARC folder.
+template <typename F>
+static void ForEachGmdFolder(fs::path const& arcFolder, F&& func)
+{
+    pugi::xml_document xmlArcMeta;
+    pugi::xml_parse_result result =
+        xmlArcMeta.load_file((arcFolder / META_FILE).string().c_str());
+    if (!result)
+        throw runtime_error("ARC meta error: {} at {}", result.description(),
+                            result.offset);
+
+    pugi::xml_node xmlEntries = xmlArcMeta.child("ARC_Archive").child("entries");
+    for (pugi::xml_node xmlEntry : xmlEntries.children("GMD_Entry"))
+        func(xmlEntry, arcFolder / xmlEntry.attribute("file").value());
+}
+
+/// Memory needed by TGAAC_GlobalExtract() for an ARC file: its largest GMD entry being
+/// extracted, and its lines kept until merged, about 3 times the size of the GMDs.
+static int64_t EstimateExtractBytes(fs::path const& arcFile)
+{
+    file_reader arcStream{arcFile};
+    ARC_Archive arc;
+    int64_t entryBytes = 0;
+    int64_t linesBytes = 0;
+    for (ARC_TocEntry const& tocEntry : arc.LoadTOC(arcStream))
+    {
+        if (tocEntry.ext != ARC_ExtensionHash::GMD)
+            continue;
+        // Like TGAAC_ExtractArchive().
+        entryBytes =
+            std::max(entryBytes, tocEntry.compSize + 4 * int64_t(tocEntry.decompSize));
+        linesBytes += 3 * int64_t(tocEntry.decompSize);
+    }
+    return entryBytes + linesBytes;
+}
+
+TGAAC_BatchSummary TGAAC_GlobalExtract(fs::path const& installFolder,
+                                       fs::path const& extractFolder,
+                                       TGAAC_GlobalExtractOptions const& globalOptions)
+{
+    fs::path journalPath = extractFolder / JOURNAL_FILE;
+    if (fs::exists(journalPath))
+        fmt::print("Resuming the extraction into {}\n", extractFolder.string());
+    else
+        CreateEmptyDirectory(extractFolder);
+    BatchJournal journal{journalPath};
 
     std::unordered_map<std::string, fs::path> mapNamePath;
 
@@ -167,15 +568,516 @@ void TGAAC_GlobalExtract(fs::path const& installFolder, fs::path const& extractF
     }
 
     fmt::print("Found {} ARC files\n", mapNamePath.size());
+    std::vector<std::pair<std::string, fs::path>> archives(mapNamePath.begin(),
+                                                           mapNamePath.end());
+    std::ranges::sort(archives);
+
+    TGAAC_SearchIndex searchIndex;
+    TGAAC_DedupWriter dedup;
+
+    // With a budget, each ARC file is charged from its table of content, until merged,
+    // and the workers are limited to the ARC files which fit at once.
+    std::optional<memory_budget> budget;
+    std::vector<int64_t> archiveBytes(archives.size());
+    unsigned nbThreads = 0;
+    if (globalOptions.maxMemory > 0)
+    {
+        budget.emplace(globalOptions.maxMemory);
+        int64_t maxArchiveBytes = 1;
+        for (size_t i = 0; i < archives.size(); ++i)
+        {
+            try
+            {
+                fs::path const& arcPath = archives[i].second;
+                archiveBytes[i] = EstimateExtractBytes(installFolder / arcPath);
+            }
+            catch (std::exception const&)
+            {
+                // Reported when extracting it.
+            }
+            maxArchiveBytes = std::max(maxArchiveBytes, archiveBytes[i]);
+        }
+        int64_t nbFitting = globalOptions.maxMemory / maxArchiveBytes;
+        unsigned nbCores = std::max(1u, std::thread::hardware_concurrency());
+        nbThreads = std::clamp<int64_t>(nbFitting, 1, nbCores);
+    }
+
+    // Results of the ARC files are merged in order, so that the outputs do not depend
+    // on the scheduling. A task waits for the previous ones to be merged.
+    // Tasks are also admitted in the budget in order: the first one not merged yet
+    // never waits for the memory held by the next ones.
+    std::mutex mergeMutex;
+    std::condition_variable mergeTurn;
+    size_t nextAdmit = 0;
+    size_t nextMerge = 0;
+    auto funcAdmitInOrder = [&](size_t i) {
+        std::unique_lock lock{mergeMutex};
+        mergeTurn.wait(lock, [&] { return nextAdmit == i; });
+        lock.unlock(); // Merges release memory.
+        if (budget)
+            budget->Acquire(archiveBytes[i]);
+        lock.lock();
+        ++nextAdmit;
+        mergeTurn.notify_all();
+    };
+    auto funcMergeInOrder = [&](size_t i, auto const& funcMerge) {
+        std::unique_lock lock{mergeMutex};
+        mergeTurn.wait(lock, [&] { return nextMerge == i; });
+        // The turn passes even if merging throws, or the next tasks would wait forever.
+        struct pass_turn
+        {
+            std::function<void()> func;
+            ~pass_turn() { func(); }
+        } passTurn{[&] {
+            ++nextMerge;
+            if (budget)
+                budget->Release(archiveBytes[i]);
+            mergeTurn.notify_all();
+        }};
+        funcMerge();
+    };
+
+    TGAAC_BatchSummary summary;
+    std::vector<TGAAC_ArchiveHash> manifest;
+    std::vector<size_t> extracted; ///< Indices in 'archives', for the metafile.
+    int64_t retainedBytes = 0;
+    ParallelFor(archives.size(), [&](size_t i) {
+        auto const& [name, arcPath] = archives[i];
+        fs::path arcFolder = extractFolder / name;
+        fs::path tmpFolder = extractFolder / (name + ".tmp");
+        funcAdmitInOrder(i);
+
+        std::vector<std::pair<std::string, GMD_Entry>> lines;
+        batch_writer writer;
+        TGAAC_ExtractOptions options;
+        options.onGmdEntry = [&](std::string_view gmd, GMD_Entry const& entry) {
+            lines.emplace_back(std::string(gmd), entry);
+        };
+        options.dedup = globalOptions.dedup ? &dedup : nullptr;
+        options.writer = &writer;
+        options.escapeJV = globalOptions.escapeJV;
+        options.deflateThreads = 1; // ARC files are already extracted in parallel.
+
+        bool resumed = journal.IsDone(name, arcFolder);
+        std::string error;
+        TGAAC_ArchiveHash hash;
+        try
+        {
+            if (resumed)
+            {
+                // Lines are read back for the search index.
+                fmt::print("Already extracted {}\n", name);
+                ForEachGmdFolder(arcFolder, [&](pugi::xml_node xmlEntry,
+                                                fs::path const& gmdFolder) {
+                    GMD_Registry gmd;
+                    TGAAC_ReadFolder_GMD(gmd, gmdFolder);
+                    for (GMD_Entry const& entry : gmd.entries)
+                        options.onGmdEntry(xmlEntry.attribute("key").value(), entry);
+                });
+            }
+            else
+            {
+                // Leftovers of an interrupted run.
+                fs::remove_all(tmpFolder);
+                fs::remove_all(arcFolder);
+
+                fmt::print("Extracting {}...\n", name);
+                TGAAC_ExtractArchive(installFolder / arcPath, tmpFolder, options);
+                writer.Flush();
+                if (options.dedup)
+                    options.dedup->RenameFolder(tmpFolder, arcFolder);
+                else
+                    fs::rename(tmpFolder, arcFolder);
+                journal.MarkDone(name);
+            }
+            hash = TGAAC_HashArchive(installFolder / arcPath);
+            hash.archive = arcPath.generic_string();
+        }
+        catch (std::exception const& e)
+        {
+            error = e.what();
+            fmt::print("Failed to extract {}: {}\n", name, error);
+            std::error_code ignored;
+            fs::remove_all(tmpFolder, ignored);
+        }
+
+        funcMergeInOrder(i, [&] {
+            std::string arcKey = arcPath.generic_string();
+            if (!error.empty())
+            {
+                summary.failures.emplace_back(arcKey, error);
+                return;
+            }
+            ++(resumed ? summary.nbResumed : summary.nbDone);
+            manifest.push_back(std::move(hash));
+            extracted.push_back(i);
+            for (auto const& [gmd, entry] : lines)
+                searchIndex.Set(name, gmd, entry.key, entry.value);
+
+            if (budget)
+            {
+                int64_t bytes = searchIndex.MemoryUsage() +
+                                (options.dedup ? dedup.MemoryUsage() : 0);
+                budget->Retain(bytes - retainedBytes);
+                retainedBytes = bytes;
+            }
+        });
+    }, nbThreads);
+
+    // Create metafile, storing where each ARC file comes from.
+    pugi::xml_document xmlMeta;
+    pugi::xml_node xmlArchives =
+        xmlMeta.append_child("TGAAC_Install").append_child("archives");
+    for (size_t i : extracted)
+    {
+        pugi::xml_node xmlArchive = xmlArchives.append_child("ARC_Archive");
+        xmlArchive.append_attribute("key").set_value(
+            archives[i].second.generic_string().c_str());
+        xmlArchive.append_attribute("file").set_value(archives[i].first.c_str());
+    }
+
+
+    xmlMeta.save_file((extractFolder / META_FILE).string().c_str());
+    TGAAC_SaveManifest(TGAAC_ManifestPath(extractFolder), manifest);
+
+    searchIndex.Save(TGAAC_SearchIndexPath(extractFolder));
+    fmt::print("Indexed {} lines for search ({} unique)\n", searchIndex.Size(),
+               searchIndex.Values().UniqueCount());
+
+    if (globalOptions.dedup)
+        dedup.PrintStats();
+
+    fmt::print("Peak memory usage: {:.1f} MiB\n", PeakMemoryUsage() / 1048576.0);
+
+    if (summary.failures.empty())
+        journal.Remove();
+    return summary;
+}
+
+/// Writes the ARC file with the GMD entries of its extracted folder.
+static void RepackArchive(fs::path const& arcFile, fs::path const& arcFolder,
+                          fs::path const& outFile, bool parallelDeflate)
+{
+    file_reader arcStream{arcFile};
+    ARC_Archive arc;
+    arc.Load(arcStream);
+
+    ARC_Archive edited;
+    TGAAC_ReadFolder_ARC(edited, arcFolder, parallelDeflate);
+
+    std::unordered_map<std::string_view, ARC_Entry*> gmdEntries;
+    for (ARC_Entry& entry : arc.entries)
+        if (entry.ext == ARC_ExtensionHash::GMD)
+            gmdEntries.emplace(entry.filename, &entry);
+    for (ARC_Entry& editedEntry : edited.entries)
+    {
+        auto it = gmdEntries.find(editedEntry.filename);
+        if (it == gmdEntries.end())
+            throw runtime_error("No GMD entry {:?} in the original ARC file",
+                                editedEntry.filename);
+        *it->second = std::move(editedEntry);
+    }
+
+    fs::path tmpFile = outFile;
+    tmpFile += ".tmp";
+    fs::create_directories(outFile.parent_path());
+    {
+        file_writer out{tmpFile};
+        arc.Save(out);
+        out.Sync();
+    }
+    fs::rename(tmpFile, outFile);
+}
+
+TGAAC_BatchSummary TGAAC_GlobalRepack(fs::path const& installFolder,
+                                      fs::path const& extractFolder,
+                                      fs::path const& outFolder, bool parallelDeflate)
+{
+    pugi::xml_document xmlMeta;
+    pugi::xml_parse_result result =
+        xmlMeta.load_file((extractFolder / META_FILE).string().c_str());
+    if (!result)
+        throw runtime_error("Install meta error: {} at {}", result.description(),
+                            result.offset);
+
+    std::vector<std::pair<std::string, std::string>> archives; // Key and folder.
+    pugi::xml_node xmlArchives = xmlMeta.child("TGAAC_Install").child("archives");
+    for (pugi::xml_node xmlArchive : xmlArchives.children("ARC_Archive"))
+        archives.emplace_back(xmlArchive.attribute("key").value(),
+                              xmlArchive.attribute("file").value());
+
+    fs::create_directories(outFolder);
+    BatchJournal journal{outFolder / REPACK_FILE};
+
+    // One task per ARC file, each one with its own result to avoid locking.
+    std::vector<std::optional<std::string>> errors(archives.size());
+    std::vector<char> upToDate(archives.size());
+    ParallelFor(archives.size(), [&](size_t i) {
+        auto const& [arcKey, name] = archives[i];
+        fs::path outFile = outFolder / arcKey;
+        try
+        {
+            std::string inputsStamp =
+                RepackInputsStamp(installFolder / arcKey, extractFolder / name);
+            if (parallelDeflate) // Gives different bytes, so it is an input too.
+                inputsStamp += "parallel-deflate\n";
+            std::string stamp = RepackStamp(inputsStamp, outFile);
+            upToDate[i] = journal.IsDone(arcKey, outFile, stamp);
+            if (upToDate[i])
+                return;
+
+            fmt::print("Repacking {}...\n", arcKey);
+            RepackArchive(installFolder / arcKey, extractFolder / name, outFile,
+                          parallelDeflate);
+            journal.MarkDone(arcKey, RepackStamp(inputsStamp, outFile));
+        }
+        catch (std::exception const& e)
+        {
+            errors[i] = e.what();
+            fmt::print("Failed to repack {}: {}\n", arcKey, e.what());
+            std::error_code ignored;
+            fs::remove(outFile.string() + ".tmp", ignored);
+        }
+    });
+
+    TGAAC_BatchSummary summary;
+    for (size_t i = 0; i < archives.size(); ++i)
+    {
+        if (errors[i])
+            summary.failures.emplace_back(archives[i].first, std::move(*errors[i]));
+        else
+            ++(upToDate[i] ? summary.nbResumed : summary.nbDone);
+    }
+
+    journal.Compact();
+    return summary;
+}
+
+fs::path TGAAC_SearchIndexPath(fs::path const& extractFolder)
+{
+    return extractFolder / SEARCH_FILE;
+}
+
+fs::path TGAAC_ManifestPath(fs::path const& extractFolder)
+{
+    return extractFolder / MANIFEST_FILE;
+}
+
+size_t TGAAC_UpdateSearchIndex(fs::path const& extractFolder)
+{
+    fs::path indexFile = TGAAC_SearchIndexPath(extractFolder);
+    fs::file_time_type indexTime = fs::last_write_time(indexFile);
 
-    for (auto& [name, arcPath] : mapNamePath)
+    TGAAC_SearchIndex searchIndex;
+    searchIndex.Load(indexFile);
+
+    pugi::xml_document xmlMeta;
+    pugi::xml_parse_result result =
+        xmlMeta.load_file((extractFolder / META_FILE).string().c_str());
+    if (!result)
+        throw runtime_error("Install meta error: {} at {}", result.description(),
+                            result.offset);
+
+    // Only GMD folders with a file modified after the index are read again.
+    auto funcIsModified = [&](fs::path const& folder) {
+        for (fs::directory_entry const& file : fs::directory_iterator(folder))
+            if (file.last_write_time() > indexTime)
+                return true;
+        return false;
+    };
+
+    // Lines no longer in their GMD folder, or whose GMD folder is gone, are removed.
+    using GmdKey = std::pair<std::string, std::string>; // ARC folder and GMD.
+    std::map<GmdKey, bool> gmdFolders; ///< True if read again.
+    std::set<std::tuple<std::string, std::string, std::string>> readLines;
+
+    size_t nbChanged = 0;
+    pugi::xml_node xmlArchives = xmlMeta.child("TGAAC_Install").child("archives");
+    for (pugi::xml_node xmlArchive : xmlArchives.children("ARC_Archive"))
     {
-        fmt::print("Extracting {}...\n", name);
-        stream_ptr arcStream{installFolder / arcPath};
-        ARC_Archive arc;
-        arc.Load(arcStream);
-        TGAAC_WriteFolder_ARC(arc, extractFolder / name);
+        std::string arcName = xmlArchive.attribute("file").value();
+        ForEachGmdFolder(extractFolder / arcName, [&](pugi::xml_node xmlEntry,
+                                                      fs::path const& gmdFolder) {
+            std::string gmdName = xmlEntry.attribute("key").value();
+            bool isModified = funcIsModified(gmdFolder);
+            gmdFolders[{arcName, gmdName}] = isModified;
+            if (!isModified)
+                return;
+
+            GMD_Registry gmd;
+            TGAAC_ReadFolder_GMD(gmd, gmdFolder);
+            for (GMD_Entry const& entry : gmd.entries)
+            {
+                nbChanged += searchIndex.Set(arcName, gmdName, entry.key, entry.value);
+                readLines.emplace(arcName, gmdName, entry.key);
+            }
+        });
     }
 
-    throw runtime_error("TODO: __meta__.xml");
+    std::vector<std::tuple<std::string, std::string, std::string>> removedLines;
+    for (TGAAC_SearchHit const& line : searchIndex.Lines())
+    {
+        auto it = gmdFolders.find(GmdKey{line.archive, line.gmd});
+        if (it == gmdFolders.end() ||
+            (it->second && !readLines.contains({std::string(line.archive),
+                                                std::string(line.gmd),
+                                                std::string(line.key)})))
+            removedLines.emplace_back(line.archive, line.gmd, line.key);
+    }
+    for (auto const& [archive, gmd, key] : removedLines)
+        nbChanged += searchIndex.Remove(archive, gmd, key);
+
+    searchIndex.Save(indexFile);
+    return nbChanged;
+}
+
+/// Reports the differences of tags between the original and the edited value.
+static void LintLine(std::string_view original, std::string_view edited,
+                     std::function<void(std::string_view, std::string)> const& funcReport)
+{
+    if (original == edited)
+        return;
+
+    GMD_TagList before = GMD_ScanTags(original);
+    GMD_TagList after = GMD_ScanTags(edited);
+
+    if (after.unclosed && !before.unclosed)
+        funcReport("unclosed_tag", "");
+    if (after.pageCount != before.pageCount)
+        funcReport("page_count", fmt::format("{} <PAGE> instead of {}", after.pageCount,
+                                             before.pageCount));
+
+    std::vector<std::string_view> sortedBefore = before.tags;
+    std::vector<std::string_view> sortedAfter = after.tags;
+    std::ranges::sort(sortedBefore);
+    std::ranges::sort(sortedAfter);
+
+    std::vector<std::string_view> missing, extra;
+    std::ranges::set_difference(sortedBefore, sortedAfter, std::back_inserter(missing));
+    std::ranges::set_difference(sortedAfter, sortedBefore, std::back_inserter(extra));
+    for (std::string_view tag : missing)
+        funcReport("missing_tag", std::string(tag));
+    for (std::string_view tag : extra)
+        funcReport("extra_tag", std::string(tag));
+
+    if (missing.empty() && extra.empty() && before.tags != after.tags)
+        funcReport("tag_order", fmt::format("{} instead of {}", fmt::join(after.tags, ""),
+                                            fmt::join(before.tags, "")));
+}
+
+/// Lints all edited lines of one ARC file.
+static void LintArchive(fs::path const& installFolder, fs::path const& extractFolder,
+                        pugi::xml_node xmlArchive, std::vector<TGAAC_LintIssue>& issues)
+{
+    std::string arcPath = xmlArchive.attribute("key").value();
+    fs::path arcFolder = extractFolder / xmlArchive.attribute("file").value();
+
+    file_reader arcStream{installFolder / arcPath};
+    ARC_Archive arc;
+    std::vector<ARC_TocEntry> toc = arc.LoadTOC(arcStream);
+
+    pugi::xml_document xmlArcMeta;
+    pugi::xml_parse_result result =
+        xmlArcMeta.load_file((arcFolder / META_FILE).string().c_str());
+    if (!result)
+        throw runtime_error("ARC meta error: {} at {}", result.description(),
+                            result.offset);
+
+    std::unordered_map<std::string_view, std::string_view> gmdFolders;
+    pugi::xml_node xmlEntries = xmlArcMeta.child("ARC_Archive").child("entries");
+    for (pugi::xml_node xmlEntry : xmlEntries.children("GMD_Entry"))
+        gmdFolders.emplace(xmlEntry.attribute("key").value(),
+                           xmlEntry.attribute("file").value());
+
+    for (ARC_TocEntry const& tocEntry : toc)
+    {
+        auto it = gmdFolders.find(tocEntry.filename);
+        if (tocEntry.ext != ARC_ExtensionHash::GMD || it == gmdFolders.end())
+            continue;
+
+        std::string_view currentKey;
+        auto funcReport = [&](std::string_view check, std::string detail) {
+            issues.push_back({arcPath, tocEntry.filename, std::string(currentKey),
+                              std::string(check), std::move(detail)});
+        };
+
+        GMD_Registry edited;
+        try
+        {
+            TGAAC_ReadFolder_GMD(edited, arcFolder / it->second);
+        }
+        catch (std::exception const& e)
+        {
+            funcReport("read_error", e.what());
+            continue;
+        }
+
+        GMD_Registry original =
+            GMD_LoadArcEntry(ARC_Archive::LoadEntry(arcStream, tocEntry));
+
+        std::unordered_map<std::string_view, std::string_view> editedValues;
+        for (GMD_Entry const& editedEntry : edited.entries)
+            editedValues.emplace(editedEntry.key, editedEntry.value);
+
+        for (GMD_Entry const& originalEntry : original.entries)
+        {
+            currentKey = originalEntry.key;
+            auto editedIt = editedValues.find(originalEntry.key);
+            if (editedIt == editedValues.end())
+                funcReport("missing_line", "");
+            else
+                LintLine(originalEntry.value, editedIt->second, funcReport);
+        }
+    }
+}
+
+std::vector<TGAAC_LintIssue> TGAAC_Lint(fs::path const& installFolder,
+                                        fs::path const& extractFolder)
+{
+    pugi::xml_document xmlMeta;
+    pugi::xml_parse_result result =
+        xmlMeta.load_file((extractFolder / META_FILE).string().c_str());
+    if (!result)
+        throw runtime_error("Install meta error: {} at {}", result.description(),
+                            result.offset);
+
+    std::vector<pugi::xml_node> xmlArchives;
+    for (pugi::xml_node xmlArchive :
+         xmlMeta.child("TGAAC_Install").child("archives").children("ARC_Archive"))
+        xmlArchives.push_back(xmlArchive);
+
+    // One task per ARC file, each one with its own results to avoid locking.
+    std::vector<std::vector<TGAAC_LintIssue>> archiveIssues(xmlArchives.size());
+    ParallelFor(xmlArchives.size(), [&](size_t i) {
+        try
+        {
+            LintArchive(installFolder, extractFolder, xmlArchives[i], archiveIssues[i]);
+        }
+        catch (std::exception const& e)
+        {
+            // Like a missing ARC file or ARC metafile, the other ones are still linted.
+            archiveIssues[i].push_back({xmlArchives[i].attribute("key").value(), "", "",
+                                        "read_error", e.what()});
+        }
+    });
+
+    std::vector<TGAAC_LintIssue> issues;
+    for (auto& batch : archiveIssues)
+        std::ranges::move(batch, std::back_inserter(issues));
+    return issues;
+}
+
+void TGAAC_AppendLintIssueJSON(std::string& out, TGAAC_LintIssue const& issue)
+{
+    out += "{\"archive\":";
+    AppendJsonString(out, issue.archive);
+    out += ",\"gmd\":";
+    AppendJsonString(out, issue.gmd);
+    out += ",\"key\":";
+    AppendJsonString(out, issue.key);
+    out += ",\"check\":";
+    AppendJsonString(out, issue.check);
+    out += ",\"detail\":";
+    AppendJsonString(out, issue.detail);
+    out += "}\n";
 }
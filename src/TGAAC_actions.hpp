@@ -7,23 +7,155 @@
 /// This file contains the global actions done on the complete installation path.
 
 #include <functional>
+#include <mutex>
+#include <unordered_map>
 
+#include "StringPool.hpp"
 #include "Utility.hpp"
 
+class batch_writer;
+class memory_budget;
+struct GMD_Entry;
 struct GMD_Registry;
 struct ARC_Archive;
 
+/// Writes each unique file content only once: files with the same content
+/// are hardlinks to the first one (or copies if hardlinks are not supported).
+/// Note that editing a hardlinked file in-place modifies all its duplicates.
+/// Write() can be called from several threads.
+class TGAAC_DedupWriter
+{
+    struct stored_file
+    {
+        fs::path path;
+        bool isWritten; ///< False while queued in a batch_writer.
+    };
+
+    std::mutex m_mutex;
+    string_pool m_contents;
+    std::unordered_map<char const*, stored_file> m_paths; ///< By interned content.
+    /// Duplicates of files not written yet, with their interned content.
+    std::vector<std::pair<std::string_view, fs::path>> m_pendingLinks;
+    size_t m_nbLinks = 0;
+
+  public:
+    /// Unique contents are queued in 'writer' if not null. Then duplicates of files
+    /// not written yet are only linked by RenameFolder().
+    void Write(fs::path const& path, std::string_view content,
+               batch_writer* writer = nullptr);
+    /// Renames a folder once its writer is flushed, so that its files can still be
+    /// linked to. Its duplicates of files still queued elsewhere are written as copies.
+    void RenameFolder(fs::path const& from, fs::path const& to);
+    void PrintStats() const;
+    /// Approximate heap size of the contents and paths kept to link to.
+    int64_t MemoryUsage();
+};
+
+/// Optional outputs of the extraction.
+struct TGAAC_ExtractOptions
+{
+    /// If set, called with every extracted GMD_Entry and the name of its GMD.
+    std::function<void(std::string_view gmd, GMD_Entry const&)> onGmdEntry;
+    /// If not null, used to write entry files.
+    TGAAC_DedupWriter* dedup = nullptr;
+    /// If not null, queues entry files: the caller calls Flush(), then RenameFolder()
+    /// of 'dedup' if set.
+    batch_writer* writer = nullptr;
+    /// Write entry files with GMD_EscapeEntryJV(), recorded in the GMD metafile.
+    bool escapeJV = true;
+    /// If not null, TGAAC_ExtractArchive() waits for the memory of each entry.
+    memory_budget* budget = nullptr;
+    /// Threads probing the deflate parameters of each entry, 0 for all cores.
+    unsigned deflateThreads = 0;
+};
+
+/// Settings of TGAAC_GlobalExtract().
+struct TGAAC_GlobalExtractOptions
+{
+    bool dedup = false;    ///< Hardlink entry files with the same content.
+    bool escapeJV = true;  ///< See TGAAC_ExtractOptions::escapeJV.
+    int64_t maxMemory = 0; ///< Budget for the extraction and its results, 0 for none.
+};
+
 /// Serialize assets content on filesystem as separate files,
 /// to make editing easier and conflict-less.
 /// Note that only supported entries (which have an ARC_ExtensionHash
 /// enumerant value) will be extracted on filesystem.
 
-void TGAAC_WriteFolder_ARC(ARC_Archive const& arc, fs::path const& outFolder);
-void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder);
+void TGAAC_WriteFolder_ARC(ARC_Archive const& arc, fs::path const& outFolder,
+                           TGAAC_ExtractOptions const& options = {});
+void TGAAC_WriteFolder_GMD(GMD_Registry const& gmd, fs::path const& outFolder,
+                           TGAAC_ExtractOptions const& options = {});
+
+/// Same as ARC_Archive::Load() then TGAAC_WriteFolder_ARC(), but only one entry
+/// of the ARC file is in memory at a time.
+void TGAAC_ExtractArchive(fs::path const& arcFile, fs::path const& outFolder,
+                          TGAAC_ExtractOptions const& options = {});
 
-void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder);
+/// With 'parallelDeflate', large GMD entries are compressed by
+/// ARC_Entry::CompressParallel(), faster but not byte-identical to the original ones.
+void TGAAC_ReadFolder_ARC(ARC_Archive& arc, fs::path const& inFolder,
+                          bool parallelDeflate = false);
 void TGAAC_ReadFolder_GMD(GMD_Registry& gmd, fs::path const& inFolder);
 
-void TGAAC_GlobalExtract(fs::path const& installFolder, fs::path const& extractFolder);
+/// Outcome of TGAAC_GlobalExtract() and TGAAC_GlobalRepack().
+struct TGAAC_BatchSummary
+{
+    size_t nbDone = 0;    ///< ARC files processed by this run.
+    size_t nbResumed = 0; ///< ARC files already processed by a previous run.
+    /// ARC files, relative to the install folder, and their error.
+    std::vector<std::pair<std::string, std::string>> failures;
+};
+
+/// Extracts all ARC files in parallel, and writes the search index of all extracted
+/// lines and the manifest of the original ARC files. Prints the peak memory usage.
+/// Each ARC file is extracted in a temporary folder, renamed once complete and then
+/// recorded in a journal. A failed ARC file does not stop the others, and the journal
+/// is kept until all of them succeed: calling it again on the same extract folder
+/// resumes the extraction. Otherwise the extract folder must be empty.
+TGAAC_BatchSummary TGAAC_GlobalExtract(fs::path const& installFolder,
+                                       fs::path const& extractFolder,
+                                       TGAAC_GlobalExtractOptions const& options = {});
+
+/// Writes in the output folder all ARC files of the extract folder, with the edited
+/// GMD entries and the other entries of the original ARC file, in parallel.
+/// Like make, only the ARC files whose inputs changed are built: the output folder
+/// records the sizes and modification times of the original ARC file and of the
+/// files of its extracted folder. An interrupted repack resumes the same way.
+/// See TGAAC_ReadFolder_ARC() for 'parallelDeflate'.
+TGAAC_BatchSummary TGAAC_GlobalRepack(fs::path const& installFolder,
+                                      fs::path const& extractFolder,
+                                      fs::path const& outFolder,
+                                      bool parallelDeflate = false);
+
+/// Path of the search index written by TGAAC_GlobalExtract().
+fs::path TGAAC_SearchIndexPath(fs::path const& extractFolder);
+/// Path of the hashes of the original ARC files written by TGAAC_GlobalExtract(),
+/// see TGAAC_Verify().
+fs::path TGAAC_ManifestPath(fs::path const& extractFolder);
+
+/// Updates the search index with the GMD folders modified since it was saved, and
+/// removes the lines which are gone. Returns the number of lines which changed.
+size_t TGAAC_UpdateSearchIndex(fs::path const& extractFolder);
+
+/// A problem found by TGAAC_Lint() in an edited line.
+struct TGAAC_LintIssue
+{
+    std::string archive; ///< ARC file, relative to the install folder.
+    std::string gmd;     ///< GMD entry name in the ARC.
+    std::string key;     ///< Empty if the whole GMD folder could not be read.
+    /// One of: missing_tag, extra_tag, tag_order, page_count, unclosed_tag,
+    /// missing_line, read_error.
+    std::string check;
+    std::string detail;
+};
+
+/// Compares the tags of each edited line of the extract folder with the original line
+/// of the install folder. ARC files are checked in parallel, issues are in their order.
+std::vector<TGAAC_LintIssue> TGAAC_Lint(fs::path const& installFolder,
+                                        fs::path const& extractFolder);
+
+/// Appends the issue as a JSON object on one line.
+void TGAAC_AppendLintIssueJSON(std::string& out, TGAAC_LintIssue const& issue);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_diff.hpp"
+#include "TGAAC_file_ARC.hpp"
+#include "TGAAC_file_GMD.hpp"
+#include <optional>
+#include <unordered_map>
+
+/// One side of the comparison of an ARC file, which may be missing.
+struct DiffSide
+{
+    std::optional<file_reader> stream;
+    std::vector<ARC_TocEntry> toc;
+    std::unordered_map<std::string_view, ARC_TocEntry const*> gmdEntries;
+
+    DiffSide(fs::path const& arcPath)
+    {
+        if (!fs::exists(arcPath))
+            return;
+        stream.emplace(arcPath);
+        ARC_Archive arc;
+        toc = arc.LoadTOC(*stream);
+        for (ARC_TocEntry const& tocEntry : toc)
+            if (tocEntry.ext == ARC_ExtensionHash::GMD)
+                gmdEntries.emplace(tocEntry.filename, &tocEntry);
+    }
+
+    ARC_TocEntry const* Find(std::string_view filename) const
+    {
+        auto it = gmdEntries.find(filename);
+        return it == gmdEntries.end() ? nullptr : it->second;
+    }
+
+    ARC_Entry ReadEntry(ARC_TocEntry const* tocEntry)
+    {
+        return tocEntry ? ARC_Archive::LoadEntry(*stream, *tocEntry) : ARC_Entry{};
+    }
+};
+
+/// Compares the lines of two GMD by key, then their values.
+static void DiffGMD(GMD_Registry& oldGmd, GMD_Registry& newGmd,
+                    TGAAC_LineChange& change, std::vector<TGAAC_LineChange>& changes)
+{
+    std::unordered_map<std::string_view, GMD_Entry*> newEntries;
+    for (GMD_Entry& entry : newGmd.entries)
+        newEntries.emplace(entry.key, &entry);
+
+    for (GMD_Entry& oldEntry : oldGmd.entries)
+    {
+        auto it = newEntries.find(oldEntry.key);
+        change.key = oldEntry.key;
+        if (it == newEntries.end())
+        {
+            change.kind = TGAAC_LineChange::Kind::Removed;
+            change.oldValue = std::move(oldEntry.value);
+            change.newValue.clear();
+            changes.push_back(change);
+            continue;
+        }
+
+        GMD_Entry& newEntry = *it->second;
+        newEntries.erase(it);
+        if (oldEntry.value == newEntry.value)
+            continue;
+        change.kind = TGAAC_LineChange::Kind::Modified;
+        change.oldValue = std::move(oldEntry.value);
+        change.newValue = std::move(newEntry.value);
+        changes.push_back(change);
+    }
+
+    // Added lines, in the order of the new GMD.
+    for (GMD_Entry& newEntry : newGmd.entries)
+    {
+        if (!newEntries.contains(newEntry.key))
+            continue;
+        change.key = newEntry.key;
+        change.kind = TGAAC_LineChange::Kind::Added;
+        change.oldValue.clear();
+        change.newValue = std::move(newEntry.value);
+        changes.push_back(change);
+    }
+}
+
+static std::vector<TGAAC_LineChange> DiffArchive(fs::path const& oldFolder,
+                                                 fs::path const& newFolder,
+                                                 fs::path const& arcPath,
+                                                 TGAAC_DiffStats& stats)
+{
+    DiffSide oldSide{oldFolder / arcPath};
+    DiffSide newSide{newFolder / arcPath};
+
+    // GMD entries in the old order, then the added ones in the new order.
+    std::vector<std::string_view> filenames;
+    for (ARC_TocEntry const& tocEntry : oldSide.toc)
+        if (tocEntry.ext == ARC_ExtensionHash::GMD)
+            filenames.push_back(tocEntry.filename);
+    for (ARC_TocEntry const& tocEntry : newSide.toc)
+        if (tocEntry.ext == ARC_ExtensionHash::GMD && !oldSide.Find(tocEntry.filename))
+            filenames.push_back(tocEntry.filename);
+
+    std::vector<TGAAC_LineChange> changes;
+    TGAAC_LineChange change;
+    change.archive = arcPath.generic_string();
+
+    for (std::string_view filename : filenames)
+    {
+        ARC_TocEntry const* oldEntry = oldSide.Find(filename);
+        ARC_TocEntry const* newEntry = newSide.Find(filename);
+
+        // Compressed bytes are only compared when the table of content is the same.
+        ARC_Entry oldArcEntry = oldSide.ReadEntry(oldEntry);
+        ARC_Entry newArcEntry = newSide.ReadEntry(newEntry);
+        bool sameToc = oldEntry && newEntry && oldEntry->compSize == newEntry->compSize &&
+                       oldEntry->decompSize == newEntry->decompSize &&
+                       oldEntry->isCompressed == newEntry->isCompressed;
+        if (sameToc && oldArcEntry.content == newArcEntry.content)
+        {
+            ++stats.nbSameEntries;
+            continue;
+        }
+
+        ++stats.nbInflatedEntries;
+        GMD_Registry oldGmd = oldEntry ? GMD_LoadArcEntry(oldArcEntry) : GMD_Registry{};
+        GMD_Registry newGmd = newEntry ? GMD_LoadArcEntry(newArcEntry) : GMD_Registry{};
+        change.gmd = filename;
+        DiffGMD(oldGmd, newGmd, change, changes);
+    }
+    return changes;
+}
+
+std::vector<TGAAC_LineChange> TGAAC_Diff(fs::path const& oldFolder,
+                                         fs::path const& newFolder,
+                                         TGAAC_DiffStats* stats)
+{
+    std::vector<fs::path> arcPaths;
+    for (fs::path const& folder : {oldFolder, newFolder})
+        for (fs::path const& p : fs::recursive_directory_iterator(folder))
+            if (p.extension() == ".arc")
+                arcPaths.push_back(fs::relative(p, folder));
+    std::ranges::sort(arcPaths);
+    arcPaths.erase(std::unique(arcPaths.begin(), arcPaths.end()), arcPaths.end());
+
+    // One task per ARC file, each one with its own results to avoid locking.
+    std::vector<std::vector<TGAAC_LineChange>> archiveChanges(arcPaths.size());
+    std::vector<TGAAC_DiffStats> archiveStats(arcPaths.size());
+    ParallelFor(arcPaths.size(), [&](size_t i) {
+        archiveChanges[i] =
+            DiffArchive(oldFolder, newFolder, arcPaths[i], archiveStats[i]);
+    });
+
+    std::vector<TGAAC_LineChange> changes;
+    for (auto& batch : archiveChanges)
+        std::ranges::move(batch, std::back_inserter(changes));
+
+    if (stats)
+    {
+        *stats = {};
+        stats->nbArchives = arcPaths.size();
+        for (TGAAC_DiffStats const& archiveStat : archiveStats)
+        {
+            stats->nbSameEntries += archiveStat.nbSameEntries;
+            stats->nbInflatedEntries += archiveStat.nbInflatedEntries;
+        }
+    }
+    return changes;
+}
+
+void TGAAC_AppendLineChangeJSON(std::string& out, TGAAC_LineChange const& change)
+{
+    using Kind = TGAAC_LineChange::Kind;
+
+    out += "{\"archive\":";
+    AppendJsonString(out, change.archive);
+    out += ",\"gmd\":";
+    AppendJsonString(out, change.gmd);
+    out += ",\"key\":";
+    AppendJsonString(out, change.key);
+    out += ",\"change\":";
+    out += change.kind == Kind::Added     ? "\"added\""
+           : change.kind == Kind::Removed ? "\"removed\""
+                                          : "\"modified\"";
+    if (change.kind != Kind::Added)
+    {
+        out += ",\"old\":";
+        AppendJsonString(out, change.oldValue);
+    }
+    if (change.kind != Kind::Removed)
+    {
+        out += ",\"new\":";
+        AppendJsonString(out, change.newValue);
+    }
+    out += "}\n";
+}
@@ -0,0 +1,47 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_DIFF_H
+#define JV_TGAAC_DIFF_H
+
+/// This file contains the comparison of the lines of two install folders,
+/// for instance before and after a game update.
+
+#include "Utility.hpp"
+
+/// A line which differs between the two install folders.
+struct TGAAC_LineChange
+{
+    enum class Kind
+    {
+        Added,
+        Removed,
+        Modified
+    };
+
+    std::string archive; ///< ARC file, relative to the install folders.
+    std::string gmd;     ///< GMD entry name in the ARC.
+    std::string key;
+    Kind kind;
+    std::string oldValue; ///< Empty if added.
+    std::string newValue; ///< Empty if removed.
+};
+
+struct TGAAC_DiffStats
+{
+    size_t nbArchives = 0;
+    size_t nbSameEntries = 0;     ///< GMD entries with the same compressed bytes.
+    size_t nbInflatedEntries = 0; ///< GMD entries decompressed to compare their lines.
+};
+
+/// Compares the GMD lines of all ARC files. Entries are first compared with their table
+/// of content and compressed bytes, and only different ones are decompressed.
+/// ARC files are compared in parallel, changes are in their order.
+std::vector<TGAAC_LineChange> TGAAC_Diff(fs::path const& oldFolder,
+                                         fs::path const& newFolder,
+                                         TGAAC_DiffStats* stats = nullptr);
+
+/// Appends the change as a JSON object on one line.
+void TGAAC_AppendLineChangeJSON(std::string& out, TGAAC_LineChange const& change);
+
+#endif
@@ -2,6 +2,8 @@
 // Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
 
 #include "TGAAC_file_ARC.hpp"
+#include "FileSchema.hpp"
+#include <atomic>
 
 // Based on Kuriimu2 :
 // https://github.com/FanTranslatorsInternational/Kuriimu2/tree/dev/plugins/Capcom/plugin_mt_framework/Archives
@@ -31,25 +33,79 @@ struct ARC_FileEntryExtendedName
     int32_t offset;
 };
 
-void ARC_Archive::Load(stream_ptr& arc)
+template <>
+struct file_schema<ARC_FileHeader>
 {
-    // 1. Read header
+    static constexpr size_t size = 8;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(ARC_FileHeader, magic, 0),
+        JV_SCHEMA_FIELD(ARC_FileHeader, version, 4),
+        JV_SCHEMA_FIELD(ARC_FileHeader, entryCount, 6),
+    };
 
-    ARC_FileHeader header;
-    arc.Read(std::span{&header, 1});
+    template <typename TStream>
+    static void Validate(ARC_FileHeader const& header, TStream& arc)
+    {
+        if (memcmp(header.magic, "ARC\0", 4) != 0)
+            arc.Error("not starting with 'ARC\0'");
+
+        if (header.version != 7 && header.version != 8)
+            arc.Error("bad ARC version {}", header.version);
+    }
+};
+
+/// Both kinds of entries only differ by the size of fileName.
+template <typename TFileEntry>
+struct ARC_FileEntrySchema
+{
+    static constexpr size_t nameSize = sizeof(TFileEntry::fileName);
+    static constexpr size_t size = nameSize + 16;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(TFileEntry, fileName, 0),
+        JV_SCHEMA_FIELD(TFileEntry, extensionHash, nameSize),
+        JV_SCHEMA_FIELD(TFileEntry, compSize, nameSize + 4),
+        JV_SCHEMA_FIELD(TFileEntry, decompSize, nameSize + 8),
+        JV_SCHEMA_FIELD(TFileEntry, offset, nameSize + 12),
+    };
+
+    template <typename TStream>
+    static void Validate(TFileEntry const& e, TStream& arc)
+    {
+        if (!memchr(e.fileName, '\0', nameSize))
+            arc.Error("entry name is not null-terminated");
+        if (e.compSize < 0 || e.offset < 0 || e.offset > arc.Size() - e.compSize)
+            arc.Error("entry '{}' out of bounds (offset={} size={})", e.fileName,
+                      e.offset, e.compSize);
+    }
+};
 
-    if (memcmp(header.magic, "ARC\0", 4) != 0)
-        arc.Error("not starting with 'ARC\0'");
+template <>
+struct file_schema<ARC_FileEntry> : ARC_FileEntrySchema<ARC_FileEntry>
+{
+};
+
+template <>
+struct file_schema<ARC_FileEntryExtendedName>
+    : ARC_FileEntrySchema<ARC_FileEntryExtendedName>
+{
+};
 
-    if (header.version != 7 && header.version != 8)
-        arc.Error("bad ARC version {}", header.version);
+template <typename TReader>
+std::vector<ARC_TocEntry> ARC_Archive::LoadTOC(TReader& arc)
+{
+    // 1. Read header
+
+    ARC_FileHeader header;
+    ReadRecords(arc, std::span{&header, 1});
 
     // 2. Determine whether we have ARC_FileEntry or ARC_FileEntryExtendedName
+    //    (not validated, as it may be the beginning of a longer entry).
 
     hasExtendedNames = [&] {
+        constexpr size_t size = file_schema<ARC_FileEntry>::size;
         ARC_FileEntry firstEntry;
-        arc.Read(std::span{&firstEntry, 1});
-        arc.SeekInput(-sizeof(firstEntry), std::ios::cur);
+        DecodeRecords(arc.ReadView(size), std::span{&firstEntry, 1});
+        arc.SeekInput(-int64_t(size), std::ios::cur);
         return firstEntry.extensionHash == 0 || firstEntry.decompSize == 0 ||
                firstEntry.offset == 0;
     }();
@@ -57,82 +113,182 @@ void ARC_Archive::Load(stream_ptr& arc)
     // 3. Parse array of entries
 
     version = header.version;
-    entries.reserve(header.entryCount);
+    entries.clear();
+
+    std::vector<ARC_TocEntry> toc;
+    toc.reserve(header.entryCount);
 
     auto funcReadEntries = [&]<typename TFileEntry>() {
         std::vector<TFileEntry> fileEntries(header.entryCount);
-        arc.Read(std::span{fileEntries});
+        ReadRecords(arc, std::span{fileEntries});
         for (TFileEntry& e : fileEntries)
         {
-            ARC_Entry& entry = entries.emplace_back();
+            ARC_TocEntry& entry = toc.emplace_back();
             entry.filename = e.fileName;
             entry.ext = ARC_ExtensionHash{e.extensionHash};
+            entry.offset = e.offset;
+            entry.compSize = e.compSize;
             entry.decompSize = e.decompSize & 0x00FFFFFF;
             entry.unknownFlags = (e.decompSize >> 24);
-            entry.content.resize(e.compSize);
             entry.isCompressed = (e.decompSize != e.compSize);
-            arc.SeekInput(e.offset, std::ios::beg);
-            arc.Read(std::span{entry.content});
-
-            if (entry.isCompressed)
-            {
-                // Check if content is actually compressed with deflate
-                uint8_t magic = (uint8_t)entry.content[0];
-                if ((magic & 0x0F) != 8 || (magic & 0xF0) > 0x70)
-                    arc.Error("Unexpected decompression first byte: {}", magic);
-            }
         }
     };
 
     if (hasExtendedNames)
-        funcReadEntries.operator()<ARC_FileEntryExtendedName>();
+        funcReadEntries.template operator()<ARC_FileEntryExtendedName>();
     else
-        funcReadEntries.operator()<ARC_FileEntry>();
+        funcReadEntries.template operator()<ARC_FileEntry>();
+
+    return toc;
+}
+
+template <typename TReader>
+ARC_Entry ARC_Archive::LoadEntry(TReader& arc, ARC_TocEntry const& toc)
+{
+    ARC_Entry entry;
+    entry.filename = toc.filename;
+    entry.ext = toc.ext;
+    entry.decompSize = toc.decompSize;
+    entry.unknownFlags = toc.unknownFlags;
+    entry.isCompressed = toc.isCompressed;
+    entry.content.resize(toc.compSize);
+    arc.SeekInput(toc.offset, std::ios::beg);
+    arc.Read(std::span{entry.content});
+
+    if (entry.isCompressed)
+    {
+        // Check if content is actually compressed with deflate
+        uint8_t magic = (uint8_t)entry.content[0];
+        if ((magic & 0x0F) != 8 || (magic & 0xF0) > 0x70)
+            arc.Error("Unexpected decompression first byte: {}", magic);
+    }
+    return entry;
+}
+
+template <typename TReader>
+void ARC_Archive::Load(TReader& arc)
+{
+    std::vector<ARC_TocEntry> toc = LoadTOC(arc);
+    entries.reserve(toc.size());
+    for (ARC_TocEntry const& tocEntry : toc)
+        entries.push_back(LoadEntry(arc, tocEntry));
 }
 
-void ARC_Archive::Save(stream_ptr& out) const
+template <typename TWriter>
+void ARC_Archive::Save(TWriter& out) const
+{
+    std::vector<ARC_TocEntry> toc;
+    toc.reserve(entries.size());
+    for (ARC_Entry const& entry : entries)
+    {
+        ARC_TocEntry& tocEntry = toc.emplace_back();
+        tocEntry.filename = entry.filename;
+        tocEntry.ext = entry.ext;
+        tocEntry.compSize = entry.content.size();
+        tocEntry.decompSize = entry.decompSize;
+        tocEntry.unknownFlags = entry.unknownFlags;
+        tocEntry.isCompressed = entry.isCompressed;
+    }
+    SaveTOC(out, std::span<ARC_TocEntry const>{toc});
+
+    for (ARC_Entry const& entry : entries)
+        out.Write(std::span{entry.content});
+}
+
+int64_t ARC_Archive::TOCSize(size_t entryCount) const noexcept
+{
+    int64_t size = file_schema<ARC_FileHeader>::size;
+    size += entryCount * (hasExtendedNames ? file_schema<ARC_FileEntryExtendedName>::size
+                                           : file_schema<ARC_FileEntry>::size);
+    return size + ((-size) & 0x7FFF); // alignas(0x8000)
+}
+
+template <typename TWriter>
+void ARC_Archive::SaveTOC(TWriter& out, std::span<ARC_TocEntry const> toc) const
 {
     ARC_FileHeader arc_header;
     memcpy(arc_header.magic, "ARC\0", 4);
     arc_header.version = version;
-    arc_header.entryCount = entries.size();
-    out.Write(std::span{&arc_header, 1});
+    arc_header.entryCount = toc.size();
+    WriteRecords(out, std::span<ARC_FileHeader const>{&arc_header, 1});
 
     auto funcReadEntries = [&]<typename TFileEntry>() {
         std::vector<TFileEntry> fileEntries;
-        fileEntries.reserve(entries.size());
+        fileEntries.reserve(toc.size());
 
-        int64_t contentBase = sizeof(ARC_FileHeader);
-        contentBase += entries.size() * sizeof(TFileEntry);
-        contentBase += (-contentBase) & 0x7FFF; // alignas(0x8000)
+        int64_t contentBase = TOCSize(toc.size());
         int64_t contentOffset = contentBase;
 
-        for (ARC_Entry const& entry : entries)
+        for (ARC_TocEntry const& entry : toc)
         {
             TFileEntry& e = fileEntries.emplace_back();
             if (entry.filename.size() >= sizeof(e.fileName))
                 out.Error("Filename size {} too big", entry.filename.size());
             memcpy(e.fileName, entry.filename.c_str(), entry.filename.size());
             e.extensionHash = (uint32_t)entry.ext;
-            e.compSize = entry.content.size();
+            e.compSize = entry.compSize;
             e.decompSize = entry.decompSize | ((uint32_t)entry.unknownFlags << 24);
             e.offset = contentOffset;
 
-            contentOffset += entry.content.size();
+            contentOffset += entry.compSize;
         }
-        out.Write(std::span{fileEntries});
+        WriteRecords(out, std::span<TFileEntry const>{fileEntries});
         int64_t pos = out.SeekOutput(0, std::ios::cur);
         std::vector<char> padding(contentBase - pos, 0);
         out.Write(std::span{padding});
     };
 
     if (hasExtendedNames)
-        funcReadEntries.operator()<ARC_FileEntryExtendedName>();
+        funcReadEntries.template operator()<ARC_FileEntryExtendedName>();
     else
-        funcReadEntries.operator()<ARC_FileEntry>();
+        funcReadEntries.template operator()<ARC_FileEntry>();
+}
 
-    for (ARC_Entry const& entry : entries)
-        out.Write(std::span{entry.content});
+template void ARC_Archive::Load(stream_ptr&);
+template void ARC_Archive::Load(span_reader&);
+template void ARC_Archive::Load(file_reader&);
+template std::vector<ARC_TocEntry> ARC_Archive::LoadTOC(span_reader&);
+template std::vector<ARC_TocEntry> ARC_Archive::LoadTOC(file_reader&);
+template ARC_Entry ARC_Archive::LoadEntry(span_reader&, ARC_TocEntry const&);
+template ARC_Entry ARC_Archive::LoadEntry(file_reader&, ARC_TocEntry const&);
+template void ARC_Archive::Save(stream_ptr&) const;
+template void ARC_Archive::Save(file_writer&) const;
+template void ARC_Archive::SaveTOC(span_writer&, std::span<ARC_TocEntry const>) const;
+template void ARC_Archive::SaveTOC(file_writer&, std::span<ARC_TocEntry const>) const;
+
+ARC_SharedArchive::ARC_SharedArchive(fs::path path, entry_cache* cache)
+    : m_file{std::move(path)}, m_cache{cache}
+{
+    static std::atomic<uint64_t> s_nextCacheKey = 0;
+    m_cacheKey = s_nextCacheKey++ << 32;
+
+    file_reader arcStream{m_file.Path()};
+    m_toc = m_header.LoadTOC(arcStream);
+}
+
+ARC_Entry ARC_SharedArchive::LoadEntry(size_t index) const
+{
+    ARC_TocEntry const& toc = m_toc.at(index);
+    ARC_Entry entry;
+    entry.filename = toc.filename;
+    entry.ext = toc.ext;
+    entry.decompSize = toc.decompSize;
+    entry.unknownFlags = toc.unknownFlags;
+    entry.isCompressed = toc.isCompressed;
+    entry.content = m_file.ReadAt(toc.offset, toc.compSize);
+    return entry;
+}
+
+entry_cache::value ARC_SharedArchive::LoadContent(size_t index) const
+{
+    auto funcLoad = [&] {
+        ARC_Entry entry = LoadEntry(index);
+        return entry.isCompressed ? ARC_Entry::Decompress(entry.content, entry.decompSize)
+                                  : std::move(entry.content);
+    };
+    if (!m_cache)
+        return std::make_shared<std::string const>(funcLoad());
+    return m_cache->GetOrLoad(m_cacheKey + index, m_toc.at(index).decompSize, funcLoad);
 }
 
 #include <zlib.h>
@@ -173,7 +329,7 @@ std::string ARC_Entry::Decompress(std::string_view input, uint32_t decompSize)
     return output;
 }
 
-std::string ARC_Entry::Compress(std::string_view input)
+std::string ARC_Entry::Compress(std::string_view input, ARC_DeflateParams const& params)
 {
     std::string output;
 
@@ -181,9 +337,10 @@ std::string ARC_Entry::Compress(std::string_view input)
     strm.next_in = (Bytef*)input.data();
     strm.avail_in = input.size();
 
-    int res = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+    int res = deflateInit2(&strm, params.level, Z_DEFLATED, params.windowBits,
+                           params.memLevel, params.strategy);
     if (res != Z_OK)
-        throw runtime_error("Error with ZLIB deflateInit: {}", res);
+        throw runtime_error("Error with ZLIB deflateInit2: {}", res);
 
     output.resize(deflateBound(&strm, input.size()));
     strm.next_out = (Bytef*)output.data();
@@ -200,4 +357,187 @@ std::string ARC_Entry::Compress(std::string_view input)
     output.resize(strm.total_out);
     output.shrink_to_fit();
     return output;
-}
\ No newline at end of file
+}
+
+std::string ARC_Entry::CompressParallel(std::string_view input,
+                                        ARC_DeflateParams const& params,
+                                        unsigned nbThreads)
+{
+    if (input.size() < PARALLEL_DEFLATE_MIN_SIZE)
+        return Compress(input, params);
+
+    // Raw deflate blocks: all but the last one end on a byte boundary (Z_SYNC_FLUSH),
+    // so that they can be concatenated. Each block is primed with the window before it,
+    // which loses little compression compared to a single stream.
+    int windowBits = std::max(params.windowBits, 9); // As zlib does.
+    size_t dictSize = size_t(1) << windowBits;
+    size_t nbBlocks = (input.size() + PARALLEL_DEFLATE_BLOCK_SIZE - 1) /
+                      PARALLEL_DEFLATE_BLOCK_SIZE;
+    std::vector<std::string> blocks(nbBlocks);
+    std::vector<uLong> adlers(nbBlocks);
+    ParallelFor(
+        nbBlocks,
+        [&](size_t i) {
+            size_t begin = i * PARALLEL_DEFLATE_BLOCK_SIZE;
+            std::string_view block = input.substr(begin, PARALLEL_DEFLATE_BLOCK_SIZE);
+            bool isLast = i + 1 == nbBlocks;
+            adlers[i] = adler32_z(adler32(0, nullptr, 0), (Bytef const*)block.data(),
+                                  block.size());
+
+            z_stream strm = {};
+            int res = deflateInit2(&strm, params.level, Z_DEFLATED, -windowBits,
+                                   params.memLevel, params.strategy);
+            if (res != Z_OK)
+                throw runtime_error("Error with ZLIB deflateInit2: {}", res);
+            if (begin > 0)
+            {
+                size_t size = std::min(dictSize, begin);
+                res = deflateSetDictionary(
+                    &strm, (Bytef const*)input.data() + begin - size, size);
+                if (res != Z_OK)
+                {
+                    deflateEnd(&strm);
+                    throw runtime_error("Error with ZLIB deflateSetDictionary: {}", res);
+                }
+            }
+
+            // A sync flush marker is 5 bytes more than deflateBound().
+            std::string& output = blocks[i];
+            output.resize(deflateBound(&strm, block.size()) + 16);
+            strm.next_in = (Bytef*)block.data();
+            strm.avail_in = block.size();
+            strm.next_out = (Bytef*)output.data();
+            strm.avail_out = output.size();
+            res = deflate(&strm, isLast ? Z_FINISH : Z_SYNC_FLUSH);
+            bool done = isLast ? res == Z_STREAM_END
+                               : res == Z_OK && strm.avail_in == 0 && strm.avail_out > 0;
+            deflateEnd(&strm);
+            if (!done)
+                throw runtime_error("Error with ZLIB deflate: {}", res);
+            output.resize(strm.total_out);
+        },
+        nbThreads);
+
+    // zlib header, as written by deflate() for these parameters.
+    int level = params.level == Z_DEFAULT_COMPRESSION ? 6 : params.level;
+    int levelFlags = (params.strategy >= Z_HUFFMAN_ONLY || level < 2) ? 0
+                     : level < 6                                      ? 1
+                     : level == 6                                     ? 2
+                                                                      : 3;
+    unsigned header = (Z_DEFLATED + ((windowBits - 8) << 4)) << 8 | (levelFlags << 6);
+    header += 31 - header % 31;
+
+    uLong adler = adlers[0];
+    for (size_t i = 1; i < nbBlocks; ++i)
+    {
+        size_t blockSize = std::min(PARALLEL_DEFLATE_BLOCK_SIZE,
+                                    input.size() - i * PARALLEL_DEFLATE_BLOCK_SIZE);
+        adler = adler32_combine(adler, adlers[i], blockSize);
+    }
+
+    std::string output;
+    size_t totalSize = 6;
+    for (std::string const& block : blocks)
+        totalSize += block.size();
+    output.reserve(totalSize);
+    output += char(header >> 8);
+    output += char(header);
+    for (std::string const& block : blocks)
+        output += block;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        output += char(adler >> shift);
+    return output;
+}
+/// Whether deflate with these parameters gives 'expected', stopping at the first
+/// differing byte.
+static bool ProbeDeflate(std::string_view input, std::string_view expected,
+                         ARC_DeflateParams const& params)
+{
+    z_stream strm = {};
+    strm.next_in = (Bytef*)input.data();
+    strm.avail_in = input.size();
+    if (deflateInit2(&strm, params.level, Z_DEFLATED, params.windowBits, params.memLevel,
+                     params.strategy) != Z_OK)
+        return false;
+
+    char chunk[4096];
+    size_t pos = 0;
+    bool same = true;
+    int res = Z_OK;
+    while (same && res != Z_STREAM_END)
+    {
+        strm.next_out = (Bytef*)chunk;
+        strm.avail_out = sizeof(chunk);
+        res = deflate(&strm, Z_FINISH);
+        size_t produced = sizeof(chunk) - strm.avail_out;
+        same = (res == Z_OK || res == Z_STREAM_END) &&
+               pos + produced <= expected.size() &&
+               memcmp(chunk, expected.data() + pos, produced) == 0;
+        pos += produced;
+    }
+    deflateEnd(&strm);
+    return same && pos == expected.size();
+}
+
+/// Parameters which can give the zlib header of 'compressed', most common first.
+static std::vector<ARC_DeflateParams> DeflateCandidates(std::string_view compressed)
+{
+    // CINFO is the window size, FLEVEL is set by deflate from the level and strategy.
+    int windowBits = std::max(9, ((uint8_t)compressed[0] >> 4) + 8);
+    int levelFlags = (uint8_t)compressed[1] >> 6;
+
+    std::vector<ARC_DeflateParams> candidates;
+    for (int strategy : {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED})
+    {
+        for (int memLevel : {8, 9, 7, 6, 5, 4, 3, 2, 1})
+        {
+            for (int level : {6, 9, 1, 2, 3, 4, 5, 7, 8, 0})
+            {
+                // Huffman-only and RLE do not depend on the level, except stored (0).
+                if (strategy >= Z_HUFFMAN_ONLY && strategy != Z_FIXED && level != 6 &&
+                    level != 0)
+                    continue;
+                int flags = strategy >= Z_HUFFMAN_ONLY || level < 2 ? 0
+                            : level < 6                             ? 1
+                            : level == 6                            ? 2
+                                                                    : 3;
+                if (flags == levelFlags)
+                    candidates.push_back({level, windowBits, memLevel, strategy});
+            }
+        }
+    }
+    return candidates;
+}
+
+std::optional<ARC_DeflateParams> ARC_Entry::DetectDeflateParams(
+    std::string_view decompressed, std::string_view compressed, unsigned nbThreads)
+{
+    if (compressed.size() < 2)
+        return std::nullopt;
+    std::vector<ARC_DeflateParams> candidates = DeflateCandidates(compressed);
+    if (candidates.empty())
+        return std::nullopt;
+    if (ProbeDeflate(decompressed, compressed, candidates[0]))
+        return candidates[0];
+
+    // The first matching candidate in order is kept, so that the result does not
+    // depend on the scheduling. Candidates after a match are skipped.
+    std::atomic<size_t> found = candidates.size();
+    ParallelFor(
+        candidates.size() - 1,
+        [&](size_t i) {
+            size_t index = i + 1;
+            if (index > found)
+                return;
+            if (!ProbeDeflate(decompressed, compressed, candidates[index]))
+                return;
+            size_t current = found;
+            while (index < current && !found.compare_exchange_weak(current, index))
+                ;
+        },
+        nbThreads);
+
+    if (found == candidates.size())
+        return std::nullopt;
+    return candidates[found];
+}
@@ -4,13 +4,27 @@
 #ifndef JV_TGAAC_FILE_ARC_H
 #define JV_TGAAC_FILE_ARC_H
 
+#include "EntryCache.hpp"
 #include "Utility.hpp"
 
+#include <optional>
+
 enum class ARC_ExtensionHash : uint32_t
 {
     GMD = 0x242BB29A
 };
 
+/// Parameters of zlib's deflateInit2(), the default ones being deflateInit()'s.
+struct ARC_DeflateParams
+{
+    int level = 6;
+    int windowBits = 15;
+    int memLevel = 8;
+    int strategy = 0; ///< Z_DEFAULT_STRATEGY
+
+    bool operator==(ARC_DeflateParams const&) const noexcept = default;
+};
+
 struct ARC_Entry
 {
     std::string filename;  ///< Entry name, without extension
@@ -21,21 +35,95 @@ struct ARC_Entry
     uint8_t unknownFlags;  ///< Unknown, vary among ARC entries, so probably some flags.
 
     static std::string Decompress(std::string_view input, uint32_t decompSize);
-    static std::string Compress(std::string_view input);
+    static std::string Compress(std::string_view input,
+                                ARC_DeflateParams const& params = {});
+    /// Like pigz, deflates blocks of the input in parallel, each one primed with the
+    /// window before it, into a single zlib stream. It is valid, but not byte-identical
+    /// to Compress() which is used for inputs below PARALLEL_DEFLATE_MIN_SIZE.
+    static std::string CompressParallel(std::string_view input,
+                                        ARC_DeflateParams const& params = {},
+                                        unsigned nbThreads = 0);
+    static constexpr size_t PARALLEL_DEFLATE_MIN_SIZE = 1 << 20;
+    static constexpr size_t PARALLEL_DEFLATE_BLOCK_SIZE = 128 << 10;
+    /// Finds the parameters with which Compress(decompressed) is exactly 'compressed'.
+    /// Candidates allowed by the zlib header are probed in parallel, each one stopping
+    /// at its first differing byte. The default parameters are tried first, alone.
+    static std::optional<ARC_DeflateParams> DetectDeflateParams(
+        std::string_view decompressed, std::string_view compressed,
+        unsigned nbThreads = 0);
 
     bool operator==(ARC_Entry const&) const noexcept = default;
 };
 
+/// Location of an entry inside an ARC file, as found in its table of content.
+struct ARC_TocEntry
+{
+    std::string filename;
+    ARC_ExtensionHash ext;
+    uint32_t offset;     ///< Position of the content from the beginning of the file.
+    uint32_t compSize;   ///< Size of the content in the file.
+    uint32_t decompSize; ///< The content size if decompressed.
+    uint8_t unknownFlags;
+    bool isCompressed;
+
+    bool operator==(ARC_TocEntry const&) const noexcept = default;
+};
+
 struct ARC_Archive
 {
     uint16_t version;
     bool hasExtendedNames;
     std::vector<ARC_Entry> entries;
 
-    void Load(stream_ptr& in);
-    void Save(stream_ptr& out) const;
+    /// Instantiated for stream_ptr, span_reader and file_reader.
+    template <typename TReader>
+    void Load(TReader& in);
+
+    /// Only reads the table of content, leaving 'entries' empty.
+    /// Instantiated for span_reader and file_reader.
+    template <typename TReader>
+    std::vector<ARC_TocEntry> LoadTOC(TReader& in);
+    /// Reads a single entry, found with LoadTOC().
+    template <typename TReader>
+    static ARC_Entry LoadEntry(TReader& in, ARC_TocEntry const& toc);
+    /// Instantiated for stream_ptr and file_writer.
+    template <typename TWriter>
+    void Save(TWriter& out) const;
+    /// Writes the header and table of content of Save() for entries of the given sizes
+    /// (their offsets are ignored), so that their contents can then be written in order
+    /// without being all in memory. Instantiated for span_writer and file_writer.
+    template <typename TWriter>
+    void SaveTOC(TWriter& out, std::span<ARC_TocEntry const> toc) const;
+    /// Size written by SaveTOC(), padding included.
+    int64_t TOCSize(size_t entryCount) const noexcept;
 
     bool operator==(ARC_Archive const&) const noexcept = default;
 };
 
+/// ARC file whose entries can be read by several threads at once: their contents are
+/// read with pread(), and the decompressed ones are kept in a cache, which several
+/// ARC files can share.
+class ARC_SharedArchive
+{
+    shared_file m_file;
+    ARC_Archive m_header; ///< Without entries.
+    std::vector<ARC_TocEntry> m_toc;
+    entry_cache* m_cache;
+    uint64_t m_cacheKey; ///< Unique among the ARC files, the entry index is added.
+
+  public:
+    /// Reads the table of content. Without cache, entries are decompressed each time.
+    explicit ARC_SharedArchive(fs::path path, entry_cache* cache = nullptr);
+
+    fs::path const& Path() const noexcept { return m_file.Path(); }
+    uint16_t Version() const noexcept { return m_header.version; }
+    bool HasExtendedNames() const noexcept { return m_header.hasExtendedNames; }
+    std::span<ARC_TocEntry const> TOC() const noexcept { return m_toc; }
+
+    /// Entry as stored, possibly compressed, like ARC_Archive::LoadEntry().
+    ARC_Entry LoadEntry(size_t index) const;
+    /// Decompressed content of an entry, shared with the other threads reading it.
+    entry_cache::value LoadContent(size_t index) const;
+};
+
 #endif
\ No newline at end of file
@@ -2,9 +2,17 @@
 // Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
 
 #include "TGAAC_file_GMD.hpp"
+#include "FileSchema.hpp"
+#include "TGAAC_file_ARC.hpp"
 #include "Utility.hpp"
+#include <bit>
+#include <unordered_map>
 #include <utility>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // GMD parser based on
 // https://github.com/IcySon55/Kuriimu/blob/master/src/text/text_gmd/GMDv2.cs
 
@@ -36,83 +44,156 @@ struct GMD_FileBuckets
     uint64_t buckets[256];
 };
 
-void GMD_Registry::Load(stream_ptr& gmd)
+template <>
+struct file_schema<GMD_FileLabelEntry>
+{
+    static constexpr size_t size = 32;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, sectionID, 0),
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, hash1, 4),
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, hash2, 8),
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, zeroPadding, 12),
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, labelOffset, 16),
+        JV_SCHEMA_FIELD(GMD_FileLabelEntry, listLink, 24),
+    };
+};
+
+template <>
+struct file_schema<GMD_FileBuckets>
+{
+    static constexpr size_t size = 2048;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(GMD_FileBuckets, buckets, 0),
+    };
+};
+
+template <>
+struct file_schema<GMD_FileHeader>
+{
+    static constexpr size_t size = 40;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(GMD_FileHeader, magic, 0),
+        JV_SCHEMA_FIELD(GMD_FileHeader, version, 4),
+        JV_SCHEMA_FIELD(GMD_FileHeader, language, 8),
+        JV_SCHEMA_FIELD(GMD_FileHeader, padding, 12),
+        JV_SCHEMA_FIELD(GMD_FileHeader, labelCount, 20),
+        JV_SCHEMA_FIELD(GMD_FileHeader, sectionCount, 24),
+        JV_SCHEMA_FIELD(GMD_FileHeader, labelSize, 28),
+        JV_SCHEMA_FIELD(GMD_FileHeader, sectionSize, 32),
+        JV_SCHEMA_FIELD(GMD_FileHeader, nameSize, 36),
+    };
+
+    template <typename TStream>
+    static void Validate(GMD_FileHeader const& header, TStream& gmd)
+    {
+        if (memcmp(header.magic, "GMD\0", 4) != 0)
+            gmd.Error("not starting with 'GMD\0'");
+
+        if (header.version != 0x010302)
+            gmd.Error("bad GMD version {:#x}", header.version);
+
+        if (header.labelCount != header.sectionCount)
+            gmd.Error("unsupported labelCount != sectionCount ({} != {})",
+                      header.labelCount, header.sectionCount);
+
+        // Checked before allocating anything from the counts.
+        int64_t minSize = size + int64_t(header.nameSize) + 1;
+        minSize += int64_t(header.labelCount) * file_schema<GMD_FileLabelEntry>::size;
+        minSize += int64_t(header.labelSize) + header.sectionSize;
+        if (minSize > gmd.Size())
+            gmd.Error("header sizes exceed file size {}", gmd.Size());
+    }
+};
+
+GMD_LabelHash GMD_HashLabel(std::string_view key)
+{
+    GMD_LabelHash hash;
+    hash.hash0 = ~crc32(0, key.data(), key.size());
+    hash.hash1 = ~crc32(~hash.hash0, key.data(), key.size());
+    hash.hash2 = ~crc32(~hash.hash1, key.data(), key.size());
+    return hash;
+}
+
+template <typename TReader>
+void GMD_Registry::Load(TReader& gmd)
 {
     *this = {};
 
     // 1. Parse header
     GMD_FileHeader header;
-    int64_t fileSize = gmd.SeekInput(0, std::ios::end);
+    int64_t fileSize = gmd.Size();
     gmd.SeekInput(0, std::ios::beg);
-    gmd.Read(std::span{&header, 1});
-
-    if (memcmp(header.magic, "GMD\0", 0) != 0)
-        gmd.Error("not starting with 'GMD\0'");
-
-    if (header.version != 0x010302)
-        gmd.Error("bad GMD version {:#x}", header.version);
-
-    if (header.labelCount != header.sectionCount)
-        gmd.Error("unsupported labelCount != sectionCount ({} != {})", header.labelCount,
-                  header.sectionCount);
+    ReadRecords(gmd, std::span{&header, 1});
 
     // 2. Parse name
 
-    name = gmd.ReadCStr();
-    if (name.size() != header.nameSize)
-        gmd.Error("ameSize mismatch (in header {}, found {})", header.nameSize,
-                  name.size());
+    std::string_view nameView = gmd.ReadView(int64_t(header.nameSize) + 1);
+    if (nameView.find('\0') != header.nameSize)
+        gmd.Error("nameSize mismatch (in header {}, found {})", header.nameSize,
+                  nameView.find('\0'));
+    name = nameView.substr(0, header.nameSize);
 
-    // 3. Parse label entries
+    // 3. Parse label entries, and index them by sectionID
 
     std::vector<GMD_FileLabelEntry> labelEntries(header.labelCount);
-    gmd.Read(std::span{labelEntries});
+    ReadRecords(gmd, std::span{labelEntries});
+
+    std::vector<GMD_FileLabelEntry const*> sectionLabels(header.sectionCount, nullptr);
+    for (GMD_FileLabelEntry const& e : labelEntries)
+    {
+        if (e.sectionID >= sectionLabels.size())
+            gmd.Error("label sectionID {} out of bounds", e.sectionID);
+        sectionLabels[e.sectionID] = &e;
+    }
 
     // 4. Compute sizes
 
-    int64_t prefixSize = gmd.SeekInput(0, std::ios::cur);
-    int64_t bucketsSize = header.labelCount > 0 ? sizeof(GMD_FileBuckets) : 0;
-    int64_t textSize = header.labelSize + header.sectionSize;
+    int64_t prefixSize = file_schema<GMD_FileHeader>::size + nameView.size();
+    prefixSize += labelEntries.size() * file_schema<GMD_FileLabelEntry>::size;
+    int64_t bucketsSize = header.labelCount > 0 ? file_schema<GMD_FileBuckets>::size : 0;
+    int64_t textSize = int64_t(header.labelSize) + header.sectionSize;
     int64_t expectedFileSize = prefixSize + bucketsSize + textSize;
     if (expectedFileSize != fileSize)
         gmd.Error("bad file size {} (expected {})", fileSize, expectedFileSize);
 
     // 5. Skip bucket (only necessary for fast random access)
 
-    GMD_FileBuckets gmd_buckets{};
-    if (bucketsSize)
-        gmd.Read(std::span{&gmd_buckets, 1});
+    gmd.SeekInput(bucketsSize, std::ios::cur);
 
-    // 6. Read all labels, store their labelOffset
+    // 6. Read all labels and sections in one bounded read,
+    //    then split them in-memory. Labels are keyed by their labelOffset.
 
-    int64_t labelBegin = gmd.SeekInput(0, std::ios::cur);
-    int64_t labelEnd = labelBegin + header.labelSize;
+    std::string_view text = gmd.ReadView(textSize);
+    std::string_view labelText = text.substr(0, header.labelSize);
+    std::string_view sectionText = text.substr(header.labelSize);
 
-    std::unordered_map<int64_t, std::string> labels;
-    while (true)
+    std::unordered_map<int64_t, std::string_view> labels;
+    for (size_t pos = 0; pos < labelText.size();)
     {
-        int64_t pos = gmd.SeekInput(0, std::ios::cur);
-        if (pos >= labelEnd)
-            break;
-        int64_t offset = pos - labelBegin;
-        std::string value = gmd.ReadCStr();
-        labels[pos - labelBegin] = value;
+        size_t end = labelText.find('\0', pos);
+        if (end == labelText.npos)
+            gmd.Error("labelEnd does not match: {} != {}", text.find('\0', pos),
+                      labelText.size());
+        labels[pos] = labelText.substr(pos, end - pos);
+        pos = end + 1;
     }
-    int64_t pos = gmd.SeekInput(0, std::ios::cur);
-    if (pos != labelEnd)
-        gmd.Error("labelEnd does not match: {} != {}", pos, labelEnd);
     if (labels.size() != header.labelCount)
         gmd.Error("labelSize does not match: {} != {}", labels.size(), header.labelCount);
 
     // 7. Read all sections
 
-    std::vector<std::string> sections;
+    std::vector<std::string_view> sections;
     sections.reserve(header.sectionCount);
-    for (uint32_t i = 0; i < header.sectionCount; ++i)
+    for (size_t pos = 0; sections.size() < header.sectionCount;)
     {
-        sections.emplace_back(gmd.ReadCStr());
+        size_t end = sectionText.find('\0', pos);
+        if (end == sectionText.npos)
+            gmd.Error("sectionSize does not match");
+        sections.push_back(sectionText.substr(pos, end - pos));
+        pos = end + 1;
     }
-    if (gmd.SeekInput(0, std::ios::cur) != fileSize)
+    if (sections.empty() ? !sectionText.empty()
+                         : sections.back().end() + 1 != sectionText.end())
         gmd.Error("sectionSize does not match");
 
     // 8. Convert to output GMD_Registry
@@ -120,37 +201,46 @@ void GMD_Registry::Load(stream_ptr& gmd)
     version = header.version;
     language = header.language;
     memcpy(&_padding, header.padding, sizeof(header.padding));
-    name = (char*)name.data();
     entries.reserve(sections.size());
     for (size_t sectionID = 0; sectionID < sections.size(); ++sectionID)
     {
         GMD_Entry& entry = entries.emplace_back();
-        std::string& section = sections[sectionID];
-        entry.value = (char*)section.data();
+        entry.value = sections[sectionID];
 
-        auto it = std::ranges::find_if(labelEntries, [&](GMD_FileLabelEntry const& e) {
-            return e.sectionID == sectionID;
-        });
-        if (it == labelEntries.end())
+        GMD_FileLabelEntry const* it = sectionLabels[sectionID];
+        if (!it)
             gmd.Error("could not find a label using sectionID {}", sectionID);
 
         if (!labels.contains(it->labelOffset))
             gmd.Error("Unknown label at offset {}", it->labelOffset);
-        entry.key = std::move(labels.at(it->labelOffset));
-
-        uint32_t hash0 = ~crc32(0, entry.key.data(), entry.key.size());
-        uint32_t hash1 = ~crc32(~hash0, entry.key.data(), entry.key.size());
-        uint32_t hash2 = ~crc32(~hash1, entry.key.data(), entry.key.size());
-        if (hash1 != it->hash1)
-            gmd.Error("hash1 mismatch: {} != {}", hash1, it->hash1);
-        if (hash2 != it->hash2)
-            gmd.Error("hash2 mismatch: {} != {}", hash2, it->hash2);
+        entry.key = labels.at(it->labelOffset);
+
+        GMD_LabelHash hash = GMD_HashLabel(entry.key);
+        if (hash.hash1 != it->hash1)
+            gmd.Error("hash1 mismatch: {} != {}", hash.hash1, it->hash1);
+        if (hash.hash2 != it->hash2)
+            gmd.Error("hash2 mismatch: {} != {}", hash.hash2, it->hash2);
     }
 }
 
-void GMD_Registry::Save(stream_ptr& out) const
+template void GMD_Registry::Load(stream_ptr&);
+template void GMD_Registry::Load(span_reader&);
+template void GMD_Registry::Load(file_reader&);
+
+int64_t GMD_Registry::ComputeSize() const
+{
+    int64_t size = file_schema<GMD_FileHeader>::size + name.size() + 1;
+    if (!entries.empty())
+        size += entries.size() * file_schema<GMD_FileLabelEntry>::size +
+                file_schema<GMD_FileBuckets>::size;
+    for (GMD_Entry const& entry : entries)
+        size += entry.key.size() + 1 + entry.value.size() + 1;
+    return size;
+}
+
+std::string GMD_Registry::Save() const
 {
-    // Header
+    // 1. Header
 
     GMD_FileHeader gmd_header{};
     memcpy(gmd_header.magic, "GMD\0", 4);
@@ -163,10 +253,9 @@ void GMD_Registry::Save(stream_ptr& out) const
     gmd_header.sectionSize = 0; //< to be filled in the entries loop
     gmd_header.nameSize = name.size();
 
-    // Entries and BucketList
+    // 2. Entries and BucketList
 
-    std::vector<GMD_FileLabelEntry> gmd_labelEntries;
-    gmd_labelEntries.reserve(entries.size());
+    std::vector<GMD_FileLabelEntry> gmd_labelEntries(entries.size());
 
     GMD_FileBuckets gmd_buckets{};
 
@@ -183,13 +272,11 @@ void GMD_Registry::Save(stream_ptr& out) const
     for (uint64_t i = 0; i < entries.size(); ++i)
     {
         GMD_Entry const& entry = entries[i];
-        GMD_FileLabelEntry& fileEntry = gmd_labelEntries.emplace_back();
+        GMD_FileLabelEntry& fileEntry = gmd_labelEntries[i];
 
-        uint32_t hash0 = ~crc32(0, entry.key.data(), entry.key.size());
-        uint32_t hash1 = ~crc32(~hash0, entry.key.data(), entry.key.size());
-        uint32_t hash2 = ~crc32(~hash1, entry.key.data(), entry.key.size());
+        GMD_LabelHash hash = GMD_HashLabel(entry.key);
 
-        uint8_t bucket = hash0 & 0xFF;
+        uint8_t bucket = hash.hash0 & 0xFF;
         GMD_FileLabelEntry* previous = std::exchange(bucketTails[bucket], &fileEntry);
         if (previous)
             previous->listLink = (i > 0 ? i : -1);
@@ -197,8 +284,8 @@ void GMD_Registry::Save(stream_ptr& out) const
             gmd_buckets.buckets[bucket] = (i > 0 ? i : -1);
 
         fileEntry.sectionID = i;
-        fileEntry.hash1 = hash1;
-        fileEntry.hash2 = hash2;
+        fileEntry.hash1 = hash.hash1;
+        fileEntry.hash2 = hash.hash2;
         fileEntry.zeroPadding = 0xCDCDCDCD;
         fileEntry.labelOffset = offset;
         fileEntry.listLink = 0;
@@ -208,100 +295,248 @@ void GMD_Registry::Save(stream_ptr& out) const
         offset += entry.key.size() + 1;
     }
 
-    out.Write(std::span{&gmd_header, 1});
-    out.Write(std::span{name.data(), name.size() + 1});
-    out.Write(std::span{gmd_labelEntries});
-    out.Write(std::span{&gmd_buckets, 1});
+    // 3. Write everything in a buffer of the exact size, allocated only once.
+
+    std::string output;
+    output.resize(ComputeSize());
+    span_writer out{name, std::span{output}};
+
+    WriteRecords(out, std::span<GMD_FileHeader const>{&gmd_header, 1});
+    out.Write(std::span{name.c_str(), name.size() + 1});
+    WriteRecords(out, std::span<GMD_FileLabelEntry const>{gmd_labelEntries});
+
+    // Buckets are only present when there is at least one label, see Load().
+    if (!entries.empty())
+        WriteRecords(out, std::span<GMD_FileBuckets const>{&gmd_buckets, 1});
 
     for (GMD_Entry const& entry : entries)
-        out.Write(std::span{entry.key.data(), entry.key.size() + 1});
+        out.Write(std::span{entry.key.c_str(), entry.key.size() + 1});
 
     for (GMD_Entry const& entry : entries)
-        out.Write(std::span{entry.value.data(), entry.value.size() + 1});
+        out.Write(std::span{entry.value.c_str(), entry.value.size() + 1});
+
+    int64_t written = out.SeekOutput(0, std::ios::cur);
+    if (written != int64_t(output.size()))
+        out.Error("GMD size mismatch ({} computed, {} written)", output.size(), written);
+
+    return output;
+}
 
+void GMD_Registry::Save(stream_ptr& out) const
+{
+    std::string bytes = Save();
+    out.Write(std::span{bytes});
     out.Sync();
 }
 
-/*
+// ==================== Tags and JV escaping ====================
+
+constexpr std::string_view JV_PAGE = "<PAGE>";
+constexpr std::string_view JV_TRAILER = "\n<!--\n==========JV==========\n";
+
+GMD_TagList GMD_ScanTags(std::string_view value)
+{
+    GMD_TagList result;
+    for (size_t pos = value.find('<'); pos != value.npos; pos = value.find('<', pos))
+    {
+        size_t closingPos = value.find('>', pos);
+        if (closingPos == value.npos)
+        {
+            result.unclosed = true;
+            break;
+        }
+        std::string_view tag = value.substr(pos, closingPos + 1 - pos);
+        if (tag == JV_PAGE)
+            ++result.pageCount;
+        else
+            result.tags.push_back(tag);
+        pos = closingPos + 1;
+    }
+    return result;
+}
+
+/// Position of the next '\r', '\n' or '<' from 'pos', or input.size().
+/// Most of a line is plain text, so it is scanned 16 bytes at a time.
+static size_t FindSpecial(std::string_view input, size_t pos)
+{
+#if defined(__SSE2__)
+    __m128i const cr = _mm_set1_epi8('\r');
+    __m128i const lf = _mm_set1_epi8('\n');
+    __m128i const lt = _mm_set1_epi8('<');
+    for (; pos + 16 <= input.size(); pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(input.data() + pos));
+        __m128i match = _mm_cmpeq_epi8(chunk, cr);
+        match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, lf));
+        match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, lt));
+        if (int mask = _mm_movemask_epi8(match); mask != 0)
+            return pos + std::countr_zero(unsigned(mask));
+    }
+#endif
+    for (; pos < input.size(); ++pos)
+        if (input[pos] == '\r' || input[pos] == '\n' || input[pos] == '<')
+            return pos;
+    return input.size();
+}
 
 std::string GMD_EscapeEntryJV(std::string_view input)
 {
-    std::string result;
-    result.reserve(input.size() * 1.5);
+    // Count specials first: each one grows by at most 8 bytes ("\n" -> "<LF/>\n",
+    // "<>" -> "<JV1234/>"), so the body is written without reallocation.
+    size_t specialCount = 0;
+    for (size_t pos = FindSpecial(input, 0); pos < input.size();
+         pos = FindSpecial(input, pos + 1))
+        ++specialCount;
 
-    // An abbreviation is <JV123>
-    std::vector<std::pair<std::string, std::string_view>> abbrText;
+    std::string result;
+    result.reserve(input.size() + 8 * specialCount + JV_TRAILER.size() + 64);
 
-    constexpr std::string_view SPECIAL = "\r\n<";
-    constexpr std::string_view PAGE = "<PAGE>";
+    // An abbreviation is <JV123/>, for a run of tags other than <PAGE>.
+    std::vector<std::string_view> abbrText;
 
-    while (input.size() > 0)
+    size_t pos = 0;
+    while (true)
     {
-        size_t notSpecialCount = input.find_first_of(SPECIAL);
-        result += input.substr(0, notSpecialCount);
-        if (notSpecialCount >= input.size())
+        size_t next = FindSpecial(input, pos);
+        result.append(input.substr(pos, next - pos));
+        if (next >= input.size())
             break;
-        input.remove_prefix(notSpecialCount);
+        pos = next;
 
-        if (input[0] == '\r')
+        std::string_view rest = input.substr(pos);
+        if (rest.starts_with("\r\n"))
         {
-            input.remove_prefix(1);
+            result += "<LINE/>\n";
+            pos += 2;
         }
-        else if (input[0] == '\n')
+        else if (rest[0] == '\r')
         {
-            result += "<LINE/>\n";
-            input.remove_prefix(1);
+            result += "<CR/>";
+            pos += 1;
+        }
+        else if (rest[0] == '\n')
+        {
+            result += "<LF/>\n";
+            pos += 1;
+        }
+        else if (rest.starts_with(JV_PAGE))
+        {
+            result += "<PAGE/>\n\n";
+            pos += JV_PAGE.size();
         }
         else
         {
-            size_t specialCount = 0;
-            for (std::string_view next = input;
-                 next.starts_with('<') && !next.starts_with(PAGE);)
-            {
-                size_t closingPos = next.find('>');
-                if (closingPos == input.npos)
-                    throw runtime_error("Unclosed angle brackets");
-                specialCount += closingPos + 1;
-                next.remove_prefix(closingPos + 1);
-            }
-            if (specialCount > 0)
-            {
-                std::string_view special = input.substr(0, specialCount);
-                input.remove_prefix(specialCount);
-                std::string abbr = fmt::format("<JV{}/>", abbrText.size());
-                result += abbr;
-                abbrText.emplace_back(std::move(abbr), special);
-            }
-            if (input.starts_with(PAGE))
+            // An unclosed '<' is kept in the abbreviation, so the text is unchanged.
+            size_t end = pos;
+            while (end < input.size() && input[end] == '<' &&
+                   !input.substr(end).starts_with(JV_PAGE))
             {
-                result += "<PAGE/>\n\n";
-                input.remove_prefix(PAGE.size());
-                while (input.starts_with('\r') || input.starts_with('\n'))
-                    input.remove_prefix(1);
+                size_t closingPos = input.find('>', end);
+                end = (closingPos == input.npos) ? input.size() : closingPos + 1;
             }
+            fmt::format_to(std::back_inserter(result), "<JV{}/>", abbrText.size());
+            abbrText.push_back(input.substr(pos, end - pos));
+            pos = end;
         }
     }
 
     /// Used to know when a file has been modified.
-    int64_t originalHash = std::hash<std::string>{}(result);
-
-    using namespace rapidjson;
-    StringBuffer buffer;
-    PrettyWriter<StringBuffer> json(buffer);
-    json.StartObject();
-    json.Key("__originalHash__");
-    json.Int64(originalHash);
-    for (auto& [abbr, text] : abbrText)
+    uint32_t originalHash = crc32(0, result.data(), result.size());
+
+    result += JV_TRAILER;
+    fmt::format_to(std::back_inserter(result), "{{\n    \"__originalHash__\": {}",
+                   originalHash);
+    for (size_t i = 0; i < abbrText.size(); ++i)
+    {
+        fmt::format_to(std::back_inserter(result), ",\n    \"<JV{}/>\": ", i);
+        AppendJsonString(result, abbrText[i]);
+    }
+    result += "\n}\n-->";
+
+    return result;
+}
+
+std::string GMD_UnescapeEntryJV(std::string_view input)
+{
+    std::string_view body = input;
+    std::unordered_map<std::string, std::string> abbreviations;
+
+    if (size_t trailerPos = input.rfind(JV_TRAILER); trailerPos != input.npos)
     {
-        json.Key(abbr.c_str());
-        json.String(text.data(), text.size());
+        body = input.substr(0, trailerPos);
+        std::string_view json = input.substr(trailerPos + JV_TRAILER.size());
+
+        size_t pos = 0;
+        for (auto& [key, value] : ParseJsonObject(json, pos))
+            abbreviations[std::move(key)] = std::move(value);
     }
-    json.EndObject();
 
-    result += "\n<!--\n==========JV==========\n";
-    result += buffer.GetString();
-    result += "\n-->";
+    std::string result;
+    result.reserve(body.size());
+
+    size_t pos = 0;
+    while (true)
+    {
+        size_t next = FindSpecial(body, pos);
+        result.append(body.substr(pos, next - pos));
+        if (next >= body.size())
+            break;
+        pos = next;
+
+        // Line breaks are insignificant, only the tags are.
+        if (body[pos] != '<')
+        {
+            ++pos;
+            continue;
+        }
+
+        size_t closingPos = body.find('>', pos);
+        if (closingPos == body.npos)
+            throw runtime_error("Unclosed angle brackets: {:?}", body.substr(pos, 32));
+        std::string_view tag = body.substr(pos, closingPos + 1 - pos);
+        pos = closingPos + 1;
+
+        if (tag == "<LINE/>")
+            result += "\r\n";
+        else if (tag == "<LF/>")
+            result += '\n';
+        else if (tag == "<CR/>")
+            result += '\r';
+        else if (tag == "<PAGE/>")
+            result += JV_PAGE;
+        else if (auto it = abbreviations.find(std::string(tag));
+                 it != abbreviations.end())
+            result += it->second;
+        else if (tag.starts_with("<JV") && tag.ends_with("/>"))
+            throw runtime_error("Abbreviation {} not in the trailer", tag);
+        else
+            result += tag; // Game tags may also be written directly.
+    }
 
     return result;
 }
-*/
\ No newline at end of file
+
+GMD_Registry GMD_LoadArcEntry(ARC_Entry const& entry)
+{
+    std::string decompressed;
+    if (entry.isCompressed)
+        decompressed = ARC_Entry::Decompress(entry.content, entry.decompSize);
+    span_reader gmdStream{entry.filename,
+                          entry.isCompressed ? decompressed : entry.content};
+    GMD_Registry gmd;
+    gmd.Load(gmdStream);
+    return gmd;
+}
+
+void GMD_ForEachInArc(fs::path const& arcFile, GMD_ArcEntryFunc const& func)
+{
+    file_reader arcStream{arcFile};
+    ARC_Archive arc;
+    for (ARC_TocEntry const& tocEntry : arc.LoadTOC(arcStream))
+    {
+        if (tocEntry.ext != ARC_ExtensionHash::GMD)
+            continue;
+        GMD_Registry gmd = GMD_LoadArcEntry(ARC_Archive::LoadEntry(arcStream, tocEntry));
+        func(tocEntry, gmd);
+    }
+}
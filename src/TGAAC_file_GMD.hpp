@@ -6,8 +6,12 @@
 
 #include "Utility.hpp"
 
+#include <functional>
 #include <map>
 
+/// A registry owns its strings, as GMD files are loaded one at a time.
+/// Commands keeping lines of many GMD files, like align and the search index,
+/// intern them in a string_pool instead.
 struct GMD_Entry
 {
     std::string key;
@@ -24,18 +28,63 @@ struct GMD_Registry
     std::vector<GMD_Entry> entries;
     uint64_t _padding; ///< Only relevant for byte-equal Load/Save
 
-    void Load(stream_ptr& in);
+    /// Instantiated for stream_ptr, span_reader and file_reader.
+    template <typename TReader>
+    void Load(TReader& in);
     void Save(stream_ptr& out) const;
 
+    /// Exact byte size of the GMD file produced by Save().
+    int64_t ComputeSize() const;
+    /// Serializes into a single buffer allocated once with ComputeSize().
+    std::string Save() const;
+
     bool operator==(GMD_Registry const&) const noexcept = default;
 };
 
-/// Modifies the given GMD to make edition more easier:
-/// - Line breaks are made insignificant.
-/// - Long event sequences <E123><E456> are converted to <JV123>
+/// Hashes of a label key, as stored in GMD files.
+/// hash0 selects the bucket, hash1 and hash2 identify the label.
+struct GMD_LabelHash
+{
+    uint32_t hash0;
+    uint32_t hash1;
+    uint32_t hash2;
+
+    bool operator==(GMD_LabelHash const&) const noexcept = default;
+};
+
+GMD_LabelHash GMD_HashLabel(std::string_view key);
+
+/// Control tags of a GMD value, such as <E123> or <PAGE>.
+struct GMD_TagList
+{
+    std::vector<std::string_view> tags; ///< In order, without <PAGE>.
+    uint32_t pageCount = 0;             ///< Number of <PAGE>.
+    bool unclosed = false;              ///< Whether it ends with '<' without '>'.
+};
+
+/// Finds all tags of a value, in a single pass.
+GMD_TagList GMD_ScanTags(std::string_view value);
+
+/// Modifies the given GMD value to make edition more easier:
+/// - Line breaks are made insignificant, the original ones become
+///   <LINE/> (CRLF), <LF/> and <CR/>, and <PAGE> becomes <PAGE/>.
+/// - Long event sequences <E123><E456> are converted to <JV123/>,
+///   their text is in a JSON trailer at the end.
 std::string GMD_EscapeEntryJV(std::string_view input);
 
-/// Reverts the operation of GMD_EscapeEntryJV
+/// Reverts the operation of GMD_EscapeEntryJV, exactly.
+/// Other tags are kept as-is, but a <JV123/> not in the trailer throws.
 std::string GMD_UnescapeEntryJV(std::string_view input);
 
+struct ARC_Entry;
+struct ARC_TocEntry;
+using GMD_ArcEntryFunc = std::function<void(ARC_TocEntry const&, GMD_Registry&)>;
+
+/// Decompresses a GMD entry of an ARC file if needed, then parses it.
+GMD_Registry GMD_LoadArcEntry(ARC_Entry const& entry);
+
+/// Calls func(tocEntry, gmd) for each GMD entry of an ARC file, in order.
+/// Only the table of content and the GMD entries are read.
+void GMD_ForEachInArc(fs::path const& arcFile, GMD_ArcEntryFunc const& func);
+
 #endif
@@ -0,0 +1,99 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_fonts.hpp"
+#include "TGAAC_file_ARC.hpp"
+#include "TGAAC_file_GMD.hpp"
+#include "Utf8.hpp"
+#include <unordered_map>
+
+/// See DecodeUtf8().
+static bool IsInvalidUtf8(char32_t codepoint)
+{
+    return codepoint >= 0xDC80 && codepoint <= 0xDCFF;
+}
+
+static TGAAC_FontCoverage AnalyzeArchive(fs::path const& installFolder,
+                                         fs::path const& arcPath)
+{
+    TGAAC_FontCoverage coverage;
+    std::unordered_map<uint32_t, std::unordered_map<char32_t, uint64_t>> histograms;
+    GMD_ForEachInArc(installFolder / arcPath, [&](ARC_TocEntry const& tocEntry,
+                                                  GMD_Registry& gmd) {
+        auto& histogram = histograms[gmd.language];
+        for (GMD_Entry const& gmdEntry : gmd.entries)
+        {
+            // Tags like <E12> are not displayed.
+            bool inTag = false;
+            ForEachCodepoint(gmdEntry.value, [&](char32_t codepoint, size_t pos) {
+                if (IsInvalidUtf8(codepoint))
+                    coverage.invalidUtf8.push_back({arcPath.generic_string(),
+                                                    tocEntry.filename, gmdEntry.key, pos,
+                                                    uint8_t(codepoint & 0xFF)});
+                else if (codepoint == '<')
+                    inTag = true;
+                else if (codepoint == '>' && inTag)
+                    inTag = false;
+                else if (!inTag && codepoint >= 0x20 && codepoint != 0x7F)
+                    ++histogram[codepoint];
+            });
+        }
+    });
+
+    for (auto& [language, histogram] : histograms)
+        coverage.histograms[language].insert(histogram.begin(), histogram.end());
+    return coverage;
+}
+
+TGAAC_FontCoverage TGAAC_AnalyzeFontCoverage(fs::path const& installFolder)
+{
+    std::vector<fs::path> arcPaths;
+    for (fs::path const& p : fs::recursive_directory_iterator(installFolder))
+        if (p.extension() == ".arc")
+            arcPaths.push_back(fs::relative(p, installFolder));
+    std::ranges::sort(arcPaths);
+
+    // One task per ARC file, each one with its own histograms to avoid locking.
+    std::vector<TGAAC_FontCoverage> archiveCoverages(arcPaths.size());
+    ParallelFor(arcPaths.size(), [&](size_t i) {
+        archiveCoverages[i] = AnalyzeArchive(installFolder, arcPaths[i]);
+    });
+
+    TGAAC_FontCoverage coverage;
+    for (TGAAC_FontCoverage& archiveCoverage : archiveCoverages)
+    {
+        for (auto& [language, archiveHistogram] : archiveCoverage.histograms)
+        {
+            TGAAC_Histogram& histogram = coverage.histograms[language];
+            for (auto [codepoint, count] : archiveHistogram)
+                histogram[codepoint] += count;
+        }
+        std::ranges::move(archiveCoverage.invalidUtf8,
+                          std::back_inserter(coverage.invalidUtf8));
+    }
+    return coverage;
+}
+
+std::set<char32_t> TGAAC_LoadGlyphList(fs::path const& glyphFile)
+{
+    std::string text = file_reader{glyphFile}.ReadAll();
+
+    std::set<char32_t> glyphs;
+    ForEachCodepoint(text, [&](char32_t codepoint, size_t pos) {
+        if (IsInvalidUtf8(codepoint))
+            throw runtime_error("{}: invalid UTF-8 at byte {}", glyphFile.string(), pos);
+        if (codepoint != '\r' && codepoint != '\n')
+            glyphs.insert(codepoint);
+    });
+    return glyphs;
+}
+
+std::vector<char32_t> TGAAC_MissingGlyphs(TGAAC_Histogram const& histogram,
+                                          std::set<char32_t> const& glyphs)
+{
+    std::vector<char32_t> missing;
+    for (auto [codepoint, count] : histogram)
+        if (!glyphs.contains(codepoint))
+            missing.push_back(codepoint);
+    return missing;
+}
@@ -0,0 +1,45 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_FONTS_H
+#define JV_TGAAC_FONTS_H
+
+/// This file contains the analysis of the codepoints used by the lines,
+/// to check that the fonts of the game have a glyph for each of them.
+
+#include <map>
+#include <set>
+
+#include "Utility.hpp"
+
+/// An invalid UTF-8 byte found in a line.
+struct TGAAC_InvalidUtf8
+{
+    std::string archive; ///< ARC file, relative to the install folder.
+    std::string gmd;     ///< GMD entry name in the ARC.
+    std::string key;
+    size_t offset; ///< Position of the byte in the line.
+    uint8_t byte;
+};
+
+/// Codepoint histogram of a language.
+using TGAAC_Histogram = std::map<char32_t, uint64_t>;
+
+struct TGAAC_FontCoverage
+{
+    /// By GMD_Registry::language. Control characters and tags are not counted.
+    std::map<uint32_t, TGAAC_Histogram> histograms;
+    std::vector<TGAAC_InvalidUtf8> invalidUtf8;
+};
+
+/// Decodes all lines of the install folder, one ARC file per task on all cores.
+TGAAC_FontCoverage TGAAC_AnalyzeFontCoverage(fs::path const& installFolder);
+
+/// Codepoints of a UTF-8 text file, line breaks excluded.
+std::set<char32_t> TGAAC_LoadGlyphList(fs::path const& glyphFile);
+
+/// Codepoints of the histogram which are not in the glyph list, in order.
+std::vector<char32_t> TGAAC_MissingGlyphs(TGAAC_Histogram const& histogram,
+                                          std::set<char32_t> const& glyphs);
+
+#endif
@@ -0,0 +1,376 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_index.hpp"
+#include "FileSchema.hpp"
+
+#include <numeric>
+
+// Index file layout, all little-endian:
+// - IDX_FileHeader
+// - IDX_FileArchive[archiveCount]
+// - IDX_FileEntry[entryCount], sorted by nameHash
+// - IDX_FileLabel[labelCount], sorted by (hash1, hash2)
+// - strings, referred by (offset, size) from the records
+
+struct IDX_FileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t archiveCount;
+    uint32_t entryCount;
+    uint32_t labelCount;
+    uint32_t stringsSize;
+};
+
+struct IDX_FileArchive
+{
+    uint32_t pathOffset;
+    uint32_t pathSize;
+};
+
+struct IDX_FileEntry
+{
+    uint32_t nameHash; ///< crc32 of the filename
+    uint32_t archiveID;
+    uint32_t nameOffset;
+    uint32_t nameSize;
+    uint32_t extensionHash;
+    uint32_t offset;
+    uint32_t compSize;
+    uint32_t decompSize; ///< As in ARC_FileEntry, unknownFlags in the upper byte.
+};
+
+struct IDX_FileLabel
+{
+    uint32_t hash1;
+    uint32_t hash2;
+    uint32_t entryID;
+    uint32_t sectionID;
+    uint32_t keyOffset; ///< Different keys may have the same hash.
+    uint32_t keySize;
+};
+
+static constexpr uint32_t IDX_VERSION = 2;
+
+template <>
+struct file_schema<IDX_FileArchive>
+{
+    static constexpr size_t size = 8;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(IDX_FileArchive, pathOffset, 0),
+        JV_SCHEMA_FIELD(IDX_FileArchive, pathSize, 4),
+    };
+};
+
+template <>
+struct file_schema<IDX_FileEntry>
+{
+    static constexpr size_t size = 32;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(IDX_FileEntry, nameHash, 0),
+        JV_SCHEMA_FIELD(IDX_FileEntry, archiveID, 4),
+        JV_SCHEMA_FIELD(IDX_FileEntry, nameOffset, 8),
+        JV_SCHEMA_FIELD(IDX_FileEntry, nameSize, 12),
+        JV_SCHEMA_FIELD(IDX_FileEntry, extensionHash, 16),
+        JV_SCHEMA_FIELD(IDX_FileEntry, offset, 20),
+        JV_SCHEMA_FIELD(IDX_FileEntry, compSize, 24),
+        JV_SCHEMA_FIELD(IDX_FileEntry, decompSize, 28),
+    };
+};
+
+template <>
+struct file_schema<IDX_FileLabel>
+{
+    static constexpr size_t size = 24;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(IDX_FileLabel, hash1, 0),
+        JV_SCHEMA_FIELD(IDX_FileLabel, hash2, 4),
+        JV_SCHEMA_FIELD(IDX_FileLabel, entryID, 8),
+        JV_SCHEMA_FIELD(IDX_FileLabel, sectionID, 12),
+        JV_SCHEMA_FIELD(IDX_FileLabel, keyOffset, 16),
+        JV_SCHEMA_FIELD(IDX_FileLabel, keySize, 20),
+    };
+};
+
+template <>
+struct file_schema<IDX_FileHeader>
+{
+    static constexpr size_t size = 24;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(IDX_FileHeader, magic, 0),
+        JV_SCHEMA_FIELD(IDX_FileHeader, version, 4),
+        JV_SCHEMA_FIELD(IDX_FileHeader, archiveCount, 8),
+        JV_SCHEMA_FIELD(IDX_FileHeader, entryCount, 12),
+        JV_SCHEMA_FIELD(IDX_FileHeader, labelCount, 16),
+        JV_SCHEMA_FIELD(IDX_FileHeader, stringsSize, 20),
+    };
+
+    template <typename TStream>
+    static void Validate(IDX_FileHeader const& header, TStream& idx)
+    {
+        if (memcmp(header.magic, "JVIX", 4) != 0)
+            idx.Error("not starting with 'JVIX'");
+
+        if (header.version != IDX_VERSION)
+            idx.Error("bad index version {} (expected {}), please rebuild it",
+                      header.version, IDX_VERSION);
+
+        int64_t expectedSize = size + header.stringsSize;
+        expectedSize += int64_t(header.archiveCount) * file_schema<IDX_FileArchive>::size;
+        expectedSize += int64_t(header.entryCount) * file_schema<IDX_FileEntry>::size;
+        expectedSize += int64_t(header.labelCount) * file_schema<IDX_FileLabel>::size;
+        if (expectedSize != idx.Size())
+            idx.Error("bad file size {} (expected {})", idx.Size(), expectedSize);
+    }
+};
+
+/// Decodes the i-th record of a table, directly from the mapping.
+template <typename T>
+static T GetRecord(std::string_view table, size_t i)
+{
+    constexpr size_t size = file_schema<T>::size;
+    T record;
+    DecodeRecords(table.substr(i * size, size), std::span{&record, 1});
+    return record;
+}
+
+/// First index in [0, count) for which GetRecord<T>(table, i) is not less than 'value'.
+template <typename T, typename TKey>
+static size_t LowerBound(std::string_view table, TKey value, TKey (*funcKey)(T const&))
+{
+    size_t first = 0;
+    size_t count = table.size() / file_schema<T>::size;
+    while (count > 0)
+    {
+        size_t half = count / 2;
+        if (funcKey(GetRecord<T>(table, first + half)) < value)
+        {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else
+        {
+            count = half;
+        }
+    }
+    return first;
+}
+
+static uint32_t HashName(std::string_view filename)
+{
+    return crc32(0, filename.data(), filename.size());
+}
+
+void TGAAC_BuildIndex(fs::path const& installFolder, fs::path const& indexFile)
+{
+    std::vector<fs::path> arcPaths;
+    for (fs::path const& p : fs::recursive_directory_iterator(installFolder))
+        if (p.extension() == ".arc")
+            arcPaths.push_back(fs::relative(p, installFolder));
+    std::ranges::sort(arcPaths);
+
+    std::string strings;
+    auto funcAddString = [&](std::string_view str) {
+        uint32_t offset = strings.size();
+        strings += str;
+        return offset;
+    };
+
+    std::vector<IDX_FileArchive> archives;
+    std::vector<IDX_FileEntry> entries;
+    std::vector<IDX_FileLabel> labels; // entryID is the index before sorting entries
+
+    for (fs::path const& arcPath : arcPaths)
+    {
+        std::string path = arcPath.generic_string();
+        uint32_t archiveID = archives.size();
+        archives.push_back({funcAddString(path), uint32_t(path.size())});
+
+        file_reader arcStream{installFolder / arcPath};
+        ARC_Archive arc;
+        for (ARC_TocEntry const& toc : arc.LoadTOC(arcStream))
+        {
+            uint32_t entryID = entries.size();
+            IDX_FileEntry& e = entries.emplace_back();
+            e.nameHash = HashName(toc.filename);
+            e.archiveID = archiveID;
+            e.nameOffset = funcAddString(toc.filename);
+            e.nameSize = toc.filename.size();
+            e.extensionHash = (uint32_t)toc.ext;
+            e.offset = toc.offset;
+            e.compSize = toc.compSize;
+            e.decompSize = toc.decompSize | ((uint32_t)toc.unknownFlags << 24);
+
+            if (toc.ext != ARC_ExtensionHash::GMD)
+                continue;
+
+            GMD_Registry gmd = GMD_LoadArcEntry(ARC_Archive::LoadEntry(arcStream, toc));
+
+            for (uint32_t sectionID = 0; sectionID < gmd.entries.size(); ++sectionID)
+            {
+                std::string const& key = gmd.entries[sectionID].key;
+                GMD_LabelHash hash = GMD_HashLabel(key);
+                labels.push_back({hash.hash1, hash.hash2, entryID, sectionID,
+                                  funcAddString(key), uint32_t(key.size())});
+            }
+        }
+    }
+
+    // Sort entries by name hash, then remap and sort labels.
+
+    std::vector<uint32_t> order(entries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, {}, [&](uint32_t i) { return entries[i].nameHash; });
+
+    std::vector<uint32_t> newEntryIDs(entries.size());
+    std::vector<IDX_FileEntry> sortedEntries;
+    sortedEntries.reserve(entries.size());
+    for (uint32_t i : order)
+    {
+        newEntryIDs[i] = sortedEntries.size();
+        sortedEntries.push_back(entries[i]);
+    }
+
+    for (IDX_FileLabel& label : labels)
+        label.entryID = newEntryIDs[label.entryID];
+    std::ranges::sort(labels, {}, [](IDX_FileLabel const& l) {
+        return std::tuple{l.hash1, l.hash2, l.entryID, l.sectionID};
+    });
+
+    // Write the index.
+
+    IDX_FileHeader header;
+    memcpy(header.magic, "JVIX", 4);
+    header.version = IDX_VERSION;
+    header.archiveCount = archives.size();
+    header.entryCount = sortedEntries.size();
+    header.labelCount = labels.size();
+    header.stringsSize = strings.size();
+
+    file_writer out{indexFile};
+    WriteRecords(out, std::span<IDX_FileHeader const>{&header, 1});
+    WriteRecords(out, std::span<IDX_FileArchive const>{archives});
+    WriteRecords(out, std::span<IDX_FileEntry const>{sortedEntries});
+    WriteRecords(out, std::span<IDX_FileLabel const>{labels});
+    out.Write(std::span{strings});
+
+    fmt::print("Indexed {} entries and {} labels from {} ARC files\n",
+               sortedEntries.size(), labels.size(), archives.size());
+}
+
+TGAAC_Index::TGAAC_Index(fs::path const& indexFile) : m_file{indexFile}
+{
+    std::string_view bytes = m_file.Bytes();
+    span_reader idx{std::string{m_file.Name()}, bytes};
+
+    IDX_FileHeader header;
+    ReadRecords(idx, std::span{&header, 1});
+
+    m_archives = idx.ReadView(header.archiveCount * file_schema<IDX_FileArchive>::size);
+    m_entries = idx.ReadView(header.entryCount * file_schema<IDX_FileEntry>::size);
+    m_labels = idx.ReadView(header.labelCount * file_schema<IDX_FileLabel>::size);
+    m_strings = idx.ReadView(header.stringsSize);
+}
+
+size_t TGAAC_Index::ArchiveCount() const noexcept
+{
+    return m_archives.size() / file_schema<IDX_FileArchive>::size;
+}
+
+size_t TGAAC_Index::EntryCount() const noexcept
+{
+    return m_entries.size() / file_schema<IDX_FileEntry>::size;
+}
+
+size_t TGAAC_Index::LabelCount() const noexcept
+{
+    return m_labels.size() / file_schema<IDX_FileLabel>::size;
+}
+
+std::string_view TGAAC_Index::GetString(uint32_t offset, uint32_t size) const
+{
+    if (offset > m_strings.size() || size > m_strings.size() - offset)
+        throw runtime_error("{}: string out of bounds", m_file.Name());
+    return m_strings.substr(offset, size);
+}
+
+TGAAC_IndexEntry TGAAC_Index::GetEntry(uint32_t entryID) const
+{
+    if (entryID >= EntryCount())
+        throw runtime_error("{}: entry {} out of bounds", m_file.Name(), entryID);
+    IDX_FileEntry e = GetRecord<IDX_FileEntry>(m_entries, entryID);
+
+    if (e.archiveID >= ArchiveCount())
+        throw runtime_error("{}: archive {} out of bounds", m_file.Name(), e.archiveID);
+    IDX_FileArchive a = GetRecord<IDX_FileArchive>(m_archives, e.archiveID);
+
+    TGAAC_IndexEntry result;
+    result.archive = GetString(a.pathOffset, a.pathSize);
+    result.toc.filename = GetString(e.nameOffset, e.nameSize);
+    result.toc.ext = ARC_ExtensionHash{e.extensionHash};
+    result.toc.offset = e.offset;
+    result.toc.compSize = e.compSize;
+    result.toc.decompSize = e.decompSize & 0x00FFFFFF;
+    result.toc.unknownFlags = (e.decompSize >> 24);
+    result.toc.isCompressed = (e.decompSize != e.compSize);
+    return result;
+}
+
+std::vector<TGAAC_IndexEntry> TGAAC_Index::FindEntries(std::string_view filename) const
+{
+    uint32_t nameHash = HashName(filename);
+    auto funcKey = [](IDX_FileEntry const& e) { return e.nameHash; };
+
+    std::vector<TGAAC_IndexEntry> result;
+    for (size_t i = LowerBound<IDX_FileEntry, uint32_t>(m_entries, nameHash, funcKey);
+         i < EntryCount() && GetRecord<IDX_FileEntry>(m_entries, i).nameHash == nameHash;
+         ++i)
+    {
+        TGAAC_IndexEntry entry = GetEntry(i);
+        if (entry.toc.filename == filename)
+            result.push_back(std::move(entry));
+    }
+    return result;
+}
+
+std::vector<TGAAC_IndexLabel> TGAAC_Index::FindLabel(std::string_view key) const
+{
+    GMD_LabelHash hash = GMD_HashLabel(key);
+    uint64_t value = (uint64_t(hash.hash1) << 32) | hash.hash2;
+    auto funcKey = [](IDX_FileLabel const& l) {
+        return (uint64_t(l.hash1) << 32) | l.hash2;
+    };
+
+    std::vector<TGAAC_IndexLabel> result;
+    for (size_t i = LowerBound<IDX_FileLabel, uint64_t>(m_labels, value, funcKey);
+         i < LabelCount(); ++i)
+    {
+        IDX_FileLabel label = GetRecord<IDX_FileLabel>(m_labels, i);
+        if (funcKey(label) != value)
+            break;
+        if (GetString(label.keyOffset, label.keySize) == key)
+            result.push_back(
+                {GetEntry(label.entryID), label.sectionID, std::string(key)});
+    }
+    return result;
+}
+
+GMD_Entry TGAAC_LoadIndexedLabel(fs::path const& installFolder,
+                                 TGAAC_IndexLabel const& label)
+{
+    file_reader arcStream{installFolder / label.entry.archive};
+    GMD_Registry gmd =
+        GMD_LoadArcEntry(ARC_Archive::LoadEntry(arcStream, label.entry.toc));
+
+    if (label.sectionID < gmd.entries.size() &&
+        gmd.entries[label.sectionID].key == label.key)
+        return std::move(gmd.entries[label.sectionID]);
+
+    // The index is outdated, but the label may have moved in the same GMD.
+    auto it = std::ranges::find(gmd.entries, label.key, &GMD_Entry::key);
+    if (it == gmd.entries.end())
+        throw runtime_error("{}: label {:?} not found, the index may be outdated",
+                            label.entry.toc.filename, label.key);
+    return std::move(*it);
+}
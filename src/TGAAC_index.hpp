@@ -0,0 +1,64 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_INDEX_H
+#define JV_TGAAC_INDEX_H
+
+/// This file contains the game-wide index of ARC entries and GMD labels,
+/// to know which ARC file to open without loading all of them.
+
+#include "TGAAC_file_ARC.hpp"
+#include "TGAAC_file_GMD.hpp"
+#include "Utility.hpp"
+
+/// An ARC entry found in the index.
+struct TGAAC_IndexEntry
+{
+    fs::path archive; ///< ARC file, relative to the install folder.
+    ARC_TocEntry toc; ///< Enough to read the entry with ARC_Archive::LoadEntry().
+};
+
+/// A GMD label found in the index.
+struct TGAAC_IndexLabel
+{
+    TGAAC_IndexEntry entry; ///< GMD containing the label.
+    uint32_t sectionID;     ///< Index of the label in GMD_Registry::entries.
+    std::string key;
+};
+
+/// Scans all ARC files of the install folder once, and writes the index file.
+void TGAAC_BuildIndex(fs::path const& installFolder, fs::path const& indexFile);
+
+/// Index file written by TGAAC_BuildIndex(), mapped in memory.
+/// Nothing is parsed upfront, lookups are binary searches in the mapping.
+class TGAAC_Index
+{
+    mapped_file m_file;
+    std::string_view m_archives;
+    std::string_view m_entries;
+    std::string_view m_labels;
+    std::string_view m_strings;
+
+  public:
+    explicit TGAAC_Index(fs::path const& indexFile);
+
+    size_t ArchiveCount() const noexcept;
+    size_t EntryCount() const noexcept;
+    size_t LabelCount() const noexcept;
+
+    /// All ARC entries with the given filename (without extension).
+    std::vector<TGAAC_IndexEntry> FindEntries(std::string_view filename) const;
+    /// All GMD labels with the given key.
+    std::vector<TGAAC_IndexLabel> FindLabel(std::string_view key) const;
+
+  private:
+    TGAAC_IndexEntry GetEntry(uint32_t entryID) const;
+    std::string_view GetString(uint32_t offset, uint32_t size) const;
+};
+
+/// Reads only the ARC file containing the label, and returns its entry. If the entry
+/// at 'sectionID' has another key, it is searched in the GMD, else this throws.
+GMD_Entry TGAAC_LoadIndexedLabel(fs::path const& installFolder,
+                                 TGAAC_IndexLabel const& label);
+
+#endif
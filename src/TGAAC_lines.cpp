@@ -0,0 +1,657 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_lines.hpp"
+#include "TGAAC_file_ARC.hpp"
+#include "TGAAC_file_GMD.hpp"
+#include "StringPool.hpp"
+#include <unordered_map>
+#include <unordered_set>
+
+static constexpr std::string_view CSV_HEADER = "archive,gmd,key,value";
+static constexpr std::string_view PO_HEADER =
+    "msgid \"\"\nmsgstr \"Content-Type: text/plain; charset=UTF-8\\n\"\n\n";
+
+TGAAC_LinesFormat TGAAC_LinesFormatFromPath(fs::path const& linesFile)
+{
+    fs::path ext = linesFile.extension();
+    if (ext == ".csv")
+        return TGAAC_LinesFormat::CSV;
+    if (ext == ".po")
+        return TGAAC_LinesFormat::PO;
+    if (ext == ".jsonl")
+        return TGAAC_LinesFormat::JSONL;
+    throw runtime_error("Unknown lines format {:?}, expected .csv, .po or .jsonl",
+                        ext.string());
+}
+
+// ==================== Writing ====================
+
+static void AppendCSVField(std::string& out, std::string_view field)
+{
+    if (field.find_first_of(",\"\r\n") == field.npos)
+    {
+        out += field;
+        return;
+    }
+    out += '"';
+    for (char c : field)
+    {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+static void AppendPOString(std::string& out, std::string_view str)
+{
+    out += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (uint8_t(c) < 0x20)
+                fmt::format_to(std::back_inserter(out), "\\{:03o}", int(c));
+            else
+                out += c;
+        }
+    }
+    out += '"';
+}
+
+static void AppendLine(std::string& out, TGAAC_LinesFormat format, TGAAC_Line const& line)
+{
+    switch (format)
+    {
+    case TGAAC_LinesFormat::CSV:
+        AppendCSVField(out, line.archive);
+        out += ',';
+        AppendCSVField(out, line.gmd);
+        out += ',';
+        AppendCSVField(out, line.key);
+        out += ',';
+        AppendCSVField(out, line.value);
+        out += '\n';
+        break;
+    case TGAAC_LinesFormat::PO:
+        out += "msgctxt ";
+        AppendPOString(out, fmt::format("{}|{}|{}", line.archive, line.gmd, line.key));
+        out += "\nmsgid ";
+        AppendPOString(out, line.value);
+        out += "\nmsgstr \"\"\n\n";
+        break;
+    case TGAAC_LinesFormat::JSONL:
+        out += "{\"archive\":";
+        AppendJsonString(out, line.archive);
+        out += ",\"gmd\":";
+        AppendJsonString(out, line.gmd);
+        out += ",\"key\":";
+        AppendJsonString(out, line.key);
+        out += ",\"value\":";
+        AppendJsonString(out, line.value);
+        out += "}\n";
+        break;
+    }
+}
+
+/// ARC files of the install folder, relative to it and sorted.
+static std::vector<fs::path> FindArchives(fs::path const& installFolder)
+{
+    std::vector<fs::path> arcPaths;
+    for (fs::path const& p : fs::recursive_directory_iterator(installFolder))
+        if (p.extension() == ".arc")
+            arcPaths.push_back(fs::relative(p, installFolder));
+    std::ranges::sort(arcPaths);
+    return arcPaths;
+}
+
+size_t TGAAC_ExportLines(fs::path const& installFolder, fs::path const& linesFile)
+{
+    TGAAC_LinesFormat format = TGAAC_LinesFormatFromPath(linesFile);
+
+    file_writer out{linesFile};
+    std::string buffer;
+    if (format == TGAAC_LinesFormat::CSV)
+        buffer = fmt::format("{}\n", CSV_HEADER);
+    else if (format == TGAAC_LinesFormat::PO)
+        buffer = PO_HEADER;
+
+    size_t nbLines = 0;
+    TGAAC_Line line;
+    for (fs::path const& arcPath : FindArchives(installFolder))
+    {
+        line.archive = arcPath.generic_string();
+        GMD_ForEachInArc(installFolder / arcPath, [&](ARC_TocEntry const& tocEntry,
+                                                      GMD_Registry& gmd) {
+            line.gmd = tocEntry.filename;
+            for (GMD_Entry const& gmdEntry : gmd.entries)
+            {
+                line.key = gmdEntry.key;
+                line.value = gmdEntry.value;
+                AppendLine(buffer, format, line);
+                ++nbLines;
+            }
+        });
+
+        // Written once per ARC file, so that memory does not grow with the game.
+        out.Write(std::span{buffer});
+        buffer.clear();
+    }
+
+    out.Write(std::span{buffer});
+    out.Sync();
+    return nbLines;
+}
+
+// ==================== Reading ====================
+
+/// Reads the fields of one CSV record, which may span several lines.
+static bool ReadCSVRecord(file_reader& in, std::vector<std::string>& fields)
+{
+    std::string text;
+    if (!in.ReadLine(text))
+        return false;
+
+    fields.assign(1, {});
+    bool quoted = false;
+    for (size_t pos = 0;;)
+    {
+        if (pos == text.size())
+        {
+            if (!quoted)
+                return true;
+            // The line break is part of the quoted field.
+            fields.back() += '\n';
+            if (!in.ReadLine(text))
+                in.Error("Unterminated quoted field in CSV");
+            pos = 0;
+            continue;
+        }
+
+        char c = text[pos++];
+        if (quoted)
+        {
+            if (c != '"')
+                fields.back() += c;
+            else if (pos < text.size() && text[pos] == '"')
+                fields.back() += text[pos++];
+            else
+                quoted = false;
+        }
+        else if (c == '"')
+            quoted = true;
+        else if (c == ',')
+            fields.emplace_back();
+        else if (c != '\r' || pos != text.size()) // Ignores CRLF line endings.
+            fields.back() += c;
+    }
+}
+
+static std::string ParsePOString(file_reader& in, std::string_view text)
+{
+    size_t begin = text.find('"');
+    size_t end = text.rfind('"');
+    if (begin == text.npos || begin == end)
+        in.Error("Expected PO string in {:?}", text);
+
+    std::string result;
+    for (size_t pos = begin + 1; pos < end; ++pos)
+    {
+        if (text[pos] != '\\' || pos + 1 == end)
+        {
+            result += text[pos];
+            continue;
+        }
+        char c = text[++pos];
+        switch (c)
+        {
+        case 'n': result += '\n'; break;
+        case 'r': result += '\r'; break;
+        case 't': result += '\t'; break;
+        case 'a': result += '\a'; break;
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'v': result += '\v'; break;
+        default: {
+            auto funcIsOctal = [](char c) { return c >= '0' && c <= '7'; };
+            if (funcIsOctal(c))
+            {
+                int value = 0;
+                for (int i = 0; i < 3 && pos < end && funcIsOctal(text[pos]); ++i, ++pos)
+                    value = value * 8 + (text[pos] - '0');
+                --pos;
+                result += char(value);
+            }
+            else
+                result += c;
+        }
+        }
+    }
+    return result;
+}
+
+/// Reads the msgctxt, msgid and msgstr of one PO message.
+static bool ReadPOMessage(file_reader& in, std::string& msgctxt, std::string& msgid,
+                          std::string& msgstr)
+{
+    msgctxt.clear();
+    msgid.clear();
+    msgstr.clear();
+
+    std::string text;
+    std::string* current = nullptr;
+    bool any = false;
+    while (in.ReadLine(text))
+    {
+        if (!text.empty() && text.back() == '\r')
+            text.pop_back();
+        std::string_view view = text;
+        while (view.starts_with(' ') || view.starts_with('\t'))
+            view.remove_prefix(1);
+
+        if (view.empty())
+        {
+            if (any)
+                return true;
+            continue;
+        }
+        if (view.starts_with('#'))
+            continue;
+
+        if (view.starts_with("msgctxt "))
+            current = &msgctxt;
+        else if (view.starts_with("msgid "))
+            current = &msgid;
+        else if (view.starts_with("msgstr "))
+            current = &msgstr;
+        else if (!view.starts_with('"') || !current)
+            in.Error("Unexpected PO line {:?}", view);
+
+        // Adjacent strings are concatenated.
+        *current += ParsePOString(in, view);
+        any = true;
+    }
+    return any;
+}
+
+/// Reads the fields of the next line, in any format.
+static bool ReadLineFields(file_reader& in, TGAAC_LinesFormat format, TGAAC_Line& line)
+{
+    switch (format)
+    {
+    case TGAAC_LinesFormat::CSV: {
+        std::vector<std::string> fields;
+        while (ReadCSVRecord(in, fields))
+        {
+            if (fields.size() == 1 && fields[0].empty())
+                continue;
+            if (fields.size() != 4)
+                in.Error("Expected 4 CSV fields, found {}", fields.size());
+            if (fields[0] == "archive" && fields[1] == "gmd")
+                continue; // Header
+            line.archive = std::move(fields[0]);
+            line.gmd = std::move(fields[1]);
+            line.key = std::move(fields[2]);
+            line.value = std::move(fields[3]);
+            return true;
+        }
+        return false;
+    }
+    case TGAAC_LinesFormat::PO: {
+        std::string msgctxt, msgid, msgstr;
+        while (ReadPOMessage(in, msgctxt, msgid, msgstr))
+        {
+            if (msgstr.empty() || msgctxt.empty())
+                continue; // Untranslated, or the header.
+            size_t first = msgctxt.find('|');
+            size_t last = msgctxt.rfind('|');
+            if (first == last)
+                in.Error("Expected 'archive|gmd|key' in msgctxt {:?}", msgctxt);
+            line.archive = msgctxt.substr(0, first);
+            line.gmd = msgctxt.substr(first + 1, last - first - 1);
+            line.key = msgctxt.substr(last + 1);
+            line.value = std::move(msgstr);
+            return true;
+        }
+        return false;
+    }
+    case TGAAC_LinesFormat::JSONL: {
+        std::string text;
+        while (in.ReadLine(text))
+        {
+            if (text.find_first_not_of(" \t\r") == text.npos)
+                continue;
+            size_t pos = 0;
+            line = {};
+            for (auto& [key, value] : ParseJsonObject(text, pos))
+            {
+                if (key == "archive")
+                    line.archive = std::move(value);
+                else if (key == "gmd")
+                    line.gmd = std::move(value);
+                else if (key == "key")
+                    line.key = std::move(value);
+                else if (key == "value")
+                    line.value = std::move(value);
+            }
+            return true;
+        }
+        return false;
+    }
+    }
+    return false;
+}
+
+/// Reads the next line to apply. Lines without edit (an empty PO msgstr) are skipped.
+static bool ReadLine(file_reader& in, TGAAC_LinesFormat format, TGAAC_Line& line)
+{
+    if (!ReadLineFields(in, format, line))
+        return false;
+    if (line.archive.empty())
+        in.Error("No archive for the line {:?} of GMD {:?}", line.key, line.gmd);
+    return true;
+}
+
+// ==================== Applying ====================
+
+/// Key of a line inside its ARC file.
+static std::string LineID(std::string_view gmd, std::string_view key)
+{
+    std::string id;
+    id.reserve(gmd.size() + 1 + key.size());
+    id += gmd;
+    id += '\0';
+    id += key;
+    return id;
+}
+
+/// Applies the edits of one ARC file, consuming them.
+static void ApplyLines(fs::path const& installFolder, std::string const& archive,
+                       std::unordered_map<std::string, std::string>& edits,
+                       fs::path const& outFolder, TGAAC_ImportStats& stats)
+{
+    file_reader arcStream{installFolder / archive};
+    ARC_Archive arc;
+    arc.Load(arcStream);
+
+    size_t nbChangedLines = 0;
+    for (ARC_Entry& entry : arc.entries)
+    {
+        if (entry.ext != ARC_ExtensionHash::GMD)
+            continue;
+
+        GMD_Registry gmd = GMD_LoadArcEntry(entry);
+
+        bool changed = false;
+        for (GMD_Entry& gmdEntry : gmd.entries)
+        {
+            auto it = edits.find(LineID(entry.filename, gmdEntry.key));
+            if (it == edits.end())
+                continue;
+            if (it->second != gmdEntry.value)
+            {
+                gmdEntry.value = std::move(it->second);
+                changed = true;
+                ++nbChangedLines;
+            }
+            edits.erase(it);
+        }
+        if (!changed)
+            continue;
+
+        std::string gmdBytes = gmd.Save();
+        entry.decompSize = gmdBytes.size();
+        if (entry.isCompressed)
+            entry.content = ARC_Entry::Compress(gmdBytes);
+        else
+            entry.content = std::move(gmdBytes);
+    }
+
+    if (!edits.empty())
+    {
+        std::string_view id = edits.begin()->first;
+        size_t sep = id.find('\0');
+        throw runtime_error("{}: no line {:?} in GMD {:?}", archive, id.substr(sep + 1),
+                            id.substr(0, sep));
+    }
+
+    if (nbChangedLines == 0)
+        return;
+
+    WriteThenRename(outFolder / archive, [&](file_writer& out) { arc.Save(out); });
+
+    stats.nbChangedLines += nbChangedLines;
+    ++stats.nbChangedArchives;
+}
+
+TGAAC_ImportStats TGAAC_ImportLines(fs::path const& installFolder,
+                                    fs::path const& linesFile, fs::path const& outFolder)
+{
+    TGAAC_LinesFormat format = TGAAC_LinesFormatFromPath(linesFile);
+    file_reader in{linesFile};
+
+    TGAAC_ImportStats stats;
+    std::string archive;
+    std::unordered_map<std::string, std::string> edits;
+    std::unordered_set<std::string> doneArchives;
+
+    auto funcFlush = [&] {
+        if (archive.empty())
+            return;
+        fmt::print("Importing {}...\n", archive);
+        ApplyLines(installFolder, archive, edits, outFolder, stats);
+        doneArchives.insert(archive);
+    };
+
+    TGAAC_Line line;
+    while (ReadLine(in, format, line))
+    {
+        ++stats.nbLines;
+        if (line.archive != archive)
+        {
+            funcFlush();
+            if (doneArchives.contains(line.archive))
+                in.Error("Lines of {} are not contiguous", line.archive);
+            archive = line.archive;
+        }
+        edits[LineID(line.gmd, line.key)] = std::move(line.value);
+    }
+    funcFlush();
+
+    return stats;
+}
+
+// ==================== Alignment ====================
+
+/// Lines of one label, in all languages.
+struct AlignedRow
+{
+    std::string_view key;
+    std::vector<std::pair<uint32_t, std::string_view>> values; ///< By language.
+
+    std::string_view const* Find(uint32_t language) const
+    {
+        for (auto const& [valueLanguage, value] : values)
+            if (valueLanguage == language)
+                return &value;
+        return nullptr;
+    }
+};
+
+/// GMD registries with the same entry name, in all languages.
+struct AlignedGMD
+{
+    std::string name;
+    std::vector<AlignedRow> rows;
+    std::unordered_multimap<uint64_t, size_t> rowsByHash; ///< hash1 and hash2 to row.
+    std::vector<uint32_t> languages;
+};
+
+static void AlignRegistry(AlignedGMD& aligned, GMD_Registry const& gmd,
+                          std::string_view archive, string_pool& pool,
+                          std::vector<TGAAC_AlignIssue>& issues)
+{
+    using Kind = TGAAC_AlignIssue::Kind;
+    auto funcIssue = [&](std::string_view key, Kind kind) {
+        issues.push_back(
+            {std::string(archive), aligned.name, std::string(key), gmd.language, kind});
+    };
+
+    if (std::ranges::find(aligned.languages, gmd.language) == aligned.languages.end())
+        aligned.languages.push_back(gmd.language);
+
+    size_t previousRow = 0; // Of the last label already in another language.
+    for (GMD_Entry const& entry : gmd.entries)
+    {
+        GMD_LabelHash hash = GMD_HashLabel(entry.key);
+        uint64_t hashID = uint64_t(hash.hash1) << 32 | hash.hash2;
+
+        // The label is compared in case of hash collision.
+        size_t rowIndex = aligned.rows.size();
+        auto [begin, end] = aligned.rowsByHash.equal_range(hashID);
+        for (auto it = begin; it != end; ++it)
+            if (aligned.rows[it->second].key == entry.key)
+                rowIndex = it->second;
+
+        if (rowIndex == aligned.rows.size())
+        {
+            aligned.rowsByHash.emplace(hashID, rowIndex);
+            aligned.rows.push_back({pool.Intern(entry.key), {}});
+        }
+        else if (aligned.rows[rowIndex].Find(gmd.language))
+        {
+            funcIssue(entry.key, Kind::Duplicate);
+            continue;
+        }
+        else
+        {
+            if (rowIndex < previousRow)
+                funcIssue(entry.key, Kind::Reordered);
+            previousRow = rowIndex;
+        }
+        std::string_view value = pool.Intern(entry.value);
+        aligned.rows[rowIndex].values.emplace_back(gmd.language, value);
+    }
+}
+
+static void AppendAlignedRow(std::string& out, TGAAC_LinesFormat format,
+                             std::string_view gmd, AlignedRow const& row,
+                             std::span<uint32_t const> languages)
+{
+    if (format == TGAAC_LinesFormat::CSV)
+    {
+        AppendCSVField(out, gmd);
+        out += ',';
+        AppendCSVField(out, row.key);
+        for (uint32_t language : languages)
+        {
+            out += ',';
+            if (std::string_view const* value = row.Find(language))
+                AppendCSVField(out, *value);
+        }
+        out += '\n';
+        return;
+    }
+
+    out += "{\"gmd\":";
+    AppendJsonString(out, gmd);
+    out += ",\"key\":";
+    AppendJsonString(out, row.key);
+    out += ",\"values\":{";
+    bool first = true;
+    for (uint32_t language : languages)
+    {
+        std::string_view const* value = row.Find(language);
+        if (!value)
+            continue;
+        fmt::format_to(std::back_inserter(out), "{}\"{}\":", first ? "" : ",", language);
+        AppendJsonString(out, *value);
+        first = false;
+    }
+    out += "}}\n";
+}
+
+std::vector<TGAAC_AlignIssue> TGAAC_ExportAlignedLines(fs::path const& installFolder,
+                                                       fs::path const& tableFile,
+                                                       TGAAC_AlignStats* stats)
+{
+    using Kind = TGAAC_AlignIssue::Kind;
+
+    TGAAC_LinesFormat format = TGAAC_LinesFormatFromPath(tableFile);
+    if (format == TGAAC_LinesFormat::PO)
+        throw runtime_error("Aligned lines are written as .csv or .jsonl, not .po");
+
+    // Values are interned, as many lines are repeated among chapters.
+    string_pool pool;
+    std::vector<AlignedGMD> alignedGMDs;
+    std::unordered_map<std::string, size_t> alignedByName;
+    std::vector<TGAAC_AlignIssue> issues;
+    for (fs::path const& arcPath : FindArchives(installFolder))
+    {
+        std::string archive = arcPath.generic_string();
+        GMD_ForEachInArc(installFolder / arcPath, [&](ARC_TocEntry const& tocEntry,
+                                                      GMD_Registry& gmd) {
+            auto [it, inserted] =
+                alignedByName.emplace(tocEntry.filename, alignedGMDs.size());
+            if (inserted)
+                alignedGMDs.emplace_back().name = tocEntry.filename;
+            AlignRegistry(alignedGMDs[it->second], gmd, archive, pool, issues);
+        });
+    }
+
+    std::vector<uint32_t> languages;
+    for (AlignedGMD const& aligned : alignedGMDs)
+        languages.insert(languages.end(), aligned.languages.begin(),
+                         aligned.languages.end());
+    std::ranges::sort(languages);
+    languages.erase(std::ranges::unique(languages).begin(), languages.end());
+
+    file_writer out{tableFile};
+    std::string buffer;
+    if (format == TGAAC_LinesFormat::CSV)
+    {
+        buffer = "gmd,key";
+        for (uint32_t language : languages)
+            fmt::format_to(std::back_inserter(buffer), ",lang{}", language);
+        buffer += '\n';
+    }
+
+    size_t nbRows = 0;
+    for (AlignedGMD const& aligned : alignedGMDs)
+    {
+        for (uint32_t language : languages)
+            if (std::ranges::find(aligned.languages, language) == aligned.languages.end())
+                issues.push_back({"", aligned.name, "", language, Kind::Missing});
+
+        for (AlignedRow const& row : aligned.rows)
+        {
+            for (uint32_t language : aligned.languages)
+                if (!row.Find(language))
+                    issues.push_back({"", aligned.name, std::string(row.key),
+                                      language, Kind::Missing});
+            AppendAlignedRow(buffer, format, aligned.name, row, languages);
+        }
+        nbRows += aligned.rows.size();
+
+        out.Write(std::span{buffer});
+        buffer.clear();
+    }
+
+    out.Write(std::span{buffer});
+    out.Sync();
+
+    if (stats)
+    {
+        stats->nbLanguages = languages.size();
+        stats->nbRegistries = alignedGMDs.size();
+        stats->nbRows = nbRows;
+    }
+    return issues;
+}
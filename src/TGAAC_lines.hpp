@@ -0,0 +1,83 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_LINES_H
+#define JV_TGAAC_LINES_H
+
+/// This file contains the bulk export and import of all GMD_Entry values
+/// as a single CSV, PO or JSONL file, for translation-management tools.
+
+#include "Utility.hpp"
+
+/// One line of the game, as written by TGAAC_ExportLines().
+struct TGAAC_Line
+{
+    std::string archive; ///< ARC file, relative to the install folder.
+    std::string gmd;     ///< GMD entry name in the ARC.
+    std::string key;
+    std::string value;
+};
+
+enum class TGAAC_LinesFormat
+{
+    CSV,  ///< Columns archive,gmd,key,value (RFC 4180).
+    PO,   ///< msgctxt "archive|gmd|key", the value is the msgid, msgstr is the edit.
+    JSONL ///< One object {"archive","gmd","key","value"} per line.
+};
+
+/// Format from the file extension: .csv, .po or .jsonl.
+TGAAC_LinesFormat TGAAC_LinesFormatFromPath(fs::path const& linesFile);
+
+/// Writes all lines of the install folder, loading one ARC file at a time.
+/// Returns the number of lines written.
+size_t TGAAC_ExportLines(fs::path const& installFolder, fs::path const& linesFile);
+
+struct TGAAC_ImportStats
+{
+    size_t nbLines = 0;
+    size_t nbChangedLines = 0;
+    size_t nbChangedArchives = 0;
+};
+
+/// Applies the lines to the ARC files of the install folder, and writes the modified
+/// ones to 'outFolder' (with the same relative path).
+/// Lines of an ARC file must be contiguous, as written by TGAAC_ExportLines(),
+/// so that only one ARC file and its lines are in memory.
+TGAAC_ImportStats TGAAC_ImportLines(fs::path const& installFolder,
+                                    fs::path const& linesFile, fs::path const& outFolder);
+
+/// A label which cannot be aligned in all languages, see TGAAC_ExportAlignedLines().
+struct TGAAC_AlignIssue
+{
+    enum class Kind
+    {
+        Missing,   ///< Label not in the language, or the whole GMD if 'key' is empty.
+        Reordered, ///< Label before one that precedes it in the first GMD read.
+        Duplicate  ///< Label already in the language, the first line is kept.
+    };
+
+    std::string archive; ///< Where the issue was found, empty if missing.
+    std::string gmd;
+    std::string key;
+    uint32_t language;
+    Kind kind;
+};
+
+struct TGAAC_AlignStats
+{
+    size_t nbLanguages = 0;
+    size_t nbRegistries = 0; ///< Distinct GMD entry names.
+    size_t nbRows = 0;
+};
+
+/// Writes a table with one row per label and one column per GMD_Registry::language,
+/// as .csv (columns gmd,key,lang<N>...) or .jsonl ({"gmd","key","values":{"<N>"}}).
+/// GMD registries are matched across languages by their entry name in the ARC files,
+/// and their lines are hash-joined on the hashes of their label, in a single pass over
+/// the ARC files. Rows are in the order of the first GMD read, then the labels only in
+/// other languages.
+std::vector<TGAAC_AlignIssue> TGAAC_ExportAlignedLines(fs::path const& installFolder,
+                                                       fs::path const& tableFile,
+                                                       TGAAC_AlignStats* stats = nullptr);
+
+#endif
@@ -0,0 +1,388 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_patch.hpp"
+#include "FileSchema.hpp"
+#include "TGAAC_file_ARC.hpp"
+
+#include <map>
+#include <optional>
+#include <zlib.h>
+
+// Patch file layout, all little-endian:
+// - PATCH_FileHeader
+// - PATCH_FileEntry[entryCount], in the order of the patched ARC file
+// - names, referred by (offset, size) from the entries
+// - contents of the replaced entries, in order
+
+struct PATCH_FileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint16_t arcVersion;
+    uint16_t hasExtendedNames;
+    uint32_t entryCount;
+    uint32_t namesSize;
+    uint64_t contentsSize;
+    uint64_t originalSize; ///< Of the original ARC file.
+    uint64_t patchedSize;  ///< Of the patched ARC file.
+    uint32_t patchedCrc32;
+};
+
+struct PATCH_FileEntry
+{
+    uint32_t nameOffset;
+    uint32_t nameSize;
+    uint32_t extensionHash;
+    uint32_t compSize;
+    uint32_t decompSize; ///< As in ARC_FileEntry, unknownFlags in the upper byte.
+    uint32_t isReplaced; ///< Else copied from the original ARC file.
+    uint32_t crc32;      ///< Of the compressed content.
+};
+
+static constexpr uint32_t PATCH_VERSION = 1;
+
+template <>
+struct file_schema<PATCH_FileEntry>
+{
+    static constexpr size_t size = 28;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(PATCH_FileEntry, nameOffset, 0),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, nameSize, 4),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, extensionHash, 8),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, compSize, 12),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, decompSize, 16),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, isReplaced, 20),
+        JV_SCHEMA_FIELD(PATCH_FileEntry, crc32, 24),
+    };
+};
+
+template <>
+struct file_schema<PATCH_FileHeader>
+{
+    static constexpr size_t size = 48;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(PATCH_FileHeader, magic, 0),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, version, 4),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, arcVersion, 8),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, hasExtendedNames, 10),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, entryCount, 12),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, namesSize, 16),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, contentsSize, 20),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, originalSize, 28),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, patchedSize, 36),
+        JV_SCHEMA_FIELD(PATCH_FileHeader, patchedCrc32, 44),
+    };
+
+    template <typename TStream>
+    static void Validate(PATCH_FileHeader const& header, TStream& patch)
+    {
+        if (memcmp(header.magic, "JVPT", 4) != 0)
+            patch.Error("not starting with 'JVPT'");
+
+        if (header.version != PATCH_VERSION)
+            patch.Error("bad patch version {} (expected {})", header.version,
+                        PATCH_VERSION);
+
+        uint64_t expectedSize = size + header.namesSize + header.contentsSize;
+        expectedSize += uint64_t(header.entryCount) * file_schema<PATCH_FileEntry>::size;
+        if (expectedSize != uint64_t(patch.Size()))
+            patch.Error("bad file size {} (expected {})", patch.Size(), expectedSize);
+    }
+};
+
+/// zlib's CRC-32, faster than the one of archive_crc32.h on large buffers.
+static uint32_t Crc32(uint32_t crc, std::string_view bytes)
+{
+    return crc32_z(crc, (Bytef const*)bytes.data(), bytes.size());
+}
+
+static uint32_t FileCrc32(file_reader& in)
+{
+    constexpr int64_t CHUNK_SIZE = 1 << 20;
+
+    uint32_t crc = 0;
+    in.SeekInput(0, std::ios::beg);
+    for (int64_t pos = 0; pos < in.Size(); pos += CHUNK_SIZE)
+        crc = Crc32(crc, in.ReadView(std::min(CHUNK_SIZE, in.Size() - pos)));
+    return crc;
+}
+
+/// Name and extension hash, which identify an entry in an ARC file.
+using EntryKey = std::pair<std::string_view, uint32_t>;
+
+static std::map<EntryKey, ARC_TocEntry const*> MapEntries(
+    std::vector<ARC_TocEntry> const& toc)
+{
+    std::map<EntryKey, ARC_TocEntry const*> entries;
+    for (ARC_TocEntry const& entry : toc)
+        entries.emplace(EntryKey{entry.filename, (uint32_t)entry.ext}, &entry);
+    return entries;
+}
+
+/// CRC-32 of the header and table of content written for 'toc'.
+static uint32_t TOCCrc32(ARC_Archive const& arc, std::span<ARC_TocEntry const> toc,
+                         std::string& tocBytes)
+{
+    tocBytes.assign(arc.TOCSize(toc.size()), '\0');
+    span_writer tocStream{"TOC", std::span{tocBytes}};
+    arc.SaveTOC(tocStream, toc);
+    return Crc32(0, tocBytes);
+}
+
+TGAAC_PatchStats TGAAC_BuildPatch(fs::path const& originalArc, fs::path const& patchedArc,
+                                  fs::path const& patchFile)
+{
+    file_reader originalStream{originalArc};
+    ARC_Archive original;
+    std::vector<ARC_TocEntry> originalToc = original.LoadTOC(originalStream);
+    std::map<EntryKey, ARC_TocEntry const*> originalEntries = MapEntries(originalToc);
+
+    file_reader patchedStream{patchedArc};
+    ARC_Archive patched;
+    std::vector<ARC_TocEntry> patchedToc = patched.LoadTOC(patchedStream);
+
+    TGAAC_PatchStats stats;
+    std::vector<PATCH_FileEntry> entries;
+    std::string names;
+    std::string contents;
+    uint32_t contentsCrc32 = 0;
+    for (ARC_TocEntry const& tocEntry : patchedToc)
+    {
+        ARC_Entry entry = ARC_Archive::LoadEntry(patchedStream, tocEntry);
+        PATCH_FileEntry& e = entries.emplace_back();
+        e.nameOffset = names.size();
+        e.nameSize = tocEntry.filename.size();
+        e.extensionHash = (uint32_t)tocEntry.ext;
+        e.compSize = tocEntry.compSize;
+        e.decompSize = tocEntry.decompSize | ((uint32_t)tocEntry.unknownFlags << 24);
+        e.crc32 = Crc32(0, entry.content);
+        names += tocEntry.filename;
+        contentsCrc32 = Crc32(contentsCrc32, entry.content);
+
+        auto it = originalEntries.find(EntryKey{tocEntry.filename, e.extensionHash});
+        e.isReplaced =
+            it == originalEntries.end() || it->second->compSize != tocEntry.compSize ||
+            ARC_Archive::LoadEntry(originalStream, *it->second).content != entry.content;
+        if (e.isReplaced)
+        {
+            contents += entry.content;
+            ++stats.nbReplaced;
+        }
+        else
+            ++stats.nbKept;
+    }
+
+    stats.identical = stats.nbReplaced == 0 && patchedToc == originalToc &&
+                      patched.version == original.version &&
+                      patched.hasExtendedNames == original.hasExtendedNames;
+    if (stats.identical)
+    {
+        fs::remove(patchFile); // From a previous build.
+        return stats;
+    }
+
+    // What TGAAC_ApplyPatch() writes: the table of content, then the contents in order.
+    std::string tocBytes;
+    PATCH_FileHeader header;
+    memcpy(header.magic, "JVPT", 4);
+    header.version = PATCH_VERSION;
+    header.arcVersion = patched.version;
+    header.hasExtendedNames = patched.hasExtendedNames;
+    header.entryCount = entries.size();
+    header.namesSize = names.size();
+    header.contentsSize = contents.size();
+    header.originalSize = originalStream.Size();
+    header.patchedSize = patched.TOCSize(patchedToc.size());
+    for (ARC_TocEntry const& tocEntry : patchedToc)
+        header.patchedSize += tocEntry.compSize;
+    uint32_t tocCrc32 = TOCCrc32(patched, patchedToc, tocBytes);
+    header.patchedCrc32 =
+        crc32_combine(tocCrc32, contentsCrc32, header.patchedSize - tocBytes.size());
+
+    WriteThenRename(patchFile, [&](file_writer& out) {
+        WriteRecords(out, std::span<PATCH_FileHeader const>{&header, 1});
+        WriteRecords(out, std::span<PATCH_FileEntry const>{entries});
+        out.Write(std::span{names});
+        out.Write(std::span{contents});
+    });
+    stats.patchSize = fs::file_size(patchFile);
+    return stats;
+}
+
+bool TGAAC_ApplyPatch(fs::path const& originalArc, fs::path const& patchFile,
+                      fs::path const& outArc)
+{
+    mapped_file patchBytes{patchFile};
+    span_reader patch{patchFile.filename().string(), patchBytes.Bytes()};
+    PATCH_FileHeader header;
+    ReadRecords(patch, std::span{&header, 1});
+    std::vector<PATCH_FileEntry> entries(header.entryCount);
+    ReadRecords(patch, std::span{entries});
+    std::string_view names = patch.ReadView(header.namesSize);
+    std::string_view contents = patch.ReadView(header.contentsSize);
+
+    // Closed before the rename, which Windows refuses over an open 'originalArc'.
+    std::optional<file_reader> originalStream{std::in_place, originalArc};
+    // The patched ARC file may have the same size as the original one.
+    if (uint64_t(originalStream->Size()) == header.patchedSize &&
+        FileCrc32(*originalStream) == header.patchedCrc32)
+        return false;
+    if (uint64_t(originalStream->Size()) != header.originalSize)
+        throw runtime_error("{}: size {} instead of {}, not the original ARC file",
+                            originalArc.string(), originalStream->Size(),
+                            header.originalSize);
+    originalStream->SeekInput(0, std::ios::beg);
+    ARC_Archive original;
+    std::vector<ARC_TocEntry> originalToc = original.LoadTOC(*originalStream);
+    std::map<EntryKey, ARC_TocEntry const*> originalEntries = MapEntries(originalToc);
+
+    ARC_Archive patched;
+    patched.version = header.arcVersion;
+    patched.hasExtendedNames = header.hasExtendedNames;
+    std::vector<ARC_TocEntry> patchedToc;
+    std::vector<ARC_TocEntry const*> sources; // Null for the replaced entries.
+    for (PATCH_FileEntry const& e : entries)
+    {
+        if (uint64_t(e.nameOffset) + e.nameSize > names.size())
+            patch.Error("entry name out of bounds");
+        ARC_TocEntry& tocEntry = patchedToc.emplace_back();
+        tocEntry.filename = names.substr(e.nameOffset, e.nameSize);
+        tocEntry.ext = ARC_ExtensionHash{e.extensionHash};
+        tocEntry.compSize = e.compSize;
+        tocEntry.decompSize = e.decompSize & 0x00FFFFFF;
+        tocEntry.unknownFlags = e.decompSize >> 24;
+        tocEntry.isCompressed = tocEntry.decompSize != e.compSize;
+
+        ARC_TocEntry const*& source = sources.emplace_back();
+        if (e.isReplaced)
+            continue;
+        auto it = originalEntries.find(EntryKey{tocEntry.filename, e.extensionHash});
+        if (it == originalEntries.end() || it->second->compSize != e.compSize)
+            throw runtime_error("{}: no entry {:?} of {} bytes, not the original ARC "
+                                "file",
+                                originalArc.string(), tocEntry.filename, e.compSize);
+        source = it->second;
+    }
+
+    WriteThenRename(outArc, [&](file_writer& out) {
+        std::string tocBytes;
+        uint32_t crc = TOCCrc32(patched, patchedToc, tocBytes);
+        uint64_t size = tocBytes.size();
+        out.Write(std::span{tocBytes});
+
+        // Copied entries are read in their original order, usually forward only.
+        size_t contentsOffset = 0;
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            std::string_view content;
+            if (sources[i])
+            {
+                originalStream->SeekInput(sources[i]->offset, std::ios::beg);
+                content = originalStream->ReadView(sources[i]->compSize);
+            }
+            else if (contentsOffset + entries[i].compSize <= contents.size())
+            {
+                content = contents.substr(contentsOffset, entries[i].compSize);
+                contentsOffset += content.size();
+            }
+            else
+                patch.Error("entry {:?} out of bounds", patchedToc[i].filename);
+
+            if (Crc32(0, content) != entries[i].crc32)
+                throw runtime_error("{}: entry {:?} differs from the one of the patch",
+                                    sources[i] ? originalArc.string() : patch.Name(),
+                                    patchedToc[i].filename);
+            crc = Crc32(crc, content);
+            size += content.size();
+            out.Write(std::span{content});
+        }
+
+        if (size != header.patchedSize || crc != header.patchedCrc32)
+            throw runtime_error("{}: the patched ARC file differs from the expected one",
+                                outArc.string());
+        originalStream.reset();
+    });
+    return true;
+}
+
+/// Files of a folder ending with 'suffix', relative to it and without the suffix.
+static std::vector<fs::path> FindFiles(fs::path const& folder, std::string_view suffix)
+{
+    std::vector<fs::path> files;
+    for (fs::directory_entry const& file : fs::recursive_directory_iterator(folder))
+    {
+        std::string name = fs::relative(file.path(), folder).generic_string();
+        if (file.is_regular_file() && name.ends_with(suffix))
+            files.emplace_back(name.substr(0, name.size() - suffix.size()));
+    }
+    std::ranges::sort(files);
+    return files;
+}
+
+/// Calls func(arcPath) for each ARC file in parallel, each one with its own result.
+template <typename F>
+static TGAAC_BatchSummary ForEachArchive(std::vector<fs::path> const& arcPaths,
+                                         std::string_view action, F&& func)
+{
+    std::vector<std::optional<std::string>> errors(arcPaths.size());
+    std::vector<char> alreadyDone(arcPaths.size());
+    ParallelFor(arcPaths.size(), [&](size_t i) {
+        try
+        {
+            alreadyDone[i] = !func(arcPaths[i]);
+        }
+        catch (std::exception const& e)
+        {
+            errors[i] = e.what();
+            fmt::print("Failed to {} {}: {}\n", action, arcPaths[i].generic_string(),
+                       e.what());
+        }
+    });
+
+    TGAAC_BatchSummary summary;
+    for (size_t i = 0; i < arcPaths.size(); ++i)
+    {
+        if (errors[i])
+            summary.failures.emplace_back(arcPaths[i].generic_string(),
+                                          std::move(*errors[i]));
+        else
+            ++(alreadyDone[i] ? summary.nbResumed : summary.nbDone);
+    }
+    return summary;
+}
+
+TGAAC_BatchSummary TGAAC_GlobalBuildPatch(fs::path const& installFolder,
+                                          fs::path const& patchedFolder,
+                                          fs::path const& patchFolder)
+{
+    return ForEachArchive(
+        FindFiles(patchedFolder, ".arc"), "build the patch of", [&](fs::path arcPath) {
+            arcPath += ".arc";
+            fs::path patchFile = patchFolder / arcPath;
+            patchFile += PATCH_EXTENSION;
+            TGAAC_PatchStats stats = TGAAC_BuildPatch(
+                installFolder / arcPath, patchedFolder / arcPath, patchFile);
+            if (stats.identical)
+                fmt::print("{}: identical, no patch\n", arcPath.generic_string());
+            else
+                fmt::print("{}: {} entries replaced, {} kept, patch of {} bytes\n",
+                           arcPath.generic_string(), stats.nbReplaced, stats.nbKept,
+                           stats.patchSize);
+            return true;
+        });
+}
+
+TGAAC_BatchSummary TGAAC_GlobalApplyPatch(fs::path const& installFolder,
+                                          fs::path const& patchFolder,
+                                          fs::path const& outFolder)
+{
+    return ForEachArchive(
+        FindFiles(patchFolder, PATCH_EXTENSION), "patch", [&](fs::path const& arcPath) {
+            fs::path patchFile = patchFolder / arcPath;
+            patchFile += PATCH_EXTENSION;
+            fmt::print("Patching {}...\n", arcPath.generic_string());
+            return TGAAC_ApplyPatch(installFolder / arcPath, patchFile,
+                                    outFolder / arcPath);
+        });
+}
@@ -0,0 +1,49 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_PATCH_H
+#define JV_TGAAC_PATCH_H
+
+/// This file contains the delta patches of ARC files, to distribute a translation
+/// without the unchanged entries: a patch has the table of content of the patched
+/// ARC file and the entries which differ from the original one. Unchanged entries
+/// are referred to by their name and the hash of their original bytes.
+
+#include "TGAAC_actions.hpp"
+
+/// Added to the name of the ARC file.
+inline constexpr std::string_view PATCH_EXTENSION = ".jvpatch";
+
+struct TGAAC_PatchStats
+{
+    bool identical = false; ///< No patch needed, nothing was written.
+    size_t nbKept = 0;      ///< Entries copied from the original ARC file.
+    size_t nbReplaced = 0;  ///< Entries stored in the patch.
+    int64_t patchSize = 0;
+};
+
+/// Writes the patch turning 'originalArc' into 'patchedArc', unless they are identical.
+TGAAC_PatchStats TGAAC_BuildPatch(fs::path const& originalArc, fs::path const& patchedArc,
+                                  fs::path const& patchFile);
+
+/// Writes 'outArc' from the original ARC file and a patch, in a single pass over both
+/// when the entries keep their original order. The copied entries are checked against
+/// their hash, and the result against the hash of the patched ARC file. 'outArc' can be
+/// 'originalArc', which is only replaced once the result is verified.
+/// Returns false if 'originalArc' is already the patched ARC file.
+bool TGAAC_ApplyPatch(fs::path const& originalArc, fs::path const& patchFile,
+                      fs::path const& outArc);
+
+/// Builds the patches of all ARC files of 'patchedFolder' in parallel, with the same
+/// layout as the install folder. ARC files identical to the original have no patch.
+TGAAC_BatchSummary TGAAC_GlobalBuildPatch(fs::path const& installFolder,
+                                          fs::path const& patchedFolder,
+                                          fs::path const& patchFolder);
+
+/// Applies all patches of 'patchFolder' in parallel. 'outFolder' can be the install
+/// folder, its ARC files already patched are then counted as done by a previous run.
+TGAAC_BatchSummary TGAAC_GlobalApplyPatch(fs::path const& installFolder,
+                                          fs::path const& patchFolder,
+                                          fs::path const& outFolder);
+
+#endif
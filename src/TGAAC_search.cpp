@@ -0,0 +1,485 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_search.hpp"
+#include "FileSchema.hpp"
+#include "Utf8.hpp"
+
+#include <numeric>
+
+// Search index file layout, all little-endian:
+// - SRCH_FileHeader
+// - SRCH_FileDocument[documentCount]
+// - SRCH_FileTrigram[trigramCount], sorted by trigram
+// - SRCH_FilePosting[postingCount], referred by the trigrams
+// - strings, referred by (offset, size) from the documents
+
+struct SRCH_FileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t documentCount;
+    uint32_t trigramCount;
+    uint32_t postingCount;
+    uint32_t stringsSize;
+};
+
+struct SRCH_FileDocument
+{
+    uint32_t archiveOffset;
+    uint32_t archiveSize;
+    uint32_t gmdOffset;
+    uint32_t gmdSize;
+    uint32_t keyOffset;
+    uint32_t keySize;
+    uint32_t valueOffset;
+    uint32_t valueSize;
+};
+
+struct SRCH_FileTrigram
+{
+    uint64_t trigram;
+    uint32_t postingOffset;
+    uint32_t postingCount;
+};
+
+struct SRCH_FilePosting
+{
+    uint32_t documentID;
+};
+
+static constexpr uint32_t SRCH_VERSION = 1;
+
+template <>
+struct file_schema<SRCH_FileDocument>
+{
+    static constexpr size_t size = 32;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(SRCH_FileDocument, archiveOffset, 0),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, archiveSize, 4),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, gmdOffset, 8),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, gmdSize, 12),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, keyOffset, 16),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, keySize, 20),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, valueOffset, 24),
+        JV_SCHEMA_FIELD(SRCH_FileDocument, valueSize, 28),
+    };
+};
+
+template <>
+struct file_schema<SRCH_FileTrigram>
+{
+    static constexpr size_t size = 16;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(SRCH_FileTrigram, trigram, 0),
+        JV_SCHEMA_FIELD(SRCH_FileTrigram, postingOffset, 8),
+        JV_SCHEMA_FIELD(SRCH_FileTrigram, postingCount, 12),
+    };
+};
+
+template <>
+struct file_schema<SRCH_FilePosting>
+{
+    static constexpr size_t size = 4;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(SRCH_FilePosting, documentID, 0),
+    };
+};
+
+template <>
+struct file_schema<SRCH_FileHeader>
+{
+    static constexpr size_t size = 24;
+    static constexpr std::tuple fields{
+        JV_SCHEMA_FIELD(SRCH_FileHeader, magic, 0),
+        JV_SCHEMA_FIELD(SRCH_FileHeader, version, 4),
+        JV_SCHEMA_FIELD(SRCH_FileHeader, documentCount, 8),
+        JV_SCHEMA_FIELD(SRCH_FileHeader, trigramCount, 12),
+        JV_SCHEMA_FIELD(SRCH_FileHeader, postingCount, 16),
+        JV_SCHEMA_FIELD(SRCH_FileHeader, stringsSize, 20),
+    };
+
+    template <typename TStream>
+    static void Validate(SRCH_FileHeader const& header, TStream& srch)
+    {
+        if (memcmp(header.magic, "JVSR", 4) != 0)
+            srch.Error("not starting with 'JVSR'");
+
+        if (header.version != SRCH_VERSION)
+            srch.Error("bad search index version {} (expected {}), please rebuild it",
+                       header.version, SRCH_VERSION);
+
+        // Checked before the tables are allocated from the counts of the header.
+        constexpr int64_t documentSize = file_schema<SRCH_FileDocument>::size;
+        constexpr int64_t trigramSize = file_schema<SRCH_FileTrigram>::size;
+        constexpr int64_t postingSize = file_schema<SRCH_FilePosting>::size;
+        int64_t expectedSize = size + header.stringsSize;
+        expectedSize += header.documentCount * documentSize;
+        expectedSize += header.trigramCount * trigramSize;
+        expectedSize += header.postingCount * postingSize;
+        if (expectedSize != srch.Size())
+            srch.Error("bad file size {} (expected {})", srch.Size(), expectedSize);
+    }
+};
+
+/// ASCII-lowercased codepoints, so that search is case-insensitive for latin text.
+static std::vector<char32_t> Normalize(std::string_view text)
+{
+    std::vector<char32_t> codepoints;
+    codepoints.reserve(text.size());
+    for (size_t pos = 0; pos < text.size();)
+    {
+        char32_t c = DecodeUtf8(text, pos);
+        codepoints.push_back(c < 0x80 ? tolower(c) : c);
+    }
+    return codepoints;
+}
+
+/// Unique trigrams of a text, each packing three 21-bit codepoints.
+static std::vector<uint64_t> ComputeTrigrams(std::string_view text)
+{
+    std::vector<char32_t> codepoints = Normalize(text);
+    std::vector<uint64_t> trigrams;
+    for (size_t i = 2; i < codepoints.size(); ++i)
+        trigrams.push_back((uint64_t(codepoints[i - 2]) << 42) |
+                           (uint64_t(codepoints[i - 1]) << 21) | codepoints[i]);
+    std::ranges::sort(trigrams);
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+static bool ContainsCaseInsensitive(std::string_view haystack, std::string_view needle)
+{
+    auto funcEqual = [](char a, char b) {
+        return (a & 0x80 ? a : tolower(a)) == (b & 0x80 ? b : tolower(b));
+    };
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(),
+                       funcEqual) != haystack.end();
+}
+
+uint32_t TGAAC_SearchIndex::AddName(std::string_view name)
+{
+    auto [it, inserted] = m_nameIDs.emplace(name, m_names.size());
+    if (inserted)
+        m_names.emplace_back(name);
+    return it->second;
+}
+
+std::string TGAAC_SearchIndex::DocumentKey(std::string_view archive, std::string_view gmd,
+                                           std::string_view key) const
+{
+    std::string documentKey;
+    documentKey.reserve(archive.size() + gmd.size() + key.size() + 2);
+    documentKey.append(archive).append(1, '\0');
+    documentKey.append(gmd).append(1, '\0');
+    documentKey.append(key);
+    return documentKey;
+}
+
+void TGAAC_SearchIndex::AddPostings(uint32_t documentID)
+{
+    for (uint64_t trigram : ComputeTrigrams(m_documents[documentID].value))
+    {
+        std::vector<uint32_t>& postings = m_postings[trigram];
+        if (postings.empty() || postings.back() < documentID)
+            postings.push_back(documentID);
+        else
+            postings.insert(std::ranges::lower_bound(postings, documentID), documentID);
+    }
+}
+
+void TGAAC_SearchIndex::RemovePostings(uint32_t documentID)
+{
+    for (uint64_t trigram : ComputeTrigrams(m_documents[documentID].value))
+    {
+        auto it = m_postings.find(trigram);
+        if (it == m_postings.end())
+            continue;
+        std::vector<uint32_t>& postings = it->second;
+        auto pos = std::ranges::lower_bound(postings, documentID);
+        if (pos != postings.end() && *pos == documentID)
+            postings.erase(pos);
+        if (postings.empty())
+            m_postings.erase(it);
+    }
+}
+
+bool TGAAC_SearchIndex::Set(std::string_view archive, std::string_view gmd,
+                            std::string_view key, std::string_view value)
+{
+    std::string documentKey = DocumentKey(archive, gmd, key);
+    auto it = m_documentIDs.find(documentKey);
+    if (it != m_documentIDs.end())
+    {
+        Document& document = m_documents[it->second];
+        if (document.value == value)
+            return false;
+        RemovePostings(it->second);
+        document.value = m_values.Intern(value);
+        AddPostings(it->second);
+        return true;
+    }
+
+    uint32_t documentID = m_documents.size();
+    if (!m_freeDocuments.empty())
+    {
+        documentID = m_freeDocuments.back();
+        m_freeDocuments.pop_back();
+    }
+    else
+    {
+        m_documents.emplace_back();
+    }
+
+    Document& document = m_documents[documentID];
+    document.archiveID = AddName(archive);
+    document.gmdID = AddName(gmd);
+    document.key = key;
+    document.value = m_values.Intern(value);
+    document.removed = false;
+    m_documentIDs.emplace(std::move(documentKey), documentID);
+    AddPostings(documentID);
+    return true;
+}
+
+bool TGAAC_SearchIndex::Remove(std::string_view archive, std::string_view gmd,
+                               std::string_view key)
+{
+    auto it = m_documentIDs.find(DocumentKey(archive, gmd, key));
+    if (it == m_documentIDs.end())
+        return false;
+
+    uint32_t documentID = it->second;
+    RemovePostings(documentID);
+    m_documents[documentID] =
+        Document{.archiveID = 0, .gmdID = 0, .key = {}, .value = {}, .removed = true};
+    m_documentIDs.erase(it);
+    m_freeDocuments.push_back(documentID);
+    return true;
+}
+
+std::string_view const* TGAAC_SearchIndex::Find(std::string_view archive,
+                                                std::string_view gmd,
+                                                std::string_view key) const
+{
+    auto it = m_documentIDs.find(DocumentKey(archive, gmd, key));
+    return it == m_documentIDs.end() ? nullptr : &m_documents[it->second].value;
+}
+
+size_t TGAAC_SearchIndex::Size() const noexcept
+{
+    return m_documentIDs.size();
+}
+
+string_pool const& TGAAC_SearchIndex::Values() const noexcept
+{
+    return m_values;
+}
+
+int64_t TGAAC_SearchIndex::MemoryUsage() const noexcept
+{
+    // Hash table nodes are counted with a next pointer and a cached hash.
+    constexpr int64_t nodeBytes = 16;
+    int64_t bytes = m_values.MemoryUsage();
+    bytes += m_documents.capacity() * sizeof(Document);
+    for (Document const& document : m_documents)
+        bytes += document.key.capacity();
+    for (auto const& [documentKey, documentID] : m_documentIDs)
+        bytes += sizeof(documentKey) + sizeof(documentID) + nodeBytes +
+                 documentKey.capacity();
+    for (std::string const& name : m_names)
+        bytes += 2 * (sizeof(name) + name.capacity()) + nodeBytes;
+    for (auto const& [trigram, postings] : m_postings)
+        bytes += sizeof(trigram) + sizeof(postings) + nodeBytes +
+                 postings.capacity() * sizeof(uint32_t);
+    return bytes;
+}
+
+std::vector<TGAAC_SearchHit> TGAAC_SearchIndex::Query(std::string_view text,
+                                                      size_t maxHits) const
+{
+    std::vector<TGAAC_SearchHit> hits;
+    if (text.empty())
+        return hits;
+
+    // 1. Intersect posting lists, from the smallest one.
+    //    Texts shorter than a trigram check all documents.
+
+    std::vector<uint32_t> candidates;
+    std::vector<uint64_t> trigrams = ComputeTrigrams(text);
+    if (trigrams.empty())
+    {
+        candidates.resize(m_documents.size());
+        std::iota(candidates.begin(), candidates.end(), 0);
+    }
+    else
+    {
+        std::vector<std::vector<uint32_t> const*> lists;
+        for (uint64_t trigram : trigrams)
+        {
+            auto it = m_postings.find(trigram);
+            if (it == m_postings.end())
+                return hits;
+            lists.push_back(&it->second);
+        }
+        std::ranges::sort(lists, {}, [](auto* list) { return list->size(); });
+
+        candidates = *lists[0];
+        std::vector<uint32_t> intersection;
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i)
+        {
+            intersection.clear();
+            std::ranges::set_intersection(candidates, *lists[i],
+                                          std::back_inserter(intersection));
+            std::swap(candidates, intersection);
+        }
+    }
+
+    // 2. Trigrams may be in another order, check each candidate.
+
+    for (uint32_t documentID : candidates)
+    {
+        Document const& document = m_documents[documentID];
+        if (document.removed || !ContainsCaseInsensitive(document.value, text))
+            continue;
+        hits.push_back({m_names[document.archiveID], m_names[document.gmdID],
+                        document.key, document.value});
+        if (hits.size() >= maxHits)
+            break;
+    }
+    return hits;
+}
+
+std::vector<TGAAC_SearchHit> TGAAC_SearchIndex::Lines() const
+{
+    std::vector<TGAAC_SearchHit> lines;
+    lines.reserve(Size());
+    for (Document const& document : m_documents)
+        if (!document.removed)
+            lines.push_back({m_names[document.archiveID], m_names[document.gmdID],
+                             document.key, document.value});
+    return lines;
+}
+
+void TGAAC_SearchIndex::Save(fs::path const& indexFile) const
+{
+    std::string strings;
+    auto funcAddString = [&](std::string_view str, uint32_t& offset, uint32_t& size) {
+        offset = strings.size();
+        size = str.size();
+        strings += str;
+    };
+
+    // Removed documents are not saved, so IDs are compacted (keeping their order).
+
+    std::vector<uint32_t> newDocumentIDs(m_documents.size());
+    std::vector<SRCH_FileDocument> documents;
+    documents.reserve(Size());
+    std::vector<std::pair<uint32_t, uint32_t>> nameStrings(m_names.size());
+    for (size_t i = 0; i < m_names.size(); ++i)
+        funcAddString(m_names[i], nameStrings[i].first, nameStrings[i].second);
+    std::unordered_map<char const*, std::pair<uint32_t, uint32_t>> valueStrings;
+
+    for (size_t i = 0; i < m_documents.size(); ++i)
+    {
+        Document const& document = m_documents[i];
+        if (document.removed)
+            continue;
+        newDocumentIDs[i] = documents.size();
+        SRCH_FileDocument& d = documents.emplace_back();
+        std::tie(d.archiveOffset, d.archiveSize) = nameStrings[document.archiveID];
+        std::tie(d.gmdOffset, d.gmdSize) = nameStrings[document.gmdID];
+        funcAddString(document.key, d.keyOffset, d.keySize);
+
+        // Interned values are written only once.
+        auto [it, inserted] = valueStrings.try_emplace(document.value.data());
+        if (inserted)
+            funcAddString(document.value, it->second.first, it->second.second);
+        std::tie(d.valueOffset, d.valueSize) = it->second;
+    }
+
+    std::vector<SRCH_FileTrigram> trigrams;
+    trigrams.reserve(m_postings.size());
+    for (auto& [trigram, postings] : m_postings)
+        trigrams.push_back({trigram, 0, uint32_t(postings.size())});
+    std::ranges::sort(trigrams, {}, &SRCH_FileTrigram::trigram);
+
+    std::vector<SRCH_FilePosting> postings;
+    for (SRCH_FileTrigram& t : trigrams)
+    {
+        t.postingOffset = postings.size();
+        for (uint32_t documentID : m_postings.at(t.trigram))
+            postings.push_back({newDocumentIDs[documentID]});
+    }
+
+    SRCH_FileHeader header;
+    memcpy(header.magic, "JVSR", 4);
+    header.version = SRCH_VERSION;
+    header.documentCount = documents.size();
+    header.trigramCount = trigrams.size();
+    header.postingCount = postings.size();
+    header.stringsSize = strings.size();
+
+    file_writer out{indexFile};
+    WriteRecords(out, std::span<SRCH_FileHeader const>{&header, 1});
+    WriteRecords(out, std::span<SRCH_FileDocument const>{documents});
+    WriteRecords(out, std::span<SRCH_FileTrigram const>{trigrams});
+    WriteRecords(out, std::span<SRCH_FilePosting const>{postings});
+    out.Write(std::span{strings});
+}
+
+void TGAAC_SearchIndex::Load(fs::path const& indexFile)
+{
+    *this = {};
+
+    mapped_file file{indexFile};
+    span_reader srch{std::string{file.Name()}, file.Bytes()};
+
+    SRCH_FileHeader header;
+    ReadRecords(srch, std::span{&header, 1});
+
+    std::vector<SRCH_FileDocument> documents(header.documentCount);
+    std::vector<SRCH_FileTrigram> trigrams(header.trigramCount);
+    std::vector<SRCH_FilePosting> postings(header.postingCount);
+    ReadRecords(srch, std::span{documents});
+    ReadRecords(srch, std::span{trigrams});
+    ReadRecords(srch, std::span{postings});
+    std::string_view strings = srch.ReadView(header.stringsSize);
+
+    auto funcGetString = [&](uint32_t offset, uint32_t size) {
+        if (offset > strings.size() || size > strings.size() - offset)
+            srch.Error("string out of bounds");
+        return strings.substr(offset, size);
+    };
+
+    m_documents.reserve(documents.size());
+    m_documentIDs.reserve(documents.size());
+    for (SRCH_FileDocument const& d : documents)
+    {
+        std::string_view archive = funcGetString(d.archiveOffset, d.archiveSize);
+        std::string_view gmd = funcGetString(d.gmdOffset, d.gmdSize);
+        std::string_view key = funcGetString(d.keyOffset, d.keySize);
+        uint32_t documentID = m_documents.size();
+        m_documentIDs.emplace(DocumentKey(archive, gmd, key), documentID);
+        m_documents.push_back({AddName(archive), AddName(gmd), std::string{key},
+                               m_values.Intern(funcGetString(d.valueOffset, d.valueSize)),
+                               false});
+    }
+
+    m_postings.reserve(trigrams.size());
+    for (SRCH_FileTrigram const& t : trigrams)
+    {
+        if (t.postingOffset > postings.size() ||
+            t.postingCount > postings.size() - t.postingOffset)
+            srch.Error("postings out of bounds");
+        std::vector<uint32_t>& list = m_postings[t.trigram];
+        list.reserve(t.postingCount);
+        for (uint32_t i = 0; i < t.postingCount; ++i)
+        {
+            uint32_t documentID = postings[t.postingOffset + i].documentID;
+            if (documentID >= m_documents.size())
+                srch.Error("document {} out of bounds", documentID);
+            list.push_back(documentID);
+        }
+    }
+}
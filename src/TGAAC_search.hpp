@@ -0,0 +1,76 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_SEARCH_H
+#define JV_TGAAC_SEARCH_H
+
+/// This file contains the full-text search index over all GMD_Entry values.
+
+#include <unordered_map>
+
+#include "StringPool.hpp"
+#include "Utility.hpp"
+
+/// A line found by TGAAC_SearchIndex::Query().
+struct TGAAC_SearchHit
+{
+    std::string_view archive; ///< Extracted ARC folder name.
+    std::string_view gmd;     ///< GMD entry name in the ARC.
+    std::string_view key;
+    std::string_view value;
+};
+
+/// Inverted index of codepoint trigrams, case-insensitive for ASCII.
+/// Queries intersect the posting lists of their trigrams, then check candidates.
+class TGAAC_SearchIndex
+{
+  public:
+    /// Adds or replaces the value of a line. Returns false if it was unchanged.
+    bool Set(std::string_view archive, std::string_view gmd, std::string_view key,
+             std::string_view value);
+    /// Returns false if the line was not in the index.
+    bool Remove(std::string_view archive, std::string_view gmd, std::string_view key);
+    /// Value of a line, or nullptr if not in the index.
+    std::string_view const* Find(std::string_view archive, std::string_view gmd,
+                            std::string_view key) const;
+
+    /// Lines containing 'text', in insertion order, at most 'maxHits'.
+    std::vector<TGAAC_SearchHit> Query(std::string_view text, size_t maxHits) const;
+    /// All lines, in insertion order. Views are valid until the next change.
+    std::vector<TGAAC_SearchHit> Lines() const;
+
+    size_t Size() const noexcept;
+    /// Values are hash-consed, as many lines are repeated among languages and chapters.
+    string_pool const& Values() const noexcept;
+    /// Approximate heap size of the index.
+    int64_t MemoryUsage() const noexcept;
+
+    void Save(fs::path const& indexFile) const;
+    void Load(fs::path const& indexFile);
+
+  private:
+    struct Document
+    {
+        uint32_t archiveID;
+        uint32_t gmdID;
+        std::string key;
+        std::string_view value; ///< Interned in m_values.
+        bool removed;
+    };
+
+    std::vector<Document> m_documents;
+    std::vector<uint32_t> m_freeDocuments;
+    std::unordered_map<std::string, uint32_t> m_documentIDs; ///< See DocumentKey().
+    std::vector<std::string> m_names;                        ///< Archives and GMDs.
+    string_pool m_values;
+    std::unordered_map<std::string, uint32_t> m_nameIDs;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_postings; ///< Sorted IDs.
+
+    uint32_t AddName(std::string_view name);
+    std::string DocumentKey(std::string_view archive, std::string_view gmd,
+                            std::string_view key) const;
+    void AddPostings(uint32_t documentID);
+    void RemovePostings(uint32_t documentID);
+};
+
+#endif
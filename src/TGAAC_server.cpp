@@ -0,0 +1,317 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_server.hpp"
+#include "TGAAC_file_ARC.hpp"
+#include "TGAAC_file_GMD.hpp"
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/// A GMD entry parsed on first access.
+struct LoadedGMD
+{
+    ARC_Entry* entry;
+    GMD_Registry gmd;
+    std::unordered_map<std::string_view, GMD_Entry*> byKey;
+    bool modified = false;
+};
+
+struct TGAAC_PatchSession::Archive
+{
+    ARC_Archive arc;
+    std::map<std::string, LoadedGMD, std::less<>> gmds; ///< By entry filename.
+    bool modified = false;
+
+    LoadedGMD& GetGMD(std::string_view name)
+    {
+        if (auto it = gmds.find(name); it != gmds.end())
+            return it->second;
+
+        auto entry = std::ranges::find_if(arc.entries, [&](ARC_Entry const& entry) {
+            return entry.ext == ARC_ExtensionHash::GMD && entry.filename == name;
+        });
+        if (entry == arc.entries.end())
+            throw runtime_error("No GMD entry {:?}", name);
+
+        LoadedGMD& loaded = gmds[std::string(name)];
+        loaded.entry = &*entry;
+        loaded.gmd = GMD_LoadArcEntry(*entry);
+        for (GMD_Entry& gmdEntry : loaded.gmd.entries)
+            loaded.byKey.emplace(gmdEntry.key, &gmdEntry);
+        return loaded;
+    }
+
+    GMD_Entry& GetLine(std::string_view gmdName, std::string_view key)
+    {
+        LoadedGMD& loaded = GetGMD(gmdName);
+        auto it = loaded.byKey.find(key);
+        if (it == loaded.byKey.end())
+            throw runtime_error("No line {:?} in GMD {:?}", key, gmdName);
+        return *it->second;
+    }
+
+    /// Saves the modified GMD entries in their ARC entry, then the ARC file.
+    /// They are compressed with the parameters detected on their current content,
+    /// like repack does with the ones cached at extraction.
+    void Write(fs::path const& outFile)
+    {
+        for (auto& [name, loaded] : gmds)
+        {
+            if (!loaded.modified)
+                continue;
+            ARC_Entry& entry = *loaded.entry;
+            std::string gmdBytes = loaded.gmd.Save();
+            if (entry.isCompressed)
+            {
+                std::string previous =
+                    ARC_Entry::Decompress(entry.content, entry.decompSize);
+                ARC_DeflateParams params =
+                    ARC_Entry::DetectDeflateParams(previous, entry.content)
+                        .value_or(ARC_DeflateParams{});
+                entry.content = ARC_Entry::Compress(gmdBytes, params);
+            }
+            else
+                entry.content = gmdBytes;
+            entry.decompSize = gmdBytes.size();
+            loaded.modified = false;
+        }
+
+        fs::path tmpFile = outFile;
+        tmpFile += ".tmp";
+        fs::create_directories(outFile.parent_path());
+        {
+            file_writer out{tmpFile};
+            arc.Save(out);
+            out.Sync();
+        }
+        fs::rename(tmpFile, outFile);
+        modified = false;
+    }
+};
+
+TGAAC_PatchSession::TGAAC_PatchSession(fs::path installFolder, fs::path outFolder)
+    : m_installFolder{std::move(installFolder)}, m_outFolder{std::move(outFolder)}
+{
+    for (fs::path const& p : fs::recursive_directory_iterator(m_installFolder))
+        if (p.extension() == ".arc")
+            m_archiveNames.push_back(fs::relative(p, m_installFolder).generic_string());
+    std::ranges::sort(m_archiveNames);
+}
+
+TGAAC_PatchSession::~TGAAC_PatchSession() = default;
+
+TGAAC_PatchSession::Archive& TGAAC_PatchSession::GetArchive(std::string_view name)
+{
+    if (auto it = m_archives.find(name); it != m_archives.end())
+        return *it->second;
+
+    // Only ARC files of the install folder can be loaded.
+    if (!std::ranges::binary_search(m_archiveNames, name))
+        throw runtime_error("No ARC file {:?}", name);
+
+    auto archive = std::make_unique<Archive>();
+    file_reader arcStream{m_installFolder / name};
+    archive->arc.Load(arcStream);
+    return *m_archives.emplace(std::string(name), std::move(archive)).first->second;
+}
+
+std::string TGAAC_PatchSession::Handle(std::string_view request, bool& shutdown)
+{
+    std::string response = "{\"ok\":true";
+    auto funcAppendList = [&](std::string_view name, auto const& values) {
+        response += ",\"";
+        response += name;
+        response += "\":[";
+        for (std::string_view value : values)
+        {
+            AppendJsonString(response, value);
+            response += ',';
+        }
+        if (response.back() == ',')
+            response.pop_back();
+        response += ']';
+    };
+
+    try
+    {
+        size_t pos = 0;
+        std::unordered_map<std::string, std::string> members;
+        for (auto& [key, value] : ParseJsonObject(request, pos))
+            members[std::move(key)] = std::move(value);
+        auto funcMember = [&](std::string const& key) -> std::string const& {
+            auto it = members.find(key);
+            if (it == members.end())
+                throw runtime_error("Missing {:?} in request", key);
+            return it->second;
+        };
+
+        std::string const& op = funcMember("op");
+        if (op == "list" && !members.contains("archive"))
+            funcAppendList("archives", m_archiveNames);
+        else if (op == "list" && !members.contains("gmd"))
+        {
+            std::vector<std::string_view> gmds;
+            for (ARC_Entry const& entry : GetArchive(funcMember("archive")).arc.entries)
+                if (entry.ext == ARC_ExtensionHash::GMD)
+                    gmds.push_back(entry.filename);
+            funcAppendList("gmds", gmds);
+        }
+        else if (op == "list")
+        {
+            Archive& archive = GetArchive(funcMember("archive"));
+            std::vector<std::string_view> keys;
+            for (GMD_Entry const& entry : archive.GetGMD(funcMember("gmd")).gmd.entries)
+                keys.push_back(entry.key);
+            funcAppendList("keys", keys);
+        }
+        else if (op == "get")
+        {
+            Archive& archive = GetArchive(funcMember("archive"));
+            response += ",\"value\":";
+            AppendJsonString(response,
+                             archive.GetLine(funcMember("gmd"), funcMember("key")).value);
+        }
+        else if (op == "set")
+        {
+            Archive& archive = GetArchive(funcMember("archive"));
+            std::string const& gmdName = funcMember("gmd");
+            GMD_Entry& line = archive.GetLine(gmdName, funcMember("key"));
+            std::string const& value = funcMember("value");
+            bool changed = line.value != value;
+            if (changed)
+            {
+                line.value = value;
+                archive.GetGMD(gmdName).modified = true;
+                archive.modified = true;
+            }
+            response += changed ? ",\"changed\":true" : ",\"changed\":false";
+        }
+        else if (op == "write")
+        {
+            std::vector<std::string_view> written;
+            for (auto& [name, archive] : m_archives)
+            {
+                if (!archive->modified)
+                    continue;
+                archive->Write(m_outFolder / name);
+                written.push_back(name);
+            }
+            funcAppendList("written", written);
+        }
+        else if (op == "shutdown")
+            shutdown = true;
+        else
+            throw runtime_error("Unknown op {:?}", op);
+    }
+    catch (std::exception const& e)
+    {
+        response = "{\"ok\":false,\"error\":";
+        AppendJsonString(response, e.what());
+    }
+    response += '}';
+    return response;
+}
+
+#ifdef _WIN32
+
+void TGAAC_Serve(TGAAC_PatchSession&, fs::path const&)
+{
+    throw runtime_error("serve needs Unix domain sockets, not available on Windows");
+}
+
+#else
+
+void TGAAC_Serve(TGAAC_PatchSession& session, fs::path const& socketPath)
+{
+    // Far above any line, so that a client cannot make the buffer grow without bound.
+    constexpr size_t MAX_REQUEST_SIZE = 16 << 20;
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.native().size() >= sizeof(address.sun_path))
+        throw runtime_error("Socket path too long: {}", socketPath.string());
+    strcpy(address.sun_path, socketPath.c_str());
+
+    int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0)
+        throw runtime_error("Could not create socket: {}", strerror(errno));
+    auto funcClose = [](int* fd) { ::close(*fd); };
+    std::unique_ptr<int, decltype(funcClose)> serverGuard{&server, funcClose};
+
+    // A socket file left by a previous server which was killed, but not another file.
+    fs::file_status status = fs::symlink_status(socketPath);
+    if (status.type() == fs::file_type::socket)
+        fs::remove(socketPath);
+    else if (fs::exists(status))
+        throw runtime_error("Not replacing {}, which is not a socket",
+                            socketPath.string());
+    if (::bind(server, (sockaddr const*)&address, sizeof(address)) != 0 ||
+        ::listen(server, 4) != 0)
+        throw runtime_error("Could not listen on {}: {}", socketPath.string(),
+                            strerror(errno));
+    fmt::print("Listening on {}\n", socketPath.string());
+
+    bool shutdown = false;
+    std::string buffer;
+    char chunk[4096];
+    while (!shutdown)
+    {
+        int client = ::accept(server, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw runtime_error("Could not accept client: {}", strerror(errno));
+        }
+
+        buffer.clear();
+        while (!shutdown)
+        {
+            ssize_t nbRead = ::recv(client, chunk, sizeof(chunk), 0);
+            if (nbRead < 0 && errno == EINTR)
+                continue;
+            if (nbRead <= 0)
+                break;
+            buffer.append(chunk, nbRead);
+            if (buffer.find('\n') == buffer.npos && buffer.size() > MAX_REQUEST_SIZE)
+            {
+                // Best effort, as the client is dropped right after.
+                std::string_view response =
+                    "{\"ok\":false,\"error\":\"Request too large\"}\n";
+                ::send(client, response.data(), response.size(), MSG_NOSIGNAL);
+                break;
+            }
+
+            // Answers every complete line received so far.
+            size_t begin = 0;
+            for (size_t end; !shutdown && (end = buffer.find('\n', begin)) != buffer.npos;
+                 begin = end + 1)
+            {
+                std::string response =
+                    session.Handle(std::string_view{buffer}.substr(begin, end - begin),
+                                   shutdown);
+                response += '\n';
+                for (size_t sent = 0; sent < response.size();)
+                {
+                    ssize_t nbSent = ::send(client, response.data() + sent,
+                                            response.size() - sent, MSG_NOSIGNAL);
+                    if (nbSent < 0 && errno == EINTR)
+                        continue;
+                    if (nbSent <= 0)
+                        break;
+                    sent += nbSent;
+                }
+            }
+            buffer.erase(0, begin);
+        }
+        ::close(client);
+    }
+    fs::remove(socketPath);
+}
+
+#endif
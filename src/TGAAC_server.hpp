@@ -0,0 +1,50 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_SERVER_H
+#define JV_TGAAC_SERVER_H
+
+/// This file contains a long-running server for editors, keeping the ARC files and
+/// their GMD registries in memory between requests.
+///
+/// Requests and responses are JSON objects, one per line:
+/// - {"op":"list"} lists the ARC files, {"op":"list","archive"} the GMD entries of an
+///   ARC file, and {"op":"list","archive","gmd"} the keys of a GMD entry.
+/// - {"op":"get","archive","gmd","key"} returns the "value" of a line.
+/// - {"op":"set","archive","gmd","key","value"} modifies a line in memory.
+/// - {"op":"write"} writes the modified ARC files in the output folder.
+/// - {"op":"shutdown"} stops the server.
+/// Responses have "ok":true, or "ok":false and an "error".
+
+#include <map>
+
+#include "Utility.hpp"
+
+/// ARC files of an install folder loaded on demand, with their edits.
+class TGAAC_PatchSession
+{
+    struct Archive;
+
+    fs::path m_installFolder;
+    fs::path m_outFolder;
+    std::vector<std::string> m_archiveNames; ///< Relative to the install folder.
+    std::map<std::string, std::unique_ptr<Archive>, std::less<>> m_archives;
+
+    Archive& GetArchive(std::string_view name);
+
+  public:
+    TGAAC_PatchSession(fs::path installFolder, fs::path outFolder);
+    ~TGAAC_PatchSession();
+
+    /// Returns the response to a request, without line break.
+    /// Sets 'shutdown' to true if the request asks to stop.
+    std::string Handle(std::string_view request, bool& shutdown);
+};
+
+/// Answers the requests of clients connected to a Unix domain socket, one client at
+/// a time, until a shutdown request. An existing file at 'socketPath' is only replaced
+/// if it is a socket. Clients sending a request over 16 MiB are dropped.
+/// Throws on Windows, where the session can still be used through Handle().
+void TGAAC_Serve(TGAAC_PatchSession& session, fs::path const& socketPath);
+
+#endif
@@ -0,0 +1,277 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_verify.hpp"
+#include "TGAAC_actions.hpp"
+#include "TGAAC_file_ARC.hpp"
+
+#include <charconv>
+#include <map>
+#include <unordered_map>
+#include <zlib.h>
+
+/// zlib's CRC-32, faster than the one of archive_crc32.h on large buffers.
+static uint32_t Crc32(uint32_t crc, std::string_view bytes)
+{
+    return crc32_z(crc, (Bytef const*)bytes.data(), bytes.size());
+}
+
+static std::string DecompressedContent(ARC_Entry&& entry)
+{
+    return entry.isCompressed ? ARC_Entry::Decompress(entry.content, entry.decompSize)
+                              : std::move(entry.content);
+}
+
+TGAAC_ArchiveHash TGAAC_HashArchive(fs::path const& arcFile, bool hashEntries)
+{
+    constexpr int64_t CHUNK_SIZE = 1 << 20;
+
+    file_reader arcStream{arcFile};
+    TGAAC_ArchiveHash hash;
+    hash.size = arcStream.Size();
+    hash.crc32 = 0;
+
+    ARC_Archive arc;
+    std::vector<ARC_TocEntry> toc;
+    if (hashEntries)
+    {
+        toc = arc.LoadTOC(arcStream);
+        arcStream.SeekInput(0, std::ios::beg);
+    }
+    for (ARC_TocEntry const& tocEntry : toc)
+    {
+        if (tocEntry.offset + int64_t(tocEntry.compSize) > arcStream.Size())
+            arcStream.Error("Entry {:?} is past the end of the file", tocEntry.filename);
+        TGAAC_EntryHash& entryHash = hash.entries.emplace_back();
+        entryHash.name = tocEntry.filename;
+        entryHash.ext = (uint32_t)tocEntry.ext;
+        entryHash.compSize = tocEntry.compSize;
+        entryHash.compCrc32 = 0;
+        entryHash.decompSize = tocEntry.decompSize;
+    }
+
+    // Entries are hashed from the parts of the chunks they overlap.
+    for (int64_t pos = 0; pos < arcStream.Size(); pos += CHUNK_SIZE)
+    {
+        int64_t size = std::min(CHUNK_SIZE, arcStream.Size() - pos);
+        std::string_view chunk = arcStream.ReadView(size);
+        hash.crc32 = Crc32(hash.crc32, chunk);
+        for (size_t i = 0; i < toc.size(); ++i)
+        {
+            int64_t begin = std::max<int64_t>(pos, toc[i].offset);
+            int64_t end = std::min(pos + size, toc[i].offset + int64_t(toc[i].compSize));
+            if (begin < end)
+                hash.entries[i].compCrc32 = Crc32(hash.entries[i].compCrc32,
+                                                  chunk.substr(begin - pos, end - begin));
+        }
+    }
+
+    for (size_t i = 0; i < toc.size(); ++i)
+    {
+        TGAAC_EntryHash& entryHash = hash.entries[i];
+        if (!toc[i].isCompressed)
+            entryHash.decompCrc32 = entryHash.compCrc32;
+        else if (toc[i].ext == ARC_ExtensionHash::GMD)
+            entryHash.decompCrc32 = Crc32(
+                0, DecompressedContent(ARC_Archive::LoadEntry(arcStream, toc[i])));
+    }
+    return hash;
+}
+
+void TGAAC_SaveManifest(fs::path const& manifestFile,
+                        std::vector<TGAAC_ArchiveHash> const& hashes)
+{
+    std::string manifest;
+    for (TGAAC_ArchiveHash const& hash : hashes)
+    {
+        manifest += "{\"archive\":";
+        AppendJsonString(manifest, hash.archive);
+        manifest += fmt::format(",\"size\":{},\"crc32\":{}}}\n", hash.size, hash.crc32);
+        for (TGAAC_EntryHash const& entry : hash.entries)
+        {
+            manifest += "{\"entry\":";
+            AppendJsonString(manifest, entry.name);
+            manifest += fmt::format(",\"ext\":{},\"compSize\":{},\"compCrc32\":{},"
+                                    "\"decompSize\":{}",
+                                    entry.ext, entry.compSize, entry.compCrc32,
+                                    entry.decompSize);
+            if (entry.decompCrc32)
+                manifest += fmt::format(",\"decompCrc32\":{}", *entry.decompCrc32);
+            manifest += "}\n";
+        }
+    }
+
+    file_writer out{manifestFile};
+    out.Write(std::span{manifest});
+}
+
+std::vector<TGAAC_ArchiveHash> TGAAC_LoadManifest(fs::path const& manifestFile)
+{
+    file_reader in{manifestFile};
+    std::vector<TGAAC_ArchiveHash> hashes;
+    std::string line;
+    for (size_t lineNumber = 1; in.ReadLine(line); ++lineNumber)
+    {
+        if (line.empty())
+            continue;
+
+        size_t pos = 0;
+        std::unordered_map<std::string, std::string> members;
+        for (auto& [key, value] : ParseJsonObject(line, pos))
+            members[std::move(key)] = std::move(value);
+        auto funcNumber = [&](std::string const& key) {
+            auto it = members.find(key);
+            if (it == members.end())
+                in.Error("Missing {:?} at line {}", key, lineNumber);
+            std::string const& value = it->second;
+            uint64_t number = 0;
+            auto [end, error] =
+                std::from_chars(value.data(), value.data() + value.size(), number);
+            if (error != std::errc{} || end != value.data() + value.size())
+                in.Error("Invalid number {:?} for {:?} at line {}", value, key,
+                         lineNumber);
+            return number;
+        };
+
+        if (members.contains("archive"))
+        {
+            TGAAC_ArchiveHash& hash = hashes.emplace_back();
+            hash.archive = members["archive"];
+            hash.size = funcNumber("size");
+            hash.crc32 = funcNumber("crc32");
+        }
+        else if (members.contains("entry") && !hashes.empty())
+        {
+            TGAAC_EntryHash& entry = hashes.back().entries.emplace_back();
+            entry.name = members["entry"];
+            entry.ext = funcNumber("ext");
+            entry.compSize = funcNumber("compSize");
+            entry.compCrc32 = funcNumber("compCrc32");
+            entry.decompSize = funcNumber("decompSize");
+            if (members.contains("decompCrc32"))
+                entry.decompCrc32 = funcNumber("decompCrc32");
+        }
+        else
+            in.Error("Unexpected object at line {}", lineNumber);
+    }
+    return hashes;
+}
+
+/// Decompressed content of an entry, found by name and extension hash.
+static std::string LoadEntryContent(fs::path const& arcFile, TGAAC_EntryHash const& hash)
+{
+    file_reader arcStream{arcFile};
+    ARC_Archive arc;
+    for (ARC_TocEntry const& tocEntry : arc.LoadTOC(arcStream))
+        if (tocEntry.filename == hash.name && (uint32_t)tocEntry.ext == hash.ext)
+            return DecompressedContent(ARC_Archive::LoadEntry(arcStream, tocEntry));
+    throw runtime_error("{}: no entry {:?}", arcFile.string(), hash.name);
+}
+
+static void VerifyArchive(fs::path const& installFolder, fs::path const& repackFolder,
+                          TGAAC_ArchiveHash const& original,
+                          std::vector<TGAAC_EntryMismatch>& mismatches, bool& identical)
+{
+    using Kind = TGAAC_EntryMismatch::Kind;
+
+    fs::path repackedFile = repackFolder / original.archive;
+    TGAAC_ArchiveHash repacked = TGAAC_HashArchive(repackedFile, false);
+    identical = repacked.size == original.size && repacked.crc32 == original.crc32;
+    if (identical)
+        return;
+    repacked = TGAAC_HashArchive(repackedFile);
+
+    using EntryKey = std::pair<std::string_view, uint32_t>; // Name and extension hash.
+    auto funcKey = [](TGAAC_EntryHash const& entry) {
+        return EntryKey{entry.name, entry.ext};
+    };
+    std::map<EntryKey, TGAAC_EntryHash const*> repackedEntries;
+    for (TGAAC_EntryHash const& entry : repacked.entries)
+        repackedEntries.emplace(funcKey(entry), &entry);
+
+    TGAAC_EntryMismatch mismatch;
+    mismatch.archive = original.archive;
+    for (TGAAC_EntryHash const& entry : original.entries)
+    {
+        mismatch.entry = entry.name;
+        mismatch.offset = -1;
+        auto it = repackedEntries.find(funcKey(entry));
+        if (it == repackedEntries.end())
+        {
+            mismatch.kind = Kind::Missing;
+            mismatches.push_back(mismatch);
+            continue;
+        }
+        TGAAC_EntryHash const& other = *it->second;
+        repackedEntries.erase(it);
+
+        if (other.compSize == entry.compSize && other.compCrc32 == entry.compCrc32)
+            continue;
+        if (other.decompSize == entry.decompSize && entry.decompCrc32 &&
+            other.decompCrc32 == entry.decompCrc32)
+        {
+            mismatch.kind = Kind::Recompressed;
+            mismatches.push_back(mismatch);
+            continue;
+        }
+
+        // Only differing entries are read again, from both ARC files.
+        std::string before = LoadEntryContent(installFolder / original.archive, entry);
+        std::string after = LoadEntryContent(repackedFile, other);
+        if (before == after)
+            mismatch.kind = Kind::Recompressed;
+        else
+        {
+            auto [itBefore, itAfter] = std::ranges::mismatch(before, after);
+            mismatch.kind = Kind::Modified;
+            mismatch.offset = itBefore - before.begin();
+        }
+        mismatches.push_back(mismatch);
+    }
+
+    // Added entries, in the repacked order.
+    for (TGAAC_EntryHash const& entry : repacked.entries)
+    {
+        if (!repackedEntries.contains(funcKey(entry)))
+            continue;
+        mismatch.entry = entry.name;
+        mismatch.kind = Kind::Added;
+        mismatch.offset = -1;
+        mismatches.push_back(mismatch);
+    }
+}
+
+std::vector<TGAAC_EntryMismatch> TGAAC_Verify(fs::path const& installFolder,
+                                              fs::path const& extractFolder,
+                                              fs::path const& repackFolder,
+                                              TGAAC_VerifyStats* stats)
+{
+    std::vector<TGAAC_ArchiveHash> manifest =
+        TGAAC_LoadManifest(TGAAC_ManifestPath(extractFolder));
+    size_t nbSkipped = std::erase_if(manifest, [&](TGAAC_ArchiveHash const& hash) {
+        return !fs::exists(repackFolder / hash.archive);
+    });
+
+    // One task per ARC file, each one with its own results to avoid locking.
+    std::vector<std::vector<TGAAC_EntryMismatch>> archiveMismatches(manifest.size());
+    std::vector<char> identical(manifest.size());
+    ParallelFor(manifest.size(), [&](size_t i) {
+        bool isIdentical;
+        VerifyArchive(installFolder, repackFolder, manifest[i], archiveMismatches[i],
+                      isIdentical);
+        identical[i] = isIdentical;
+    });
+
+    std::vector<TGAAC_EntryMismatch> mismatches;
+    for (auto& batch : archiveMismatches)
+        std::ranges::move(batch, std::back_inserter(mismatches));
+
+    if (stats)
+    {
+        *stats = {};
+        stats->nbArchives = manifest.size();
+        stats->nbIdentical = std::ranges::count(identical, true);
+        stats->nbSkipped = nbSkipped;
+    }
+    return mismatches;
+}
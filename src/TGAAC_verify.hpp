@@ -0,0 +1,76 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_VERIFY_H
+#define JV_TGAAC_VERIFY_H
+
+/// This file contains the hashes of the original ARC files recorded at extraction,
+/// and the verification of repacked ARC files against them.
+
+#include "Utility.hpp"
+
+#include <optional>
+
+/// CRC-32 of an entry, compressed as stored and decompressed.
+struct TGAAC_EntryHash
+{
+    std::string name;
+    uint32_t ext;
+    uint32_t compSize;
+    uint32_t compCrc32;
+    uint32_t decompSize;
+    /// Only for GMD entries and stored ones: the others are copied as-is by repack.
+    std::optional<uint32_t> decompCrc32;
+};
+
+struct TGAAC_ArchiveHash
+{
+    std::string archive; ///< ARC file, relative to the install folder.
+    uint64_t size;
+    uint32_t crc32; ///< Of the whole file.
+    std::vector<TGAAC_EntryHash> entries;
+};
+
+/// Reads the ARC file once in chunks, hashing the entries from the same chunks if
+/// 'hashEntries'. Only GMD entries are then read again, to be decompressed.
+TGAAC_ArchiveHash TGAAC_HashArchive(fs::path const& arcFile, bool hashEntries = true);
+
+/// One JSON object per line: an ARC file, followed by its entries.
+void TGAAC_SaveManifest(fs::path const& manifestFile,
+                        std::vector<TGAAC_ArchiveHash> const& hashes);
+std::vector<TGAAC_ArchiveHash> TGAAC_LoadManifest(fs::path const& manifestFile);
+
+/// An entry of a repacked ARC file which is not identical to the original one.
+struct TGAAC_EntryMismatch
+{
+    enum class Kind
+    {
+        Missing,      ///< Not in the repacked ARC file.
+        Added,        ///< Not in the original ARC file.
+        Recompressed, ///< Same decompressed content, but different compressed bytes.
+        Modified
+    };
+
+    std::string archive;
+    std::string entry;
+    Kind kind;
+    int64_t offset = -1; ///< First different byte of the decompressed content.
+};
+
+struct TGAAC_VerifyStats
+{
+    size_t nbArchives = 0;  ///< ARC files of the manifest found in the repacked folder.
+    size_t nbIdentical = 0; ///< ARC files with the same size and whole-file hash.
+    size_t nbSkipped = 0;   ///< ARC files of the manifest not in the repacked folder.
+};
+
+/// Compares the repacked ARC files with the manifest of the extract folder, in parallel.
+/// The whole-file hash is checked first, and only on a mismatch the hashes of each
+/// entry. Only entries whose decompressed hash differs, or is unknown, are compared
+/// with the original ARC file, to locate their first difference.
+std::vector<TGAAC_EntryMismatch> TGAAC_Verify(fs::path const& installFolder,
+                                              fs::path const& extractFolder,
+                                              fs::path const& repackFolder,
+                                              TGAAC_VerifyStats* stats = nullptr);
+
+#endif
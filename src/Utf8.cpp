@@ -0,0 +1,70 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "Utf8.hpp"
+
+char32_t DecodeUtf8(std::string_view input, size_t& pos)
+{
+    uint8_t c = input[pos];
+    size_t length = c < 0x80   ? 1
+                    : c < 0xC2 ? 0
+                    : c < 0xE0 ? 2
+                    : c < 0xF0 ? 3
+                    : c < 0xF5 ? 4
+                               : 0;
+    if (length == 0 || length > input.size() - pos)
+    {
+        ++pos;
+        return 0xDC00 | c;
+    }
+
+    char32_t codepoint = length == 1 ? c : c & (0x7F >> length);
+    for (size_t i = 1; i < length; ++i)
+    {
+        uint8_t next = input[pos + i];
+        if ((next & 0xC0) != 0x80)
+        {
+            ++pos;
+            return 0xDC00 | c;
+        }
+        codepoint = (codepoint << 6) | (next & 0x3F);
+    }
+
+    // Reject overlong encodings, surrogates and out-of-range codepoints.
+    constexpr char32_t minCodepoint[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (codepoint < minCodepoint[length] || (codepoint >= 0xD800 && codepoint < 0xE000) ||
+        codepoint > 0x10FFFF)
+    {
+        ++pos;
+        return 0xDC00 | c;
+    }
+
+    pos += length;
+    return codepoint;
+}
+
+void EncodeUtf8(char32_t codepoint, std::string& output)
+{
+    if (codepoint < 0x80)
+    {
+        output += char(codepoint);
+    }
+    else if (codepoint < 0x800)
+    {
+        output += char(0xC0 | (codepoint >> 6));
+        output += char(0x80 | (codepoint & 0x3F));
+    }
+    else if (codepoint < 0x10000)
+    {
+        output += char(0xE0 | (codepoint >> 12));
+        output += char(0x80 | ((codepoint >> 6) & 0x3F));
+        output += char(0x80 | (codepoint & 0x3F));
+    }
+    else
+    {
+        output += char(0xF0 | (codepoint >> 18));
+        output += char(0x80 | ((codepoint >> 12) & 0x3F));
+        output += char(0x80 | ((codepoint >> 6) & 0x3F));
+        output += char(0x80 | (codepoint & 0x3F));
+    }
+}
@@ -0,0 +1,57 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#ifndef JV_TGAAC_UTF8_HPP
+#define JV_TGAAC_UTF8_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// Decodes the codepoint at 'pos' and advances 'pos' after it.
+/// Invalid bytes are decoded one at a time as U+DC80..U+DCFF (like Python's
+/// "surrogateescape"), which cannot be produced by valid UTF-8.
+char32_t DecodeUtf8(std::string_view input, size_t& pos);
+
+/// Decodes all codepoints of 'input' like DecodeUtf8(), calling func(codepoint, pos)
+/// with the position of each one. ASCII runs are checked 16 bytes at a time.
+template <typename F>
+void ForEachCodepoint(std::string_view input, F&& func);
+
+/// Appends the UTF-8 encoding of a codepoint.
+void EncodeUtf8(char32_t codepoint, std::string& output);
+
+//
+// ==================== IMPLEMENTATION ====================
+//
+
+template <typename F>
+void ForEachCodepoint(std::string_view input, F&& func)
+{
+    size_t pos = 0;
+    while (pos < input.size())
+    {
+#if defined(__SSE2__)
+        // 16 ASCII bytes are 16 codepoints, without decoding.
+        while (pos + 16 <= input.size())
+        {
+            __m128i chunk = _mm_loadu_si128((__m128i const*)(input.data() + pos));
+            if (_mm_movemask_epi8(chunk) != 0)
+                break;
+            for (size_t end = pos + 16; pos < end; ++pos)
+                func(char32_t(input[pos]), pos);
+        }
+        if (pos >= input.size())
+            break;
+#endif
+        size_t start = pos;
+        char32_t codepoint = DecodeUtf8(input, pos);
+        func(codepoint, start);
+    }
+}
+
+#endif
@@ -2,9 +2,29 @@
 // Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
 
 #include "Utility.hpp"
+#include "Utf8.hpp"
+#include <atomic>
 #include <cctype>
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+// After windows.h, which it depends on.
+#include <psapi.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -28,6 +48,214 @@ std::string ConvertToID(std::string_view input)
     return output;
 }
 
+static thread_local bool t_isParallelWorker = false;
+
+bool IsParallelWorker() noexcept
+{
+    return t_isParallelWorker;
+}
+
+void ParallelFor(size_t count, std::function<void(size_t)> const& func,
+                 unsigned nbThreads)
+{
+    if (nbThreads == 0)
+        nbThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (t_isParallelWorker)
+        nbThreads = 1;
+    nbThreads = std::min<size_t>(nbThreads, count);
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    auto funcWorker = [&] {
+        // Restored for the calling thread, which is a worker too.
+        bool wasParallelWorker = t_isParallelWorker;
+        t_isParallelWorker = wasParallelWorker || nbThreads > 1;
+        for (size_t i; (i = next++) < count;)
+        {
+            try
+            {
+                func(i);
+            }
+            catch (...)
+            {
+                std::lock_guard lock{errorMutex};
+                if (!error)
+                    error = std::current_exception();
+                next = count; // Stops the other workers.
+            }
+        }
+        t_isParallelWorker = wasParallelWorker;
+    };
+
+    std::vector<std::jthread> threads;
+    for (unsigned t = 1; t < nbThreads; ++t)
+        threads.emplace_back(funcWorker);
+    funcWorker();
+    threads.clear();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+int64_t PeakMemoryUsage()
+{
+#ifdef _WIN32
+    // The K32 variant is in kernel32, so psapi.lib is not needed.
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!::K32GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return int64_t(counters.PeakWorkingSetSize);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return int64_t(usage.ru_maxrss) * 1024; // In kilobytes on Linux.
+#endif
+}
+
+void AppendJsonString(std::string& output, std::string_view str)
+{
+    output += '"';
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"': output += "\\\""; break;
+        case '\\': output += "\\\\"; break;
+        case '\n': output += "\\n"; break;
+        case '\r': output += "\\r"; break;
+        case '\t': output += "\\t"; break;
+        default:
+            if (uint8_t(c) < 0x20)
+                fmt::format_to(std::back_inserter(output), "\\u{:04x}", int(c));
+            else
+                output += c;
+        }
+    }
+    output += '"';
+}
+
+std::string ParseJsonString(std::string_view input, size_t& pos)
+{
+    if (pos >= input.size() || input[pos] != '"')
+        throw ::runtime_error("Expected JSON string at {}", pos);
+
+    auto funcParseHex = [&](size_t at) {
+        if (at + 4 > input.size())
+            throw ::runtime_error("Truncated JSON escape at {}", at);
+        uint32_t value = 0;
+        for (unsigned char c : input.substr(at, 4))
+        {
+            int digit = isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10);
+            if (!isxdigit(c))
+                throw ::runtime_error("Bad JSON escape at {}", at);
+            value = value * 16 + digit;
+        }
+        return value;
+    };
+
+    std::string result;
+    for (++pos; pos < input.size(); ++pos)
+    {
+        char c = input[pos];
+        if (c == '"')
+        {
+            ++pos;
+            return result;
+        }
+        if (c != '\\')
+        {
+            result += c;
+            continue;
+        }
+        if (++pos >= input.size())
+            break;
+        switch (input[pos])
+        {
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'n': result += '\n'; break;
+        case 'r': result += '\r'; break;
+        case 't': result += '\t'; break;
+        case 'u': {
+            char32_t codepoint = funcParseHex(pos + 1);
+            pos += 4;
+            // Surrogate pair
+            if (codepoint >= 0xD800 && codepoint < 0xDC00 &&
+                input.substr(pos + 1).starts_with("\\u"))
+            {
+                char32_t low = funcParseHex(pos + 3);
+                if (low >= 0xDC00 && low < 0xE000)
+                {
+                    codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                }
+            }
+            EncodeUtf8(codepoint, result);
+            break;
+        }
+        default: result += input[pos]; break;
+        }
+    }
+    throw ::runtime_error("Unterminated JSON string");
+}
+
+std::vector<std::pair<std::string, std::string>> ParseJsonObject(std::string_view input,
+                                                                 size_t& pos)
+{
+    auto funcSkipSpaces = [&] {
+        while (pos < input.size() && isspace((unsigned char)input[pos]))
+            ++pos;
+    };
+    auto funcExpect = [&](char c) {
+        funcSkipSpaces();
+        if (pos >= input.size() || input[pos] != c)
+            throw ::runtime_error("Expected '{}' at {} in JSON", c, pos);
+        ++pos;
+    };
+    auto funcTryTake = [&](char c) {
+        funcSkipSpaces();
+        if (pos < input.size() && input[pos] == c)
+        {
+            ++pos;
+            return true;
+        }
+        return false;
+    };
+
+    std::vector<std::pair<std::string, std::string>> members;
+    funcExpect('{');
+    if (funcTryTake('}'))
+        return members;
+    do
+    {
+        funcSkipSpaces();
+        auto& [key, value] = members.emplace_back();
+        key = ParseJsonString(input, pos);
+        funcExpect(':');
+        funcSkipSpaces();
+        if (pos < input.size() && input[pos] == '"')
+        {
+            value = ParseJsonString(input, pos);
+            continue;
+        }
+        size_t begin = pos;
+        // Bytes of UTF-8 sequences are negative chars, undefined for isalnum().
+        auto funcIsValueChar = [](unsigned char c) {
+            return isalnum(c) || c == '+' || c == '-' || c == '.';
+        };
+        while (pos < input.size() && funcIsValueChar(input[pos]))
+            ++pos;
+        if (pos == begin)
+            throw ::runtime_error("Expected JSON value at {}", pos);
+        value = input.substr(begin, pos - begin);
+    } while (funcTryTake(','));
+    funcExpect('}');
+    return members;
+}
+
 stream_ptr::stream_ptr(fs::path const& p, std::ios::openmode mode)
     : unique_ptr{make_unique<filebuf>()}, m_name{p.filename()}
 {
@@ -83,6 +311,322 @@ std::string stream_ptr::ReadAll()
     return result;
 }
 
+int64_t stream_ptr::Size()
+{
+    int64_t originalPos = SeekInput(0, std::ios::cur);
+    int64_t fileSize = SeekInput(0, std::ios::end);
+    SeekInput(originalPos, std::ios::beg);
+    return fileSize;
+}
+
+std::string_view stream_ptr::ReadView(int64_t size)
+{
+    m_scratch.resize(size);
+    Read(std::span{m_scratch});
+    return m_scratch;
+}
+
+/// Converts a (offset, seekdir) pair to an absolute position, within [0, size].
+static int64_t ResolveSeek(int64_t off, std::ios::seekdir seekdir, int64_t cur,
+                           int64_t size)
+{
+    int64_t pos = off;
+    if (seekdir == std::ios::cur)
+        pos += cur;
+    else if (seekdir == std::ios::end)
+        pos += size;
+    return (pos < 0 || pos > size) ? -1 : pos;
+}
+
+span_reader::span_reader(std::string name, std::string_view bytes)
+    : byte_stream{std::move(name)}, m_begin{bytes.data()}, m_cur{bytes.data()},
+      m_end{bytes.data() + bytes.size()}
+{
+}
+
+int64_t span_reader::SeekInput(int64_t off, std::ios::seekdir seekdir)
+{
+    int64_t pos = ResolveSeek(off, seekdir, m_cur - m_begin, Size());
+    if (pos < 0)
+        Error("Could not seek at {}", off);
+    m_cur = m_begin + pos;
+    return pos;
+}
+
+std::string span_reader::ReadCStr()
+{
+    char const* end = (char const*)memchr(m_cur, '\0', m_end - m_cur);
+    std::string str{m_cur, end ? end : m_end};
+    m_cur = end ? end + 1 : m_end;
+    return str;
+}
+
+std::string span_reader::ReadAll()
+{
+    return {m_begin, m_end};
+}
+
+std::FILE* OpenFile(fs::path const& p, bool write)
+{
+#ifdef _WIN32
+    return ::_wfopen(p.c_str(), write ? L"wb" : L"rb");
+#else
+    return std::fopen(p.c_str(), write ? "wb" : "rb");
+#endif
+}
+
+file_reader::file_reader(fs::path const& p)
+    : byte_stream{p.filename()}, m_file{OpenFile(p, false), &std::fclose}
+{
+    if (!m_file)
+        Error("Could not open file: {}", strerror(errno));
+    std::fseek(m_file.get(), 0, SEEK_END);
+    m_size = std::ftell(m_file.get());
+    std::fseek(m_file.get(), 0, SEEK_SET);
+}
+
+int64_t file_reader::SeekInput(int64_t off, std::ios::seekdir seekdir)
+{
+    int64_t pos = ResolveSeek(off, seekdir, std::ftell(m_file.get()), m_size);
+    if (pos < 0 || std::fseek(m_file.get(), pos, SEEK_SET) != 0)
+        Error("Could not seek at {}", off);
+    return pos;
+}
+
+std::string_view file_reader::ReadView(int64_t size)
+{
+    if (size < 0)
+        Error("Could not read {} bytes", size);
+    m_scratch.resize(size);
+    Read(std::span{m_scratch});
+    return m_scratch;
+}
+
+std::string file_reader::ReadCStr()
+{
+    std::string str;
+    while (true)
+    {
+        int c = std::getc(m_file.get());
+        if (c == '\0' || c == EOF)
+            return str;
+        str.push_back(c);
+    }
+}
+
+std::string file_reader::ReadAll()
+{
+    std::string result;
+    int64_t originalPos = SeekInput(0, std::ios::cur);
+    result.resize(m_size);
+    SeekInput(0, std::ios::beg);
+    Read(std::span{result});
+    SeekInput(originalPos, std::ios::beg);
+    return result;
+}
+
+bool file_reader::ReadLine(std::string& line)
+{
+    line.clear();
+    char buffer[4096];
+    while (std::fgets(buffer, sizeof(buffer), m_file.get()))
+    {
+        size_t length = strlen(buffer);
+        if (length > 0 && buffer[length - 1] == '\n')
+        {
+            line.append(buffer, length - 1);
+            return true;
+        }
+        line.append(buffer, length);
+    }
+    return !line.empty();
+}
+
+span_writer::span_writer(std::string name, std::span<char> bytes)
+    : byte_stream{std::move(name)}, m_begin{bytes.data()}, m_cur{bytes.data()},
+      m_end{bytes.data() + bytes.size()}
+{
+}
+
+int64_t span_writer::SeekOutput(int64_t off, std::ios::seekdir seekdir)
+{
+    int64_t pos = ResolveSeek(off, seekdir, m_cur - m_begin, m_end - m_begin);
+    if (pos < 0)
+        Error("Could not seek at {}", off);
+    m_cur = m_begin + pos;
+    return pos;
+}
+
+file_writer::file_writer(fs::path const& p)
+    : byte_stream{p.filename()}, m_file{OpenFile(p, true), &std::fclose}
+{
+    if (!m_file)
+        Error("Could not open file: {}", strerror(errno));
+}
+
+int64_t file_writer::SeekOutput(int64_t off, std::ios::seekdir seekdir)
+{
+    int whence = seekdir == std::ios::beg ? SEEK_SET
+                 : seekdir == std::ios::cur ? SEEK_CUR
+                                            : SEEK_END;
+    if (std::fseek(m_file.get(), off, whence) != 0)
+        Error("Could not seek at {}", off);
+    return std::ftell(m_file.get());
+}
+
+void file_writer::Sync()
+{
+    std::fflush(m_file.get());
+}
+
+mapped_file::mapped_file(fs::path const& p) : byte_stream{p.filename()}
+{
+#ifdef _WIN32
+    HANDLE file = ::CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        Error("Could not open file: Windows error {}", ::GetLastError());
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(file, &size))
+        m_size = size.QuadPart;
+    DWORD error = 0;
+    if (m_size > 0)
+    {
+        HANDLE mapping =
+            ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        m_data = mapping ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!m_data)
+            error = ::GetLastError();
+        if (mapping)
+            ::CloseHandle(mapping); // The view keeps the mapping alive.
+    }
+    ::CloseHandle(file);
+    if (error != 0)
+        Error("Could not map file: Windows error {}", error);
+#else
+    int fd = ::open(p.c_str(), O_RDONLY);
+    if (fd < 0)
+        Error("Could not open file: {}", strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) == 0)
+        m_size = st.st_size;
+    if (m_size > 0)
+        m_data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m_data == MAP_FAILED)
+        Error("Could not map file: {}", strerror(errno));
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+    if (m_data)
+        ::UnmapViewOfFile(m_data);
+#else
+    if (m_data)
+        ::munmap(m_data, m_size);
+#endif
+}
+
+#ifdef _WIN32
+
+shared_file::shared_file(fs::path p) : m_path{std::move(p)}
+{
+    // Shared for deletion too, so that the file can be replaced while it is open.
+    m_handle = ::CreateFileW(m_path.c_str(), GENERIC_READ,
+                             FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_handle == INVALID_HANDLE_VALUE)
+        throw ::runtime_error("Could not open {}: Windows error {}", m_path.string(),
+                              ::GetLastError());
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(m_handle, &size))
+    {
+        DWORD error = ::GetLastError();
+        ::CloseHandle(m_handle);
+        throw ::runtime_error("Could not stat {}: Windows error {}", m_path.string(),
+                              error);
+    }
+    m_size = size.QuadPart;
+}
+
+shared_file::~shared_file()
+{
+    ::CloseHandle(m_handle);
+}
+
+std::string shared_file::ReadAt(int64_t offset, size_t size) const
+{
+    std::string result(size, '\0');
+    for (size_t nbRead = 0; nbRead < size;)
+    {
+        // The offset is given to each call, the position of the handle is not used.
+        OVERLAPPED overlapped{};
+        uint64_t position = offset + nbRead;
+        overlapped.Offset = DWORD(position);
+        overlapped.OffsetHigh = DWORD(position >> 32);
+        DWORD toRead = DWORD(std::min<size_t>(size - nbRead, 1 << 30));
+        DWORD n = 0;
+        if (!::ReadFile(m_handle, result.data() + nbRead, toRead, &n, &overlapped))
+        {
+            DWORD error = ::GetLastError();
+            if (error != ERROR_HANDLE_EOF)
+                throw ::runtime_error("Could not read {}: Windows error {}",
+                                      m_path.string(), error);
+        }
+        if (n == 0)
+            throw ::runtime_error("{}: unexpected end of file at {}", m_path.string(),
+                                  position);
+        nbRead += n;
+    }
+    return result;
+}
+
+#else
+
+shared_file::shared_file(fs::path p) : m_path{std::move(p)}
+{
+    m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        throw ::runtime_error("Could not open {}: {}", m_path.string(), strerror(errno));
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0)
+    {
+        int error = errno;
+        ::close(m_fd);
+        throw ::runtime_error("Could not stat {}: {}", m_path.string(), strerror(error));
+    }
+    m_size = st.st_size;
+}
+
+shared_file::~shared_file()
+{
+    ::close(m_fd);
+}
+
+std::string shared_file::ReadAt(int64_t offset, size_t size) const
+{
+    std::string result(size, '\0');
+    for (size_t nbRead = 0; nbRead < size;)
+    {
+        ssize_t n =
+            ::pread(m_fd, result.data() + nbRead, size - nbRead, offset + nbRead);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw ::runtime_error("Could not read {}: {}", m_path.string(),
+                                  strerror(errno));
+        if (n == 0)
+            throw ::runtime_error("{}: unexpected end of file at {}", m_path.string(),
+                                  offset + nbRead);
+        nbRead += n;
+    }
+    return result;
+}
+
+#endif
+
 void CreateEmptyDirectory(fs::path const& folder)
 {
     if (!fs::exists(folder))
@@ -6,7 +6,9 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <filesystem>
+#include <functional>
 #include <memory>
 #include <span>
 #include <stdexcept>
@@ -14,7 +16,7 @@
 #include <string>
 #include <string_view>
 #include <type_traits>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <fmt/format.h>
@@ -53,11 +55,185 @@ class stream_ptr : public std::unique_ptr<std::streambuf>
     std::string ReadCStr();
     std::string ReadAll();
 
+    int64_t Size();
+    /// Reads 'size' bytes, the view is valid until the next call to ReadView().
+    std::string_view ReadView(int64_t size);
+
+    /// Concise unconditional throw.
+    template <typename S, typename... TArgs>
+    [[noreturn]] void Error(S const& format, TArgs const&... args);
+
+  private:
+    std::string m_scratch;
+};
+
+/// Common part of the non-virtual readers and writers below.
+/// The ARC and GMD codecs are templated on them, to avoid the virtual calls
+/// of std::streambuf on hot paths.
+class byte_stream
+{
+    std::string m_name;
+
+  public:
+    explicit byte_stream(std::string name) : m_name{std::move(name)} {}
+    std::string_view Name() const noexcept { return m_name; }
+
     /// Concise unconditional throw.
     template <typename S, typename... TArgs>
     [[noreturn]] void Error(S const& format, TArgs const&... args);
 };
 
+/// Reader over bytes already in memory, which must outlive the reader.
+/// Bounds are checked once per call, so that bulk reads are pointer arithmetic.
+class span_reader : public byte_stream
+{
+    char const* m_begin;
+    char const* m_cur;
+    char const* m_end;
+
+  public:
+    span_reader(std::string name, std::string_view bytes);
+
+    int64_t Size() const noexcept { return m_end - m_begin; }
+    int64_t SeekInput(int64_t off, std::ios::seekdir);
+
+    template <typename T>
+    void Read(std::span<T> out);
+    /// Reads 'size' bytes without copy, the view is valid as long as the bytes.
+    std::string_view ReadView(int64_t size);
+
+    std::string ReadCStr();
+    std::string ReadAll();
+};
+
+/// Buffered reader over a file, without virtual calls.
+class file_reader : public byte_stream
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> m_file;
+    std::string m_scratch;
+    int64_t m_size;
+
+  public:
+    explicit file_reader(fs::path const& p);
+
+    int64_t Size() const noexcept { return m_size; }
+    int64_t SeekInput(int64_t off, std::ios::seekdir);
+
+    template <typename T>
+    void Read(std::span<T> out);
+    /// Reads 'size' bytes, the view is valid until the next call to ReadView().
+    std::string_view ReadView(int64_t size);
+
+    std::string ReadCStr();
+    std::string ReadAll();
+    /// Reads until '\n' (excluded). Returns false at the end of the file.
+    bool ReadLine(std::string& line);
+};
+
+/// Writer into a preallocated buffer, which must outlive the writer.
+class span_writer : public byte_stream
+{
+    char* m_begin;
+    char* m_cur;
+    char* m_end;
+
+  public:
+    span_writer(std::string name, std::span<char> bytes);
+
+    int64_t SeekOutput(int64_t off, std::ios::seekdir);
+
+    template <typename T>
+    void Write(std::span<T> in);
+};
+
+/// Buffered writer into a file, without virtual calls.
+class file_writer : public byte_stream
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> m_file;
+
+  public:
+    explicit file_writer(fs::path const& p);
+
+    int64_t SeekOutput(int64_t off, std::ios::seekdir);
+
+    template <typename T>
+    void Write(std::span<T> in);
+
+    void Sync();
+};
+
+/// fopen() with a wide path on Windows, where a narrow one cannot name every file.
+std::FILE* OpenFile(fs::path const& p, bool write);
+
+/// Writes to a temporary file renamed once func(out) returns, removed if it throws,
+/// so that an interrupted run never leaves a partial 'outFile'.
+template <typename F>
+void WriteThenRename(fs::path const& outFile, F&& func);
+
+/// Read-only memory mapping of a whole file.
+class mapped_file : public byte_stream
+{
+    void* m_data = nullptr;
+    size_t m_size = 0;
+
+  public:
+    explicit mapped_file(fs::path const& p);
+    ~mapped_file();
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+
+    std::string_view Bytes() const noexcept { return {(char const*)m_data, m_size}; }
+};
+
+/// File read at given offsets with pread(), or ReadFile() with an offset on Windows,
+/// without a shared position, so that several threads can read it at once.
+class shared_file
+{
+    fs::path m_path;
+#ifdef _WIN32
+    void* m_handle = nullptr; ///< HANDLE, without including windows.h.
+#else
+    int m_fd = -1;
+#endif
+    int64_t m_size = 0;
+
+  public:
+    explicit shared_file(fs::path p);
+    ~shared_file();
+    shared_file(shared_file const&) = delete;
+    shared_file& operator=(shared_file const&) = delete;
+
+    fs::path const& Path() const noexcept { return m_path; }
+    int64_t Size() const noexcept { return m_size; }
+
+    /// Throws if the file is shorter than offset + size.
+    std::string ReadAt(int64_t offset, size_t size) const;
+};
+
+/// Appends a JSON string literal (with quotes). Non-ASCII bytes are kept as-is.
+void AppendJsonString(std::string& output, std::string_view str);
+
+/// Parses the JSON string literal starting at 'pos' (on the opening quote),
+/// and advances 'pos' after the closing quote.
+std::string ParseJsonString(std::string_view input, size_t& pos);
+
+/// Parses the flat JSON object starting at 'pos' (leading spaces allowed), whose values
+/// are strings or numbers (kept as text), and advances 'pos' after the closing brace.
+std::vector<std::pair<std::string, std::string>> ParseJsonObject(std::string_view input,
+                                                                 size_t& pos);
+
+/// Calls func(i) for each i in [0, count) on 'nbThreads' threads (0 for all cores),
+/// including the calling one. The first exception thrown is rethrown.
+/// Nested calls from a worker run on that worker alone, as the cores are already busy.
+void ParallelFor(size_t count, std::function<void(size_t)> const& func,
+                 unsigned nbThreads = 0);
+
+/// Whether the calling thread is a worker of a ParallelFor() on several threads.
+bool IsParallelWorker() noexcept;
+
+/// Peak resident memory of the process so far, in bytes.
+int64_t PeakMemoryUsage();
+
 /// Removes directory separators and whitespaces.
 std::string ConvertToID(std::string_view input);
 
@@ -97,4 +273,77 @@ template <typename S, typename... TArgs>
 {
     throw runtime_error(fmt::format("{{}}: {}", format), m_name, args...);
 }
+
+template <typename S, typename... TArgs>
+[[noreturn]] void byte_stream::Error(S const& format, TArgs const&... args)
+{
+    throw runtime_error(fmt::format("{{}}: {}", format), m_name, args...);
+}
+
+template <typename T>
+void span_reader::Read(std::span<T> out)
+{
+    static_assert(std::is_trivial_v<T>);
+    if (out.size_bytes() > size_t(m_end - m_cur))
+        Error("Could not read {} bytes", out.size_bytes());
+    memcpy(out.data(), m_cur, out.size_bytes());
+    m_cur += out.size_bytes();
+}
+
+inline std::string_view span_reader::ReadView(int64_t size)
+{
+    if (size < 0 || size > m_end - m_cur)
+        Error("Could not read {} bytes", size);
+    return {std::exchange(m_cur, m_cur + size), size_t(size)};
+}
+
+template <typename T>
+void file_reader::Read(std::span<T> out)
+{
+    static_assert(std::is_trivial_v<T>);
+    if (std::fread(out.data(), 1, out.size_bytes(), m_file.get()) != out.size_bytes())
+        Error("Could not read {} bytes", out.size_bytes());
+}
+
+template <typename T>
+void span_writer::Write(std::span<T> in)
+{
+    static_assert(std::is_trivial_v<T>);
+    if (in.size_bytes() > size_t(m_end - m_cur))
+        Error("Could not write {} bytes", in.size_bytes());
+    memcpy(m_cur, in.data(), in.size_bytes());
+    m_cur += in.size_bytes();
+}
+
+template <typename T>
+void file_writer::Write(std::span<T> in)
+{
+    static_assert(std::is_trivial_v<T>);
+    if (std::fwrite(in.data(), 1, in.size_bytes(), m_file.get()) != in.size_bytes())
+        Error("Could not write {} bytes", in.size_bytes());
+}
+
+template <typename F>
+void WriteThenRename(fs::path const& outFile, F&& func)
+{
+    fs::path tmpFile = outFile;
+    tmpFile += ".tmp";
+    if (outFile.has_parent_path())
+        fs::create_directories(outFile.parent_path());
+    try
+    {
+        {
+            file_writer out{tmpFile};
+            func(out);
+            out.Sync();
+        }
+        fs::rename(tmpFile, outFile);
+    }
+    catch (...)
+    {
+        std::error_code ignored;
+        fs::remove(tmpFile, ignored);
+        throw;
+    }
+}
 #endif
\ No newline at end of file
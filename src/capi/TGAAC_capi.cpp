@@ -0,0 +1,256 @@
+// TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+// Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
+
+#include "TGAAC_capi.h"
+#include "../TGAAC_file_ARC.hpp"
+#include "../TGAAC_file_GMD.hpp"
+#include <unordered_map>
+
+struct TGAAC_Gmd
+{
+    GMD_Registry gmd;
+    std::unordered_map<std::string_view, uint32_t> byKey;
+    bool modified = false;
+};
+
+/// Decompressed entries of all the opened ARC files.
+static entry_cache s_entryCache{64 << 20};
+
+struct TGAAC_Arc
+{
+    ARC_SharedArchive shared;
+    std::span<ARC_TocEntry const> toc;
+    std::vector<std::unique_ptr<TGAAC_Gmd>> gmds; ///< By entry index, parsed on demand.
+
+    explicit TGAAC_Arc(fs::path const& path) : shared{path, &s_entryCache}
+    {
+        toc = shared.TOC();
+        gmds.resize(toc.size());
+    }
+};
+
+static thread_local std::string t_lastError;
+
+/// Exceptions must not cross the C interface.
+template <typename F>
+static TGAAC_Status Guard(F&& func) noexcept
+{
+    try
+    {
+        return func();
+    }
+    catch (std::exception const& e)
+    {
+        t_lastError = e.what();
+    }
+    catch (...)
+    {
+        t_lastError = "Unknown error";
+    }
+    return TGAAC_ERROR;
+}
+
+static TGAAC_Status CopyOut(std::string_view bytes, void* buffer, size_t capacity,
+                            size_t* size)
+{
+    *size = bytes.size();
+    if (capacity < bytes.size())
+        return TGAAC_BUFFER_TOO_SMALL;
+    if (!bytes.empty())
+        memcpy(buffer, bytes.data(), bytes.size());
+    return TGAAC_OK;
+}
+
+uint32_t TGAAC_ApiVersion(void)
+{
+    return TGAAC_API_VERSION;
+}
+
+const char* TGAAC_LastError(void)
+{
+    return t_lastError.c_str();
+}
+
+TGAAC_Status TGAAC_ArcOpen(const char* path, TGAAC_Arc** arc)
+{
+    return Guard([&] {
+        *arc = new TGAAC_Arc{path};
+        return TGAAC_OK;
+    });
+}
+
+void TGAAC_ArcClose(TGAAC_Arc* arc)
+{
+    delete arc;
+}
+
+uint32_t TGAAC_ArcEntryCount(const TGAAC_Arc* arc)
+{
+    return arc->toc.size();
+}
+
+TGAAC_Status TGAAC_ArcEntryInfo(const TGAAC_Arc* arc, uint32_t index,
+                                TGAAC_EntryInfo* info)
+{
+    if (index >= arc->toc.size())
+        return TGAAC_NOT_FOUND;
+    ARC_TocEntry const& tocEntry = arc->toc[index];
+    info->name = tocEntry.filename.c_str();
+    info->ext = (uint32_t)tocEntry.ext;
+    info->compSize = tocEntry.compSize;
+    info->decompSize = tocEntry.decompSize;
+    info->isCompressed = tocEntry.isCompressed;
+    return TGAAC_OK;
+}
+
+TGAAC_Status TGAAC_ArcReadEntry(TGAAC_Arc* arc, uint32_t index, void* buffer,
+                                size_t capacity, size_t* size)
+{
+    if (index >= arc->toc.size())
+        return TGAAC_NOT_FOUND;
+    ARC_TocEntry const& tocEntry = arc->toc[index];
+
+    // The size is known without reading the entry.
+    if (capacity < tocEntry.decompSize)
+    {
+        *size = tocEntry.decompSize;
+        return TGAAC_BUFFER_TOO_SMALL;
+    }
+    return Guard([&] {
+        return CopyOut(*arc->shared.LoadContent(index), buffer, capacity, size);
+    });
+}
+
+TGAAC_Status TGAAC_ArcGetGmd(TGAAC_Arc* arc, uint32_t index, TGAAC_Gmd** gmd)
+{
+    if (index >= arc->toc.size() || arc->toc[index].ext != ARC_ExtensionHash::GMD)
+        return TGAAC_NOT_FOUND;
+
+    return Guard([&] {
+        std::unique_ptr<TGAAC_Gmd>& loaded = arc->gmds[index];
+        if (!loaded)
+        {
+            entry_cache::value gmdBytes = arc->shared.LoadContent(index);
+            span_reader gmdStream{arc->toc[index].filename, *gmdBytes};
+
+            auto parsed = std::make_unique<TGAAC_Gmd>();
+            parsed->gmd.Load(gmdStream);
+            for (uint32_t i = 0; i < parsed->gmd.entries.size(); ++i)
+                parsed->byKey.emplace(parsed->gmd.entries[i].key, i);
+            loaded = std::move(parsed);
+        }
+        *gmd = loaded.get();
+        return TGAAC_OK;
+    });
+}
+
+TGAAC_Status TGAAC_ArcSave(TGAAC_Arc* arc, const char* path)
+{
+    return Guard([&] {
+        // Only the modified GMD entries are kept in memory, compressed like repack with
+        // the parameters of their original bytes. The others are copied one at a time.
+        std::vector<ARC_TocEntry> toc(arc->toc.begin(), arc->toc.end());
+        std::unordered_map<size_t, std::string> modifiedContents;
+        for (size_t i = 0; i < toc.size(); ++i)
+        {
+            TGAAC_Gmd const* gmd = arc->gmds[i].get();
+            if (!gmd || !gmd->modified)
+                continue;
+            std::string gmdBytes = gmd->gmd.Save();
+            std::string content;
+            if (toc[i].isCompressed)
+            {
+                ARC_Entry original = arc->shared.LoadEntry(i);
+                ARC_DeflateParams params =
+                    ARC_Entry::DetectDeflateParams(*arc->shared.LoadContent(i),
+                                                   original.content)
+                        .value_or(ARC_DeflateParams{});
+                content = ARC_Entry::Compress(gmdBytes, params);
+            }
+            else
+                content = gmdBytes;
+            toc[i].compSize = content.size();
+            toc[i].decompSize = gmdBytes.size();
+            modifiedContents.emplace(i, std::move(content));
+        }
+
+        ARC_Archive header;
+        header.version = arc->shared.Version();
+        header.hasExtendedNames = arc->shared.HasExtendedNames();
+
+        // The opened ARC file stays readable until it is closed.
+        fs::path tmpFile = path;
+        tmpFile += ".tmp";
+        {
+            file_writer out{tmpFile};
+            header.SaveTOC(out, std::span<ARC_TocEntry const>{toc});
+            for (size_t i = 0; i < toc.size(); ++i)
+            {
+                if (auto it = modifiedContents.find(i); it != modifiedContents.end())
+                    out.Write(std::span{it->second});
+                else
+                {
+                    ARC_Entry entry = arc->shared.LoadEntry(i);
+                    out.Write(std::span{entry.content});
+                }
+            }
+            out.Sync();
+        }
+        fs::rename(tmpFile, path);
+        return TGAAC_OK;
+    });
+}
+
+void TGAAC_CacheStats(uint64_t* hits, uint64_t* misses)
+{
+    *hits = s_entryCache.Hits();
+    *misses = s_entryCache.Misses();
+}
+
+uint32_t TGAAC_GmdLanguage(const TGAAC_Gmd* gmd)
+{
+    return gmd->gmd.language;
+}
+
+uint32_t TGAAC_GmdLineCount(const TGAAC_Gmd* gmd)
+{
+    return gmd->gmd.entries.size();
+}
+
+TGAAC_Status TGAAC_GmdFindLine(const TGAAC_Gmd* gmd, const char* key, size_t keySize,
+                               uint32_t* index)
+{
+    auto it = gmd->byKey.find(std::string_view{key, keySize});
+    if (it == gmd->byKey.end())
+        return TGAAC_NOT_FOUND;
+    *index = it->second;
+    return TGAAC_OK;
+}
+
+TGAAC_Status TGAAC_GmdGetKey(const TGAAC_Gmd* gmd, uint32_t index, char* buffer,
+                             size_t capacity, size_t* size)
+{
+    if (index >= gmd->gmd.entries.size())
+        return TGAAC_NOT_FOUND;
+    return CopyOut(gmd->gmd.entries[index].key, buffer, capacity, size);
+}
+
+TGAAC_Status TGAAC_GmdGetValue(const TGAAC_Gmd* gmd, uint32_t index, char* buffer,
+                               size_t capacity, size_t* size)
+{
+    if (index >= gmd->gmd.entries.size())
+        return TGAAC_NOT_FOUND;
+    return CopyOut(gmd->gmd.entries[index].value, buffer, capacity, size);
+}
+
+TGAAC_Status TGAAC_GmdSetValue(TGAAC_Gmd* gmd, uint32_t index, const char* value,
+                               size_t valueSize)
+{
+    if (index >= gmd->gmd.entries.size())
+        return TGAAC_NOT_FOUND;
+    return Guard([&] {
+        gmd->gmd.entries[index].value.assign(value, valueSize);
+        gmd->modified = true;
+        return TGAAC_OK;
+    });
+}
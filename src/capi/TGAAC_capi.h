@@ -0,0 +1,99 @@
+/* TGAAC_jv_patcher : Extract and modify scripts of The Great Ace Attorney Chronicles.
+ * Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later */
+
+#ifndef JV_TGAAC_CAPI_H
+#define JV_TGAAC_CAPI_H
+
+/* This file is the C interface of the shared library TGAAC_jv_patcher_c, for bindings
+ * from other languages. Archives and GMD entries are opaque handles, and their content
+ * is only read when asked for.
+ *
+ * Bytes and UTF-8 strings are copied into buffers provided by the caller, without NUL
+ * terminator. '*size' always receives the full size: if 'capacity' is too small,
+ * nothing is copied and TGAAC_BUFFER_TOO_SMALL is returned, so the call can be done
+ * again with a large enough buffer (or first with a NULL buffer and a 0 capacity).
+ *
+ * Handles are not thread-safe, but different handles can be used by different threads,
+ * and TGAAC_ArcReadEntry() can be called by several threads with the same handle.
+ * Decompressed entries are kept in a cache of 64 MiB shared by all the handles.
+ * When a function fails, TGAAC_LastError() describes the error of the calling thread. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(TGAAC_CAPI_BUILD)
+#define TGAAC_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define TGAAC_API __declspec(dllimport)
+#else
+#define TGAAC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented when the functions or structures change. */
+#define TGAAC_API_VERSION 2
+
+typedef enum TGAAC_Status
+{
+    TGAAC_OK = 0,
+    TGAAC_ERROR = 1,            /* See TGAAC_LastError(). */
+    TGAAC_BUFFER_TOO_SMALL = 2, /* '*size' has the required capacity. */
+    TGAAC_NOT_FOUND = 3         /* Index out of range, unknown key or not a GMD entry. */
+} TGAAC_Status;
+
+/* An opened ARC file, of which only the table of content is loaded. */
+typedef struct TGAAC_Arc TGAAC_Arc;
+/* A GMD entry of an ARC file, owned by its TGAAC_Arc. */
+typedef struct TGAAC_Gmd TGAAC_Gmd;
+
+typedef struct TGAAC_EntryInfo
+{
+    const char* name; /* NUL-terminated, valid until TGAAC_ArcClose(). */
+    uint32_t ext;     /* Extension hash, 0x242BB29A for GMD entries. */
+    uint32_t compSize;
+    uint32_t decompSize;
+    int32_t isCompressed;
+} TGAAC_EntryInfo;
+
+TGAAC_API uint32_t TGAAC_ApiVersion(void);
+/* Valid until the next failing call of the same thread. */
+TGAAC_API const char* TGAAC_LastError(void);
+
+TGAAC_API TGAAC_Status TGAAC_ArcOpen(const char* path, TGAAC_Arc** arc);
+TGAAC_API void TGAAC_ArcClose(TGAAC_Arc* arc);
+
+TGAAC_API uint32_t TGAAC_ArcEntryCount(const TGAAC_Arc* arc);
+TGAAC_API TGAAC_Status TGAAC_ArcEntryInfo(const TGAAC_Arc* arc, uint32_t index,
+                                          TGAAC_EntryInfo* info);
+/* Reads and decompresses a single entry, or copies it from the cache. */
+TGAAC_API TGAAC_Status TGAAC_ArcReadEntry(TGAAC_Arc* arc, uint32_t index, void* buffer,
+                                          size_t capacity, size_t* size);
+/* Parses a GMD entry on first call, the same handle is returned afterwards. */
+TGAAC_API TGAAC_Status TGAAC_ArcGetGmd(TGAAC_Arc* arc, uint32_t index, TGAAC_Gmd** gmd);
+/* Writes the ARC file with the lines modified by TGAAC_GmdSetValue(). Modified GMD
+ * entries are compressed with the parameters of their original bytes, and the other
+ * entries are copied one at a time.
+ * 'path' can be the opened ARC file, which is replaced once completely written. */
+TGAAC_API TGAAC_Status TGAAC_ArcSave(TGAAC_Arc* arc, const char* path);
+/* Number of entry reads found in the cache, and of the ones decompressed. */
+TGAAC_API void TGAAC_CacheStats(uint64_t* hits, uint64_t* misses);
+
+TGAAC_API uint32_t TGAAC_GmdLanguage(const TGAAC_Gmd* gmd);
+TGAAC_API uint32_t TGAAC_GmdLineCount(const TGAAC_Gmd* gmd);
+TGAAC_API TGAAC_Status TGAAC_GmdFindLine(const TGAAC_Gmd* gmd, const char* key,
+                                         size_t keySize, uint32_t* index);
+TGAAC_API TGAAC_Status TGAAC_GmdGetKey(const TGAAC_Gmd* gmd, uint32_t index, char* buffer,
+                                       size_t capacity, size_t* size);
+TGAAC_API TGAAC_Status TGAAC_GmdGetValue(const TGAAC_Gmd* gmd, uint32_t index,
+                                         char* buffer, size_t capacity, size_t* size);
+TGAAC_API TGAAC_Status TGAAC_GmdSetValue(TGAAC_Gmd* gmd, uint32_t index,
+                                         const char* value, size_t valueSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
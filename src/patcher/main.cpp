@@ -2,8 +2,20 @@
 // Copyright (C) 2023 Julien Vernay - Available as GNU GPL-3.0-or-later
 
 #include "../TGAAC_actions.hpp"
+#include "../TGAAC_diff.hpp"
+#include "../TGAAC_fonts.hpp"
+#include "../TGAAC_index.hpp"
+#include "../TGAAC_lines.hpp"
+#include "../TGAAC_search.hpp"
+#include "../TGAAC_server.hpp"
+#include "../TGAAC_patch.hpp"
+#include "../TGAAC_verify.hpp"
+#include "../Utf8.hpp"
 #include "../Utility.hpp"
+#include <charconv>
+#include <chrono>
 #include <filesystem>
+#include <optional>
 
 // For debugging purposes
 // fs::path const TGAAC_DIR = "~/.local/share/Steam/steamapps/common/TGAAC";
@@ -36,6 +48,287 @@ char const* LONG_LICENSE = R"(
 
 )";
 
+static void PrintUsage(char const* exe)
+{
+    fmt::print("Usage:\n"
+               "  {0} extract [<options>] <archive_folder> <extract_folder>\n"
+               "  {0} index <archive_folder> <index_file>\n"
+               "  {0} find <archive_folder> <index_file> <entry_or_label>\n"
+               "  {0} repack [<options>] <archive_folder> <extract_folder> "
+               "<output_folder>\n"
+               "  {0} search <extract_folder> <text>\n"
+               "  {0} search-update <extract_folder>\n"
+               "  {0} export <archive_folder> <lines_file>\n"
+               "  {0} import <archive_folder> <lines_file> <output_folder>\n"
+               "  {0} align <archive_folder> <table_file>\n"
+               "  {0} lint <archive_folder> <extract_folder> [<report_file>]\n"
+               "  {0} diff <old_archive_folder> <new_archive_folder> [<changeset_file>]\n"
+               "  {0} fonts <archive_folder> [<glyph_file>]\n"
+               "  {0} serve <archive_folder> <socket_path> <output_folder>\n"
+               "  {0} verify <archive_folder> <extract_folder> <repacked_folder>\n"
+               "  {0} patch-build <archive_folder> <repacked_folder> <patch_folder>\n"
+               "  {0} patch-apply <archive_folder> <patch_folder> <output_folder>\n"
+               "\n"
+               "'{0} <archive_folder> <extract_folder>' is the same as 'extract'.\n"
+               "\n"
+               "Options of extract:\n"
+               "  --dedup  Hardlink extracted files with the same content.\n"
+               "  --raw    Write lines as-is, without <LINE/> and <JV0/> escaping.\n"
+               "  --max-memory <MiB>\n"
+               "           Limit the memory of the extraction, its lines and index.\n"
+               "\n"
+               "Options of repack:\n"
+               "  --parallel-deflate\n"
+               "           Compress large entries faster on several threads, but not\n"
+               "           byte-identical to the original ARC files.\n"
+               "\n"
+               "'lines_file' is a .csv, .po or .jsonl file.\n",
+               exe);
+}
+
+static int PrintSummary(TGAAC_BatchSummary const& summary, std::string_view action)
+{
+    for (auto const& [archive, error] : summary.failures)
+        fmt::print("Failed {}: {}\n", archive, error);
+    fmt::print("{} {} ARC files ({} already done by a previous run), {} failed\n", action,
+               summary.nbDone + summary.nbResumed, summary.nbResumed,
+               summary.failures.size());
+    if (summary.failures.empty())
+        return EXIT_SUCCESS;
+    fmt::print("Run the same command again to retry the failed ARC files.\n");
+    return EXIT_FAILURE;
+}
+
+static int CommandExtract(fs::path const& archiveFolder, fs::path const& extractFolder,
+                          TGAAC_GlobalExtractOptions const& options)
+{
+    fmt::print("Decompressing {} into {}\n", archiveFolder.c_str(),
+               extractFolder.c_str());
+
+    return PrintSummary(TGAAC_GlobalExtract(archiveFolder, extractFolder, options),
+                        "Extracted");
+}
+
+static int CommandFind(fs::path const& archiveFolder, fs::path const& indexFile,
+                       std::string_view name)
+{
+    TGAAC_Index index{indexFile};
+
+    for (TGAAC_IndexEntry const& entry : index.FindEntries(name))
+        fmt::print("{}: entry {} (ext={:#x} offset={} size={}/{})\n",
+                   entry.archive.string(), entry.toc.filename, (uint32_t)entry.toc.ext,
+                   entry.toc.offset, entry.toc.compSize, entry.toc.decompSize);
+
+    for (TGAAC_IndexLabel const& label : index.FindLabel(name))
+    {
+        GMD_Entry entry = TGAAC_LoadIndexedLabel(archiveFolder, label);
+        fmt::print("{}: {} / {} = {}\n", label.entry.archive.string(),
+                   label.entry.toc.filename, entry.key, entry.value);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int CommandSearch(fs::path const& extractFolder, std::string_view text)
+{
+    auto start = std::chrono::steady_clock::now();
+    TGAAC_SearchIndex searchIndex;
+    searchIndex.Load(TGAAC_SearchIndexPath(extractFolder));
+    std::vector<TGAAC_SearchHit> hits = searchIndex.Query(text, 1000);
+    std::chrono::duration<double, std::milli> duration =
+        std::chrono::steady_clock::now() - start;
+
+    for (TGAAC_SearchHit const& hit : hits)
+        fmt::print("{} / {} / {}: {:?}\n", hit.archive, hit.gmd, hit.key, hit.value);
+    fmt::print("{} hits among {} lines in {:.3f} ms\n", hits.size(), searchIndex.Size(),
+               duration.count());
+    return EXIT_SUCCESS;
+}
+
+static int CommandImport(fs::path const& archiveFolder, fs::path const& linesFile,
+                         fs::path const& outFolder)
+{
+    TGAAC_ImportStats stats = TGAAC_ImportLines(archiveFolder, linesFile, outFolder);
+    fmt::print("Read {} lines, {} changed in {} ARC files written to {}\n", stats.nbLines,
+               stats.nbChangedLines, stats.nbChangedArchives, outFolder.string());
+    return EXIT_SUCCESS;
+}
+
+static int CommandLint(fs::path const& archiveFolder, fs::path const& extractFolder,
+                       std::optional<fs::path> const& reportFile)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<TGAAC_LintIssue> issues = TGAAC_Lint(archiveFolder, extractFolder);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    std::string report;
+    for (TGAAC_LintIssue const& issue : issues)
+        TGAAC_AppendLintIssueJSON(report, issue);
+
+    if (reportFile)
+    {
+        file_writer out{*reportFile};
+        out.Write(std::span{report});
+    }
+    else
+        fmt::print("{}", report);
+
+    fmt::print("Found {} issues in {:.2f} s\n", issues.size(), duration.count());
+    return issues.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int CommandDiff(fs::path const& oldFolder, fs::path const& newFolder,
+                       std::optional<fs::path> const& changesetFile)
+{
+    auto start = std::chrono::steady_clock::now();
+    TGAAC_DiffStats stats;
+    std::vector<TGAAC_LineChange> changes = TGAAC_Diff(oldFolder, newFolder, &stats);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    std::string changeset;
+    for (TGAAC_LineChange const& change : changes)
+        TGAAC_AppendLineChangeJSON(changeset, change);
+
+    if (changesetFile)
+    {
+        file_writer out{*changesetFile};
+        out.Write(std::span{changeset});
+    }
+    else
+        fmt::print("{}", changeset);
+
+    fmt::print("Found {} changed lines in {} ARC files in {:.2f} s "
+               "({} GMD entries unchanged, {} decompressed)\n",
+               changes.size(), stats.nbArchives, duration.count(), stats.nbSameEntries,
+               stats.nbInflatedEntries);
+    return EXIT_SUCCESS;
+}
+
+static int CommandAlign(fs::path const& archiveFolder, fs::path const& tableFile)
+{
+    using Kind = TGAAC_AlignIssue::Kind;
+
+    auto start = std::chrono::steady_clock::now();
+    TGAAC_AlignStats stats;
+    std::vector<TGAAC_AlignIssue> issues =
+        TGAAC_ExportAlignedLines(archiveFolder, tableFile, &stats);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    for (TGAAC_AlignIssue const& issue : issues)
+    {
+        fmt::print("{} / {} in language {}: ", issue.gmd, issue.key, issue.language);
+        switch (issue.kind)
+        {
+        case Kind::Missing:
+            fmt::print("missing\n");
+            break;
+        case Kind::Reordered:
+            fmt::print("reordered in {}\n", issue.archive);
+            break;
+        case Kind::Duplicate:
+            fmt::print("duplicate in {}\n", issue.archive);
+            break;
+        }
+    }
+
+    fmt::print("Aligned {} lines of {} GMD in {} languages to {} in {:.2f} s: "
+               "{} issues\n",
+               stats.nbRows, stats.nbRegistries, stats.nbLanguages, tableFile.string(),
+               duration.count(), issues.size());
+    return EXIT_SUCCESS;
+}
+
+static int CommandFonts(fs::path const& archiveFolder,
+                        std::optional<fs::path> const& glyphFile)
+{
+    auto start = std::chrono::steady_clock::now();
+    TGAAC_FontCoverage coverage = TGAAC_AnalyzeFontCoverage(archiveFolder);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    std::set<char32_t> glyphs;
+    if (glyphFile)
+        glyphs = TGAAC_LoadGlyphList(*glyphFile);
+
+    auto funcToUtf8 = [](char32_t codepoint) {
+        std::string str;
+        EncodeUtf8(codepoint, str);
+        return str;
+    };
+
+    size_t nbMissing = 0;
+    for (auto const& [language, histogram] : coverage.histograms)
+    {
+        uint64_t nbChars = 0;
+        for (auto [codepoint, count] : histogram)
+            nbChars += count;
+        fmt::print("Language {}: {} characters, {} distinct codepoints\n", language,
+                   nbChars, histogram.size());
+
+        if (!glyphFile)
+        {
+            // Usable as a glyph list.
+            std::string codepoints;
+            for (auto [codepoint, count] : histogram)
+                EncodeUtf8(codepoint, codepoints);
+            fmt::print("  {}\n", codepoints);
+            continue;
+        }
+
+        std::vector<char32_t> missing = TGAAC_MissingGlyphs(histogram, glyphs);
+        nbMissing += missing.size();
+        for (char32_t codepoint : missing)
+            fmt::print("  Missing U+{:04X} '{}' used {} times\n", uint32_t(codepoint),
+                       funcToUtf8(codepoint), histogram.at(codepoint));
+    }
+
+    for (TGAAC_InvalidUtf8 const& invalid : coverage.invalidUtf8)
+        fmt::print("Invalid UTF-8 byte 0x{:02X} in {} / {} / {} at {}\n", invalid.byte,
+                   invalid.archive, invalid.gmd, invalid.key, invalid.offset);
+
+    fmt::print("Analyzed in {:.2f} s: {} missing glyphs, {} invalid UTF-8 bytes\n",
+               duration.count(), nbMissing, coverage.invalidUtf8.size());
+    return nbMissing == 0 && coverage.invalidUtf8.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int CommandVerify(fs::path const& archiveFolder, fs::path const& extractFolder,
+                         fs::path const& repackFolder)
+{
+    using Kind = TGAAC_EntryMismatch::Kind;
+
+    auto start = std::chrono::steady_clock::now();
+    TGAAC_VerifyStats stats;
+    std::vector<TGAAC_EntryMismatch> mismatches =
+        TGAAC_Verify(archiveFolder, extractFolder, repackFolder, &stats);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    size_t nbDifferent = 0;
+    for (TGAAC_EntryMismatch const& mismatch : mismatches)
+    {
+        fmt::print("{} / {}: ", mismatch.archive, mismatch.entry);
+        switch (mismatch.kind)
+        {
+        case Kind::Missing:
+            fmt::print("missing\n");
+            break;
+        case Kind::Added:
+            fmt::print("added\n");
+            break;
+        case Kind::Recompressed:
+            fmt::print("same content, compressed differently\n");
+            continue;
+        case Kind::Modified:
+            fmt::print("modified, first difference at 0x{:X}\n", mismatch.offset);
+            break;
+        }
+        ++nbDifferent;
+    }
+
+    fmt::print("Verified {} ARC files in {:.2f} s: {} identical, {} different entries "
+               "({} ARC files not repacked)\n",
+               stats.nbArchives, duration.count(), stats.nbIdentical, nbDifferent,
+               stats.nbSkipped);
+    return nbDifferent == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char** argv)
 {
     if (argc == 2 && strcmp(argv[1], "--license") == 0)
@@ -46,19 +339,114 @@ int main(int argc, char** argv)
 
     fmt::print("{}", SHORT_LICENSE);
 
-    if (argc != 3)
-    {
-        fmt::print("Usage: {} <archive_folder> <extract_folder>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+    std::string_view command = args.empty() ? "" : args[0];
 
-    fs::path archiveFolder = argv[1];
-    fs::path extractFolder = argv[2];
+    TGAAC_GlobalExtractOptions extractOptions;
+    auto funcTakeFlag = [&](std::string_view flag) {
+        auto it = std::ranges::find(args, flag);
+        if (it == args.end())
+            return false;
+        args.erase(it);
+        return true;
+    };
+    extractOptions.dedup = funcTakeFlag("--dedup");
+    extractOptions.escapeJV = !funcTakeFlag("--raw");
+    bool parallelDeflate = funcTakeFlag("--parallel-deflate");
 
-    fmt::print("Decompressing {} into {}", archiveFolder.c_str(), extractFolder.c_str());
+    auto funcTakeOption = [&](std::string_view option) {
+        std::optional<std::string_view> value;
+        auto it = std::ranges::find(args, option);
+        if (it == args.end() || it + 1 == args.end())
+            return value;
+        value = *(it + 1);
+        args.erase(it, it + 2);
+        return value;
+    };
+    if (auto maxMemory = funcTakeOption("--max-memory"))
+    {
+        int64_t mebibytes = 0;
+        char const* last = maxMemory->data() + maxMemory->size();
+        auto [end, error] = std::from_chars(maxMemory->data(), last, mebibytes);
+        if (error != std::errc{} || end != last ||
+            mebibytes <= 0 || mebibytes > (INT64_MAX >> 20))
+        {
+            fmt::print("Error: --max-memory expects a positive number of MiB, not '{}'\n",
+                       *maxMemory);
+            PrintUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        extractOptions.maxMemory = mebibytes << 20;
+    }
 
-    fs::remove_all(extractFolder);
-    TGAAC_GlobalExtract(archiveFolder, extractFolder);
+    try
+    {
+        if (command == "extract" && args.size() == 3)
+            return CommandExtract(args[1], args[2], extractOptions);
+        if (command == "index" && args.size() == 3)
+        {
+            TGAAC_BuildIndex(args[1], args[2]);
+            return EXIT_SUCCESS;
+        }
+        if (command == "repack" && args.size() == 4)
+            return PrintSummary(
+                TGAAC_GlobalRepack(args[1], args[2], args[3], parallelDeflate),
+                "Repacked");
+        if (command == "find" && args.size() == 4)
+            return CommandFind(args[1], args[2], args[3]);
+        if (command == "search" && args.size() == 3)
+            return CommandSearch(args[1], args[2]);
+        if (command == "search-update" && args.size() == 2)
+        {
+            size_t nbChanged = TGAAC_UpdateSearchIndex(args[1]);
+            fmt::print("Updated {} lines in the search index\n", nbChanged);
+            return EXIT_SUCCESS;
+        }
+        if (command == "export" && args.size() == 3)
+        {
+            size_t nbLines = TGAAC_ExportLines(args[1], args[2]);
+            fmt::print("Exported {} lines to {}\n", nbLines, args[2]);
+            return EXIT_SUCCESS;
+        }
+        if (command == "import" && args.size() == 4)
+            return CommandImport(args[1], args[2], args[3]);
+        if (command == "align" && args.size() == 3)
+            return CommandAlign(args[1], args[2]);
+        if (command == "lint" && (args.size() == 3 || args.size() == 4))
+            return CommandLint(args[1], args[2],
+                               args.size() == 4 ? std::optional<fs::path>{args[3]}
+                                                : std::nullopt);
+        if (command == "diff" && (args.size() == 3 || args.size() == 4))
+            return CommandDiff(args[1], args[2],
+                               args.size() == 4 ? std::optional<fs::path>{args[3]}
+                                                : std::nullopt);
+        if (command == "fonts" && (args.size() == 2 || args.size() == 3))
+            return CommandFonts(args[1], args.size() == 3
+                                             ? std::optional<fs::path>{args[2]}
+                                             : std::nullopt);
+        if (command == "verify" && args.size() == 4)
+            return CommandVerify(args[1], args[2], args[3]);
+        if (command == "patch-build" && args.size() == 4)
+            return PrintSummary(TGAAC_GlobalBuildPatch(args[1], args[2], args[3]),
+                                "Compared");
+        if (command == "patch-apply" && args.size() == 4)
+            return PrintSummary(TGAAC_GlobalApplyPatch(args[1], args[2], args[3]),
+                                "Patched");
+        if (command == "serve" && args.size() == 4)
+        {
+            TGAAC_PatchSession session{args[1], args[3]};
+            TGAAC_Serve(session, args[2]);
+            return EXIT_SUCCESS;
+        }
+        if (args.size() == 2 && fs::is_directory(args[0]))
+            return CommandExtract(args[0], args[1], extractOptions);
+    }
+    catch (std::exception const& e)
+    {
+        fmt::print("Error: {}\n", e.what());
+        return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
 }
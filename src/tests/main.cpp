@@ -4,7 +4,9 @@
 #include "../TGAAC_actions.hpp"
 #include "../TGAAC_file_ARC.hpp"
 #include "../TGAAC_file_GMD.hpp"
+#include "../TGAAC_patch.hpp"
 #include "../Utility.hpp"
+#include "../capi/TGAAC_capi.h"
 #include <bits/ranges_util.h>
 #include <filesystem>
 
@@ -69,8 +71,11 @@ struct TestCase
     }
 };
 
-void test_ARC_Archive(TestCase& T, stream_ptr& arcStream);
-void test_GMD_Archive(TestCase& T, stream_ptr& gmdStream);
+void test_ARC_Archive(TestCase& T, file_reader& arcStream);
+void test_ARC_SharedArchive(TestCase& T, fs::path const& arcPath);
+void test_CAPI(TestCase& T, fs::path const& arcPath);
+void test_Patch(TestCase& T, fs::path const& originalArc, fs::path const& patchedArc);
+void test_GMD_Archive(TestCase& T, span_reader& gmdStream);
 
 int main(int argc, char** argv)
 {
@@ -88,8 +93,10 @@ int main(int argc, char** argv)
             continue;
         try
         {
-            stream_ptr arcStream{p};
+            file_reader arcStream{p};
             test_ARC_Archive(T, arcStream);
+            test_ARC_SharedArchive(T, p);
+            test_CAPI(T, p);
         }
         catch (TestCase&)
         {
@@ -102,7 +109,7 @@ int main(int argc, char** argv)
     return EXIT_SUCCESS;
 }
 
-void test_ARC_Archive(TestCase& T, stream_ptr& arcStream)
+void test_ARC_Archive(TestCase& T, file_reader& arcStream)
 {
     ARC_Archive arc;
     arc.Load(arcStream);
@@ -129,7 +136,7 @@ void test_ARC_Archive(TestCase& T, stream_ptr& arcStream)
         {
             fmt::print("Testing {} / {}...\n", arcStream.Name(), entry.filename);
             std::string gmdBytes = ARC_Entry::Decompress(entry.content, entry.decompSize);
-            stream_ptr gmdStream{entry.filename, gmdBytes};
+            span_reader gmdStream{entry.filename, gmdBytes};
             test_GMD_Archive(T, gmdStream);
 
             if (entry.isCompressed)
@@ -139,10 +146,38 @@ void test_ARC_Archive(TestCase& T, stream_ptr& arcStream)
                 std::span before{(uint8_t*)entry.content.data(), entry.content.size()};
                 std::span after{(uint8_t*)gmdComp.data(), gmdComp.size()};
                 T.CheckMismatch(before, after);
+
+                // Same with the detected parameters, which repack relies on
+                std::optional<ARC_DeflateParams> params =
+                    ARC_Entry::DetectDeflateParams(gmdBytes, entry.content);
+                if (T.Check(params.has_value(), "No deflate parameters found for {}\n",
+                            entry.filename))
+                {
+                    std::string detected = ARC_Entry::Compress(gmdBytes, *params);
+                    T.CheckMismatch(before, std::span{(uint8_t*)detected.data(),
+                                                      detected.size()});
+                }
             }
         }
     }
 
+    // Check that CompressParallel() is valid deflate, on GMD bytes repeated over
+    // several blocks, so that each block is primed with the window before it
+
+    std::string gmdAll;
+    for (ARC_Entry const& entry : arc.entries)
+        if (entry.ext == ARC_ExtensionHash::GMD)
+            gmdAll += ARC_Entry::Decompress(entry.content, entry.decompSize);
+    if (!gmdAll.empty())
+    {
+        std::string large;
+        while (large.size() < 2 * ARC_Entry::PARALLEL_DEFLATE_MIN_SIZE)
+            large += gmdAll;
+        std::string compressed = ARC_Entry::CompressParallel(large);
+        T.Check(ARC_Entry::Decompress(compressed, large.size()) == large,
+                "CompressParallel() round trip differs for {}\n", arcStream.Name());
+    }
+
     // Check WriteFolder/ReadFolder for supported folders
 
     auto funcUnsupportedFormat = [](ARC_Entry const& entry) {
@@ -159,7 +194,129 @@ void test_ARC_Archive(TestCase& T, stream_ptr& arcStream)
     T.Check(arc == arc2, "ARC WriteFolder() and ReadFolder() are not symmetrical");
 }
 
-void test_GMD_Archive(TestCase& T, stream_ptr& gmdStream)
+void test_ARC_SharedArchive(TestCase& T, fs::path const& arcPath)
+{
+    file_reader arcStream{arcPath};
+    ARC_Archive arc;
+    arc.Load(arcStream);
+
+    // Each entry is read twice concurrently, and decompressed only once:
+    // a single shard holds all of them, so none is evicted
+    int64_t totalBytes = 0;
+    for (ARC_Entry const& entry : arc.entries)
+        totalBytes += entry.decompSize;
+    entry_cache cache{totalBytes, 1};
+    ARC_SharedArchive shared{arcPath, &cache};
+    size_t nbEntries = arc.entries.size();
+    std::vector<entry_cache::value> contents(2 * nbEntries);
+    ParallelFor(contents.size(), [&](size_t i) {
+        contents[i] = shared.LoadContent(i % nbEntries);
+    });
+
+    for (size_t i = 0; i < contents.size(); ++i)
+    {
+        ARC_Entry const& entry = arc.entries[i % nbEntries];
+        std::string expected =
+            entry.isCompressed ? ARC_Entry::Decompress(entry.content, entry.decompSize)
+                               : entry.content;
+        T.Check(*contents[i] == expected, "Shared read of {} differs\n", entry.filename);
+    }
+    T.Check(cache.Misses() == nbEntries && cache.Hits() == nbEntries,
+            "Shared reads: {} misses and {} hits for {} entries\n", cache.Misses(),
+            cache.Hits(), nbEntries);
+}
+
+void test_CAPI(TestCase& T, fs::path const& arcPath)
+{
+    // Round trip of a line through the C interface: modified, saved, read back,
+    // then restored, which must give the original bytes again
+
+    std::string arcFile = arcPath.string();
+    fs::path savedFile = fs::temp_directory_path() / "test-tmp-capi.arc";
+    std::string savedPath = savedFile.string();
+    TGAAC_Arc* arc = nullptr;
+    T.Require(TGAAC_ArcOpen(arcFile.c_str(), &arc) == TGAAC_OK, "C API open: {}\n",
+              TGAAC_LastError());
+    std::unique_ptr<TGAAC_Arc, void (*)(TGAAC_Arc*)> arcGuard{arc, TGAAC_ArcClose};
+
+    TGAAC_Gmd* gmd = nullptr;
+    uint32_t gmdIndex = 0;
+    while (gmdIndex < TGAAC_ArcEntryCount(arc) &&
+           (TGAAC_ArcGetGmd(arc, gmdIndex, &gmd) != TGAAC_OK ||
+            TGAAC_GmdLineCount(gmd) == 0))
+        ++gmdIndex;
+    if (gmdIndex == TGAAC_ArcEntryCount(arc))
+        return;
+
+    size_t size = 0;
+    T.Require(TGAAC_GmdGetValue(gmd, 0, nullptr, 0, &size) != TGAAC_ERROR,
+              "C API value size: {}\n", TGAAC_LastError());
+    std::string original(size, '\0');
+    T.Require(TGAAC_GmdGetValue(gmd, 0, original.data(), size, &size) == TGAAC_OK,
+              "C API value: {}\n", TGAAC_LastError());
+
+    std::string edited = original + "<PAGE>";
+    TGAAC_GmdSetValue(gmd, 0, edited.data(), edited.size());
+    T.Require(TGAAC_ArcSave(arc, savedPath.c_str()) == TGAAC_OK, "C API save: {}\n",
+              TGAAC_LastError());
+
+    TGAAC_Arc* saved = nullptr;
+    T.Require(TGAAC_ArcOpen(savedPath.c_str(), &saved) == TGAAC_OK,
+              "C API open saved: {}\n", TGAAC_LastError());
+    std::unique_ptr<TGAAC_Arc, void (*)(TGAAC_Arc*)> savedGuard{saved, TGAAC_ArcClose};
+    TGAAC_Gmd* savedGmd = nullptr;
+    std::string value(edited.size(), '\0');
+    T.Check(TGAAC_ArcGetGmd(saved, gmdIndex, &savedGmd) == TGAAC_OK &&
+                TGAAC_GmdGetValue(savedGmd, 0, value.data(), value.size(), &size) ==
+                    TGAAC_OK &&
+                value == edited,
+            "C API saved line differs in {}\n", arcFile);
+    test_Patch(T, arcPath, savedFile);
+
+    TGAAC_GmdSetValue(gmd, 0, original.data(), original.size());
+    T.Require(TGAAC_ArcSave(arc, savedPath.c_str()) == TGAAC_OK, "C API save: {}\n",
+              TGAAC_LastError());
+    std::string before = file_reader{arcFile}.ReadAll();
+    std::string after = file_reader{savedFile}.ReadAll();
+    T.CheckMismatch(std::span{(uint8_t const*)before.data(), before.size()},
+                    std::span{(uint8_t const*)after.data(), after.size()});
+
+    savedGuard.reset();
+    fs::remove(savedFile);
+}
+
+void test_Patch(TestCase& T, fs::path const& originalArc, fs::path const& patchedArc)
+{
+    // Build then apply a patch, to a new file then in place, where applying it again
+    // must detect that the ARC file is already patched
+
+    fs::path tmpFolder = fs::temp_directory_path();
+    fs::path patchFile = tmpFolder / "test-tmp.jvpatch";
+    fs::path outArc = tmpFolder / "test-tmp-patched.arc";
+    std::string expected = file_reader{patchedArc}.ReadAll();
+    auto funcCheckOutput = [&] {
+        std::string output = file_reader{outArc}.ReadAll();
+        T.CheckMismatch(std::span{(uint8_t const*)expected.data(), expected.size()},
+                        std::span{(uint8_t const*)output.data(), output.size()});
+    };
+
+    TGAAC_PatchStats stats = TGAAC_BuildPatch(originalArc, patchedArc, patchFile);
+    T.Require(!stats.identical && stats.nbReplaced > 0, "Empty patch for {}\n",
+              patchedArc.string());
+    T.Check(TGAAC_ApplyPatch(originalArc, patchFile, outArc), "Patch not applied\n");
+    funcCheckOutput();
+
+    fs::copy_file(originalArc, outArc, fs::copy_options::overwrite_existing);
+    T.Check(TGAAC_ApplyPatch(outArc, patchFile, outArc), "Patch not applied in place\n");
+    funcCheckOutput();
+    T.Check(!TGAAC_ApplyPatch(outArc, patchFile, outArc), "Patch applied twice\n");
+    funcCheckOutput();
+
+    fs::remove(patchFile);
+    fs::remove(outArc);
+}
+
+void test_GMD_Archive(TestCase& T, span_reader& gmdStream)
 {
     std::string inputStorage = gmdStream.ReadAll();
     std::span<uint8_t> inputBytes{(uint8_t*)inputStorage.data(), inputStorage.size()};
@@ -175,10 +332,24 @@ void test_GMD_Archive(TestCase& T, stream_ptr& gmdStream)
 
     T.Check(gmd == gmd2, "GMD WriteFolder() and ReadFolder() are not symmetrical");
 
-    stream_ptr gmdOut{fmt::format("out--{}", gmdStream.Name()), std::string{}};
-    gmd.Save(gmdOut);
-    std::string_view view = dynamic_cast<std::stringbuf&>(*gmdOut.get()).view();
-    std::span<uint8_t> outputBytes{(uint8_t*)view.data(), view.size()};
+    for (GMD_Entry const& entry : gmd.entries)
+        T.Check(GMD_UnescapeEntryJV(GMD_EscapeEntryJV(entry.value)) == entry.value,
+                "GMD escaping of {} is not reversible\n", entry.key);
+
+    bool isRejected = false;
+    try
+    {
+        GMD_UnescapeEntryJV("<JV99/>");
+    }
+    catch (std::exception const&)
+    {
+        isRejected = true;
+    }
+    T.Check(isRejected, "GMD unescaping kept an abbreviation not in the trailer\n");
+
+    std::string outputStorage = gmd.Save();
+    T.Check(outputStorage.size() == gmd.ComputeSize(), "GMD ComputeSize() mismatch\n");
+    std::span<uint8_t> outputBytes{(uint8_t*)outputStorage.data(), outputStorage.size()};
 
     T.CheckMismatch(inputBytes, outputBytes);
 }
\ No newline at end of file